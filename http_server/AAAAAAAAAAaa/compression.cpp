@@ -0,0 +1,121 @@
+#include <zlib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+#include <unordered_map>
+
+#define COMPRESSION_LEVEL       6       // zlib level, 1 fastest to 9 smallest
+#define COMPRESSION_MIN_BYTES   256     // smaller bodies are sent as they are, the framing would eat the gain
+#define COMPRESSION_OUT_CHUNK   16384
+
+enum class ContentCoding
+{
+    IDENTITY,
+    GZIP,
+    DEFLATE     // HTTP deflate is the zlib format, not raw deflate
+};
+
+static const char *coding_name(ContentCoding coding)
+{
+    return coding == ContentCoding::GZIP ? "gzip" : coding == ContentCoding::DEFLATE ? "deflate" : "identity";
+}
+
+// Text formats from the mime_types map and their relatives, images other than SVG are compressed already
+static bool compressible(const std::string& mime_type)
+{
+    std::string type = mime_type.substr(0, mime_type.find(';'));
+    return type.compare(0, 5, "text/") == 0 || type == "application/javascript" || type == "application/json" ||
+           type == "application/xml" || type == "image/svg+xml" || type == "application/x-httpd-php";
+}
+
+// Accept-Encoding with q-values (RFC 9110 12.5.3). gzip wins a tie with deflate, q=0 refuses a coding
+// and * stands for every coding not listed
+static ContentCoding negotiate_coding(const std::unordered_map<std::string, std::string>& headers)
+{
+    const std::string *accept = nullptr;
+    for (const auto& header : headers)
+    {
+        if (strcasecmp(header.first.c_str(), "Accept-Encoding") == 0) accept = &header.second;
+    }
+    if (!accept) return ContentCoding::IDENTITY;
+
+    double gzip = -1, deflate = -1, any = -1;
+    size_t pos = 0;
+    while (pos < accept->size())
+    {
+        size_t comma = accept->find(',', pos);
+        std::string item = accept->substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        pos = comma == std::string::npos ? accept->size() : comma + 1;
+
+        size_t semicolon = item.find(';');
+        std::string name = item.substr(0, semicolon);
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        double q = 1;
+        if (semicolon != std::string::npos)
+        {
+            size_t q_pos = item.find("q=", semicolon);
+            if (q_pos != std::string::npos) q = atof(item.c_str() + q_pos + 2);
+        }
+        if (strcasecmp(name.c_str(), "gzip") == 0 || strcasecmp(name.c_str(), "x-gzip") == 0) gzip = q;
+        else if (strcasecmp(name.c_str(), "deflate") == 0) deflate = q;
+        else if (name == "*") any = q;
+    }
+    if (gzip < 0) gzip = any;
+    if (deflate < 0) deflate = any;
+    if (gzip <= 0 && deflate <= 0) return ContentCoding::IDENTITY;
+    return gzip >= deflate ? ContentCoding::GZIP : ContentCoding::DEFLATE;
+}
+
+// Streaming zlib compressor, one per response. Every piece is flushed so the client can decode what
+// was sent so far, a streamed page keeps rendering as it arrives
+class StreamCompressor
+{
+public:
+    ~StreamCompressor()
+    {
+        if (active_) deflateEnd(&stream_);
+    }
+
+    bool start(ContentCoding coding, int level = COMPRESSION_LEVEL)
+    {
+        memset(&stream_, 0, sizeof(stream_));
+        int window = coding == ContentCoding::GZIP ? 15 + 16 : 15;
+        active_ = deflateInit2(&stream_, level, Z_DEFLATED, window, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        return active_;
+    }
+
+    // Appends the compressed form of data to out, the last call passes finish
+    bool compress(const char *data, size_t length, std::string& out, bool finish)
+    {
+        if (!active_) return false;
+        stream_.next_in = (Bytef*)data;
+        stream_.avail_in = length;
+        int flush = finish ? Z_FINISH : Z_SYNC_FLUSH;
+        int result;
+        do
+        {
+            size_t used = out.size();
+            out.resize(used + COMPRESSION_OUT_CHUNK);
+            stream_.next_out = (Bytef*)&out[used];
+            stream_.avail_out = COMPRESSION_OUT_CHUNK;
+            result = deflate(&stream_, flush);
+            out.resize(used + COMPRESSION_OUT_CHUNK - stream_.avail_out);
+        } while (result == Z_OK && (stream_.avail_out == 0 || stream_.avail_in > 0));
+        return result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR;
+    }
+
+private:
+    z_stream stream_;
+    bool active_ = false;
+};
+
+// Whole body at once, for static files and cached script output
+static bool compress_body(ContentCoding coding, const char *data, size_t length, std::string& out)
+{
+    StreamCompressor compressor;
+    out.clear();
+    out.reserve(length / 2 + 64);
+    return compressor.start(coding) && compressor.compress(data, length, out, true);
+}
@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+# FastCGI responder for .py pages, the stand-in for php-cgi. The server's script pool starts it with
+# the listening socket on fd 0 and restarts it after a number of requests. Scripts run inside this
+# process, their code stays compiled until the file changes. What they print goes out as FastCGI
+# stdout whenever they flush or OUTPUT_BUFFER fills, so the server can stream it on.
+import contextlib
+import io
+import os
+import socket
+import struct
+import sys
+import traceback
+
+BEGIN_REQUEST, END_REQUEST, PARAMS, STDIN, STDOUT = 1, 3, 4, 5, 6
+KEEP_CONN = 1
+RECORD_MAX = 65535
+OUTPUT_BUFFER = 8192
+
+code_cache = {}     # path -> (mtime_ns, code)
+
+
+def read_exact(conn, length):
+    data = b""
+    while len(data) < length:
+        chunk = conn.recv(length - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def read_record(conn):
+    header = read_exact(conn, 8)
+    if header is None:
+        return None
+    _, kind, request_id, length, padding, _ = struct.unpack(">BBHHBB", header)
+    content = read_exact(conn, length + padding)
+    if content is None:
+        return None
+    return kind, request_id, content[:length]
+
+
+def write_record(conn, kind, request_id, content):
+    conn.sendall(struct.pack(">BBHHBB", 1, kind, request_id, len(content), 0, 0) + content)
+
+
+class RecordWriter(io.TextIOBase):
+    """stdout and stderr of a running script, sent as FastCGI stdout records."""
+
+    def __init__(self, conn, request_id):
+        self.conn = conn
+        self.request_id = request_id
+        self.buffer = bytearray()
+
+    def writable(self):
+        return True
+
+    def write(self, text):
+        self.buffer += text.encode()
+        if len(self.buffer) >= OUTPUT_BUFFER:
+            self.flush()
+        return len(text)
+
+    def flush(self):
+        for pos in range(0, len(self.buffer), RECORD_MAX):
+            write_record(self.conn, STDOUT, self.request_id, bytes(self.buffer[pos:pos + RECORD_MAX]))
+        self.buffer.clear()
+
+
+def parse_params(data):
+    params = {}
+    pos = 0
+    while pos < len(data):
+        lengths = []
+        for _ in range(2):
+            if data[pos] < 128:
+                lengths.append(data[pos])
+                pos += 1
+            else:
+                lengths.append(struct.unpack(">I", data[pos:pos + 4])[0] & 0x7fffffff)
+                pos += 4
+        name = data[pos:pos + lengths[0]].decode("latin-1")
+        pos += lengths[0]
+        params[name] = data[pos:pos + lengths[1]].decode("latin-1")
+        pos += lengths[1]
+    return params
+
+
+def compiled(path):
+    mtime = os.stat(path).st_mtime_ns
+    entry = code_cache.get(path)
+    if entry is None or entry[0] != mtime:
+        with open(path, "rb") as source:
+            entry = (mtime, compile(source.read(), path, "exec"))
+        code_cache[path] = entry
+    return entry[1]
+
+
+def run_script(output, params, body):
+    path = params.get("SCRIPT_FILENAME", "")
+    saved_argv, saved_stdin, saved_environ = sys.argv, sys.stdin, dict(os.environ)
+    sys.argv = [path]
+    sys.stdin = io.TextIOWrapper(io.BytesIO(body))
+    os.environ.update(params)   # CGI variables, QUERY_STRING among them
+    with contextlib.redirect_stdout(output), contextlib.redirect_stderr(output):
+        try:
+            exec(compiled(path), {"__name__": "__main__", "__file__": path})
+        except SystemExit:
+            pass
+        except BaseException:
+            traceback.print_exc()
+    sys.argv, sys.stdin = saved_argv, saved_stdin
+    os.environ.clear()
+    os.environ.update(saved_environ)
+    output.flush()
+
+
+def serve(conn):
+    request_id, flags, params, body = 0, 0, b"", b""
+    while True:
+        record = read_record(conn)
+        if record is None:
+            return
+        kind, request_id, content = record
+        if kind == BEGIN_REQUEST:
+            _, flags = struct.unpack(">HB", content[:3])
+            params, body = b"", b""
+        elif kind == PARAMS:
+            params += content
+        elif kind == STDIN and content:
+            body += content
+        elif kind == STDIN:
+            run_script(RecordWriter(conn, request_id), parse_params(params), body)
+            write_record(conn, STDOUT, request_id, b"")
+            write_record(conn, END_REQUEST, request_id, struct.pack(">IB3x", 0, 0))
+            if not flags & KEEP_CONN:
+                return
+
+
+def main():
+    listener = socket.socket(fileno=0)
+    while True:
+        conn, _ = listener.accept()
+        try:
+            serve(conn)
+        except OSError:
+            pass
+        finally:
+            conn.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -8,7 +8,6 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
-#include <sys/msg.h>
 #include <fcntl.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -18,9 +17,15 @@
 #include <sys/wait.h>
 
 #include <csignal>
+#include <limits.h>
+#include <strings.h>
 
 #include "requestparser.cpp"
 #include "response.cpp"
+#include "../log_ring.cpp"
+#include "script_pool.cpp"
+#include "script_cache.cpp"
+#include "compression.cpp"
 
 #define INDEX_PATH          "www/index.html"
 #define FILE_NOT_FOUND_PATH "www/404.html"
@@ -29,26 +34,21 @@
 
 #define PORT 8080
 #define WORKER_COUNT 5
-#define LOG_QUEUE_KEY 1234
+#define LOG_RING_BYTES (1024 * 1024)
 
 std::vector<pid_t> workers;
 pid_t logger_pid;
-int msg_queue_id;
+LogRing log_ring;
+ScriptPool script_pool;
+ScriptCache script_cache;
+pid_t script_supervisor_pid;
 int server_fd;
 
 
-struct LogMessage {
-    long type;
-    char text[256];
-};
-
-void log_message(int msg_queue_id, const std::string& message) 
+// No syscall, the record is copied into the shared ring and the logger process writes it out
+void log_message(const std::string& message) 
 {
-    LogMessage log_msg;
-    log_msg.type = 1;
-    strncpy(log_msg.text, message.c_str(), sizeof(log_msg.text) - 1);
-    log_msg.text[sizeof(log_msg.text) - 1] = '\0';
-    msgsnd(msg_queue_id, &log_msg, sizeof(log_msg.text), 0);
+    log_ring.write(message);
 }
 
 
@@ -62,7 +62,6 @@ void cleanup(int signo)
     }
 
     close(server_fd);
-    msgctl(msg_queue_id, IPC_RMID, nullptr);
 
     std::cout << "Server shutdown complete." << std::endl;
     exit(0);
@@ -104,13 +103,313 @@ std::map<std::string, std::string> mime_types =
     {".sh", "text/x-shellscript"},
 };
 
-std::string execute_file(const std::string& file_path, std::string body, std::string file_extension) 
+// Interpreters kept running for the script pool, extensions without one fork and exec per request
+std::vector<ScriptPoolConfig> script_pools = 
+{
+    // File extension, FastCGI command line, interpreter processes
+    {".php", {"php-cgi"}, 4},
+    {".py", {"python3", "fcgi_runner.py"}, 4},
+};
+
+// Extensions whose GET output goes through the script cache, with how long it is reused when the
+// script sends no Cache-Control max-age. 0 only lets concurrent identical requests share one run
+std::map<std::string, uint64_t> script_cache_ttl_ms = 
+{
+    {".php", 0},
+    {".py", 0},
+};
+
+#define CGI_HEADERS_MAX 8192    // longer script output without a blank line is taken as all body
+
+// Sends script output to the client as it arrives. A CGI header block at the start is held back until
+// its blank line to fill in the status line and Content-Type, then the body goes out as one chunk per
+// read from the script. SSL_write blocks while the client is slow, the pipe or socket to the script
+// fills up and the script blocks in turn, so a slow client throttles the producer instead of the
+// output piling up here
+class ScriptStream : public ScriptOutput 
+{
+public:
+    ScriptStream(SSL* ssl, bool chunked, bool cgi_headers) 
+        : ssl_(ssl), chunked_(chunked), headers_done_(!cgi_headers) {}
+
+    bool write(const char* data, size_t length) override;
+    // Ends the body, false when the client is gone
+    bool finish();
+    // Answers with an error instead, unless part of the output went out already
+    void fail(int status, const std::string& mime_type, const std::string& body);
+    bool started() const { return started_; }
+    // Plain interpreter output, set before the first write
+    void expect_cgi_headers(bool expect) { headers_done_ = !expect; }
+    // Coding the client accepts, used when the output turns out compressible
+    void accept_coding(ContentCoding coding) { coding_ = coding; }
+
+    // Keeps a copy of the body for the script cache, given up once it grows past limit
+    void capture(size_t limit) { capture_limit_ = limit; capturing_ = true; }
+    // Whether the whole body was captured and the headers allow sharing it, and for how long
+    bool cacheable(uint64_t default_ttl_ms, uint64_t& ttl_ms) const;
+    const std::string& captured() const { return captured_; }
+    int status() const { return response_.getStatusCode(); }
+    const std::string& mime_type() const { return mime_type_; }
+    const std::string& extra_headers() const { return extra_headers_; }
+    const std::string& vary() const { return vary_; }
+
+private:
+    void parse_headers(size_t end, size_t skip);
+    bool send(const char* data, size_t length, bool last = false);
+    void start();
+
+    SSL* ssl_;
+    Response response_;
+    bool chunked_;
+    bool headers_done_;
+    bool started_ = false;
+    std::string mime_type_ = "text/plain";
+    std::string pending_;   // start of the output until the CGI header block is complete
+    std::string frame_;     // reused for the head and chunk framing
+    std::string extra_headers_;     // Vary and Cache-Control from the script, passed on as they are
+    std::string vary_;
+    std::string cache_control_;
+    std::string captured_;
+    size_t capture_limit_ = 0;
+    bool capturing_ = false;
+    bool overflowed_ = false;
+    bool encoded_ = false;      // the script set its own Content-Encoding
+    ContentCoding coding_ = ContentCoding::IDENTITY;
+    bool compressing_ = false;
+    StreamCompressor compressor_;
+    std::string compressed_;
+};
+
+void ScriptStream::parse_headers(size_t end, size_t skip) 
+{
+    std::istringstream headers(pending_.substr(0, end));
+    std::string line;
+    while (std::getline(headers, line)) 
+    {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        std::string key = line.substr(0, colon);
+        std::string value = line.substr(colon + 1);
+        while (!value.empty() && value[0] == ' ') value.erase(0, 1);
+        if (strcasecmp(key.c_str(), "Content-Type") == 0) 
+        {
+            mime_type_ = value;
+        }
+        else if (strcasecmp(key.c_str(), "Status") == 0) 
+        {
+            response_.setStatusCode(atoi(value.c_str()));
+        }
+        else if (strcasecmp(key.c_str(), "Vary") == 0) 
+        {
+            vary_ = value;
+            extra_headers_ += "Vary: " + value + "\r\n";
+        }
+        else if (strcasecmp(key.c_str(), "Cache-Control") == 0) 
+        {
+            cache_control_ = value;
+            extra_headers_ += "Cache-Control: " + value + "\r\n";
+        }
+        else if (strcasecmp(key.c_str(), "Content-Encoding") == 0) 
+        {
+            encoded_ = true;
+            extra_headers_ += "Content-Encoding: " + value + "\r\n";
+        }
+    }
+    pending_.erase(0, end + skip);
+}
+
+bool ScriptStream::cacheable(uint64_t default_ttl_ms, uint64_t& ttl_ms) const 
+{
+    if (!capturing_ || overflowed_ || status() != 200) 
+    {
+        return false;
+    }
+    if (cache_control_.find("no-store") != std::string::npos || cache_control_.find("no-cache") != std::string::npos ||
+        cache_control_.find("private") != std::string::npos) 
+    {
+        return false;
+    }
+    size_t max_age = cache_control_.find("max-age=");
+    ttl_ms = max_age == std::string::npos ? default_ttl_ms : strtoull(cache_control_.c_str() + max_age + 8, nullptr, 10) * 1000;
+    return true;
+}
+
+bool ScriptStream::write(const char* data, size_t length) 
+{
+    if (headers_done_) 
+    {
+        return send(data, length);
+    }
+
+    pending_.append(data, length);
+    size_t end = pending_.find("\r\n\r\n");
+    size_t skip = 4;
+    if (end == std::string::npos) 
+    {
+        end = pending_.find("\n\n");
+        skip = 2;
+    }
+    size_t colon = pending_.find(':');
+    size_t first_line = pending_.find('\n');
+    if (end != std::string::npos && colon < end) 
+    {
+        parse_headers(end, skip);
+    }
+    else if (end == std::string::npos && pending_.size() <= CGI_HEADERS_MAX && 
+             (first_line == std::string::npos || colon < first_line)) 
+    {
+        // Could still be a header block, wait for the rest
+        return true;
+    }
+    // Otherwise the output has no header block and all of it is body
+    headers_done_ = true;
+    std::string body;
+    body.swap(pending_);
+    return body.empty() || send(body.data(), body.size());
+}
+
+// Compression is decided before the first piece of body goes out. The total length of streamed output
+// is not known then, so COMPRESSION_MIN_BYTES does not apply, a script that flushes line by line would
+// otherwise never be compressed
+void ScriptStream::start() 
+{
+    std::string headers = extra_headers_;
+    if (compressible(mime_type_) && !encoded_) 
+    {
+        headers += "Vary: Accept-Encoding\r\n";
+        if (coding_ != ContentCoding::IDENTITY && compressor_.start(coding_)) 
+        {
+            compressing_ = true;
+            headers += std::string("Content-Encoding: ") + coding_name(coding_) + "\r\n";
+        }
+    }
+    frame_ = response_.buildStreamHead(mime_type_, chunked_, headers);
+    started_ = true;
+}
+
+bool ScriptStream::send(const char* data, size_t length, bool last) 
+{
+    if (!started_) 
+    {
+        start();
+    }
+    if (capturing_ && !overflowed_ && length > 0) 
+    {
+        if (captured_.size() + length > capture_limit_) 
+        {
+            overflowed_ = true;
+            std::string().swap(captured_);
+        }
+        else 
+        {
+            captured_.append(data, length);
+        }
+    }
+    // The cache keeps the output as the script wrote it, each hit is encoded for its own client
+    if (compressing_) 
+    {
+        compressed_.clear();
+        compressor_.compress(data, length, compressed_, last);
+        data = compressed_.data();
+        length = compressed_.size();
+    }
+    if (chunked_ && length > 0) 
+    {
+        Response::appendChunk(frame_, data, length);
+    }
+    else 
+    {
+        frame_.append(data, length);
+    }
+    bool ok = frame_.empty() || SSL_write(ssl_, frame_.data(), frame_.size()) > 0;
+    frame_.clear();
+    return ok;
+}
+
+bool ScriptStream::finish() 
+{
+    if (!headers_done_) 
+    {
+        // Output ended inside what looked like a header block, send it as it is
+        headers_done_ = true;
+        std::string body;
+        body.swap(pending_);
+        if (!body.empty() && !send(body.data(), body.size())) return false;
+    }
+    if (!started_ && !send(nullptr, 0)) 
+    {
+        return false;
+    }
+    if (compressing_ && !send(nullptr, 0, true)) 
+    {
+        return false;
+    }
+    if (!chunked_) 
+    {
+        return true;
+    }
+    Response::appendChunk(frame_, nullptr, 0);
+    bool ok = SSL_write(ssl_, frame_.data(), frame_.size()) > 0;
+    frame_.clear();
+    return ok;
+}
+
+void ScriptStream::fail(int status, const std::string& mime_type, const std::string& body) 
+{
+    // Once the head is out the error can only show as a body cut short, without the last chunk
+    if (started_) return;
+    started_ = true;
+    response_.setStatusCode(status);
+    std::string response_message = response_.buildResponse(body, mime_type);
+    SSL_write(ssl_, response_message.c_str(), response_message.length());
+}
+
+// Compresses a whole body for the client into compressed when its type and size are worth it, leaves
+// compressed empty otherwise. Returns the header lines to send with it, Vary for every compressible
+// type so caches keep the codings apart
+std::string encode_body(const HttpRequest& http_request, const std::string& mime_type, const char* data, size_t length,
+                        std::string& compressed) 
+{
+    compressed.clear();
+    if (!compressible(mime_type)) 
+    {
+        return "";
+    }
+    std::string headers = "Vary: Accept-Encoding\r\n";
+    ContentCoding coding = negotiate_coding(http_request.headers);
+    if (coding != ContentCoding::IDENTITY && length >= COMPRESSION_MIN_BYTES && 
+        compress_body(coding, data, length, compressed) && compressed.size() < length) 
+    {
+        headers += std::string("Content-Encoding: ") + coding_name(coding) + "\r\n";
+    }
+    else 
+    {
+        compressed.clear();
+    }
+    return headers;
+}
+
+std::string encode_body(const HttpRequest& http_request, const std::string& mime_type, std::string& body) 
+{
+    std::string compressed;
+    std::string headers = encode_body(http_request, mime_type, body.data(), body.size(), compressed);
+    if (!compressed.empty()) 
+    {
+        body.swap(compressed);
+    }
+    return headers;
+}
+
+// Forks and execs the interpreter, its stdout and stderr go to the output as they are read
+bool execute_file(const std::string& file_path, const std::string& file_extension, ScriptOutput& output) 
 {
     int pipe_fd[2];
     if (pipe(pipe_fd) == -1) 
     {
         perror("pipe failed");
-        log_message(msg_queue_id, "Pipe creation failed for: " + file_path);
+        log_message("Pipe creation failed for: " + file_path);
+        return false;
     }
 
     pid_t pid = fork();
@@ -121,6 +420,7 @@ std::string execute_file(const std::string& file_path, std::string body, std::st
         dup2(pipe_fd[1], STDOUT_FILENO);
         dup2(pipe_fd[1], STDERR_FILENO);
         close(pipe_fd[1]);
+        signal(SIGPIPE, SIG_DFL);
         execlp(executable_types[file_extension].c_str(), executable_types[file_extension].c_str(), file_path.c_str(), NULL);
         perror("execlp failed");
         exit(EXIT_FAILURE);
@@ -129,25 +429,159 @@ std::string execute_file(const std::string& file_path, std::string body, std::st
     {
         // parent
         close(pipe_fd[1]);
-        char buffer[1024];
+        char buffer[16384];
         ssize_t bytes_read;
-        body.clear();
+        bool ok = true;
 
-        while ((bytes_read = read(pipe_fd[0], buffer, sizeof(buffer))) > 0) 
+        while (ok && (bytes_read = read(pipe_fd[0], buffer, sizeof(buffer))) > 0) 
         {
-            body.append(buffer, bytes_read);
+            ok = output.write(buffer, bytes_read);
         }
+        // A client gone away leaves the script to die of SIGPIPE on its next write
         close(pipe_fd[0]);
         waitpid(pid, NULL, 0);
-        log_message(msg_queue_id, "File executed and output captured: " + file_path);
+        log_message("File executed and output streamed: " + file_path);
+        return ok;
     } 
     else 
     {
         // Fork failed
         perror("fork failed");
-        log_message(msg_queue_id, "Fork failed for: " + file_path);
+        log_message("Fork failed for: " + file_path);
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        return false;
+    }
+}
+
+// Runs the script on a pooled interpreter, or with execute_file when its extension has no pool, and
+// streams the output to the client. True when the script's whole output was produced
+bool run_script(const HttpRequest& http_request, const std::string& file_path, const std::string& file_extension,
+                ScriptStream& stream) 
+{
+    char absolute[PATH_MAX];
+    if (!realpath(file_path.c_str(), absolute)) 
+    {
+        snprintf(absolute, sizeof(absolute), "%s", file_path.c_str());
+    }
+    // The target is path?query, REQUEST_URI keeps both
+    size_t query = http_request.path.find('?');
+    std::vector<std::pair<std::string, std::string>> params = 
+    {
+        {"GATEWAY_INTERFACE", "CGI/1.1"},
+        {"SERVER_SOFTWARE", "ivos"},
+        {"SERVER_PROTOCOL", http_request.version},
+        {"REQUEST_METHOD", http_request.method},
+        {"REQUEST_URI", http_request.path},
+        {"SCRIPT_NAME", http_request.path.substr(0, query)},
+        {"SCRIPT_FILENAME", absolute},
+        {"QUERY_STRING", query == std::string::npos ? "" : http_request.path.substr(query + 1)},
+        {"CONTENT_LENGTH", "0"},
+        {"REDIRECT_STATUS", "200"},     // php-cgi refuses to run without it
+    };
+
+    ScriptResult result = script_pool.run(file_extension, params, "", stream);
+    if (!result.errors.empty()) 
+    {
+        log_message("Script " + file_path + " stderr: " + result.errors);
+    }
+    switch (result.status) 
+    {
+    case ScriptStatus::OK:
+        stream.finish();
+        log_message("File executed by the script pool: " + file_path);
+        return true;
+    case ScriptStatus::UNAVAILABLE:
+        log_message("No idle interpreter for: " + file_path);
+        stream.fail(503, "text/html", Response().loadFile(SERVICE_UNAVAILABLE));
+        return false;
+    case ScriptStatus::TIMEOUT:
+        log_message("Script timed out: " + file_path);
+        stream.fail(504, "text/plain", "Script timed out\n");
+        return false;
+    case ScriptStatus::FAILED:
+        log_message("Interpreter failed on: " + file_path);
+        stream.fail(500, "text/plain", "Script failed\n");
+        return false;
+    case ScriptStatus::ABORTED:
+        log_message("Client went away during: " + file_path);
+        return false;
+    case ScriptStatus::NO_POOL:
+        break;
+    }
+
+    // Plain interpreter output has no CGI headers
+    stream.expect_cgi_headers(false);
+    if (!execute_file(file_path, file_extension, stream)) 
+    {
+        stream.fail(500, "text/plain", "Script failed\n");
+        return false;
+    }
+    stream.finish();
+    return true;
+}
+
+// Identical GETs of a cached extension share one run of the script and, with a TTL, its output for a
+// while. The key is the request target, the script's Vary header adds request headers to it
+void handle_script(SSL* ssl, const HttpRequest& http_request, const std::string& file_path, const std::string& file_extension) 
+{
+    int fill = -1;
+    auto ttl = script_cache_ttl_ms.find(file_extension);
+    if (http_request.method == "GET" && ttl != script_cache_ttl_ms.end()) 
+    {
+        ScriptCacheHit hit;
+        if (script_cache.lookup(http_request.path, http_request.headers, hit, fill) == ScriptCacheLookup::HIT) 
+        {
+            Response response;
+            response.setStatusCode(hit.status);
+            std::string headers = hit.headers;
+            std::string encoded;
+            const char* body = hit.body;
+            size_t length = hit.length;
+            if (headers.find("Content-Encoding:") == std::string::npos) 
+            {
+                // Compressed straight out of the cache, otherwise sent from it as it is
+                headers += encode_body(http_request, hit.content_type, hit.body, hit.length, encoded);
+                if (!encoded.empty()) 
+                {
+                    body = encoded.data();
+                    length = encoded.size();
+                }
+            }
+            std::string head = response.buildHead(hit.content_type, length, headers);
+            if (SSL_write(ssl, head.data(), head.size()) > 0 && length > 0) 
+            {
+                SSL_write(ssl, body, length);
+            }
+            script_cache.release(hit);
+            log_message((hit.coalesced ? "Shared the run of: " : "Served from script cache: ") + file_path);
+            return;
+        }
+    }
+
+    // Chunked needs HTTP/1.1, an older client reads until the connection closes
+    ScriptStream stream(ssl, http_request.version == "HTTP/1.1", true);
+    stream.accept_coding(negotiate_coding(http_request.headers));
+    if (fill >= 0) 
+    {
+        stream.capture(SCRIPT_CACHE_ENTRY_MAX);
+    }
+    bool complete = run_script(http_request, file_path, file_extension, stream);
+    if (fill < 0) 
+    {
+        return;
+    }
+    uint64_t ttl_ms;
+    if (complete && stream.cacheable(ttl->second, ttl_ms)) 
+    {
+        script_cache.complete(fill, stream.status(), stream.mime_type(), stream.extra_headers(), stream.vary(),
+                              http_request.headers, stream.captured(), ttl_ms);
+    }
+    else 
+    {
+        // A finished run that may not be shared lets the next identical requests run in parallel
+        script_cache.abandon(fill, complete);
     }
-    return body;
 }
 
 std::string get_mime_type(const std::string& file_path) 
@@ -182,20 +616,31 @@ SSL_CTX* create_ssl_context()
 }
 
 
-void logger_process(int msg_queue_id) {
-    std::ofstream log_file(LOG_FILE, std::ios::app);
+volatile sig_atomic_t logger_stop = 0;
+
+void stop_logger(int) {
+    logger_stop = 1;
+}
+
+void logger_process() {
+    int fd = open(LOG_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
     printf("Logger process started\n");
-    if (!log_file.is_open()) {
+    if (fd < 0) {
         perror("Failed to open log file");
         exit(EXIT_FAILURE);
     }
-    while (true) {
-        LogMessage log_msg;
-        if (msgrcv(msg_queue_id, &log_msg, sizeof(log_msg.text), 1, 0) > 0) {
-            log_file << log_msg.text << std::endl;
-            log_file.flush();
-        }
+    // Drain what the workers already wrote before exiting, instead of the inherited cleanup handler
+    struct sigaction sa = {};
+    sa.sa_handler = stop_logger;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    pid_t parent = getppid();
+    while (!logger_stop && getppid() == parent) {
+        if (log_ring.drain(fd) == 0) usleep(LOG_DRAIN_IDLE_US);
     }
+    while (log_ring.drain(fd) > 0);
+    close(fd);
 }
 
 
@@ -209,13 +654,75 @@ std::string get_file_extension(const std::string& file_path)
     return "";
 }
 
-void handle_client(SSL* ssl, int msg_queue_id) 
+// Streams a POST body through the multipart parser as it is read, files land on disk part by part and
+// at most one read buffer of the body is in memory. head is the first read, request line and headers
+// and the start of the body. Returns the status code for the response
+int receive_upload(SSL* ssl, HttpRequest& http_request, const std::string& head, char* buffer, size_t buffer_size)
+{
+    size_t header_end = head.find("\r\n\r\n");
+    long long content_length = atoll(http_request.headers["Content-Length"].c_str());
+    if (header_end == std::string::npos || content_length < 0) 
+    {
+        return 400;
+    }
+    if (content_length > UPLOAD_BODY_MAX) 
+    {
+        log_message("Upload too large: " + std::to_string(content_length) + " bytes");
+        return 413;
+    }
+
+    // Anything but a form is read and dropped so the response is not sent into an unread body
+    bool multipart = http_request.boundary.size() > 2;
+    FileUploadHandler uploads;
+    MultipartParser parser(multipart ? std::string_view(http_request.boundary).substr(2) : "-", uploads);
+
+    long long received = std::min<long long>(head.size() - header_end - 4, content_length);
+    bool ok = !multipart || parser.feed(head.data() + header_end + 4, received);
+    while (ok && received < content_length) 
+    {
+        int bytes = SSL_read(ssl, buffer, std::min<long long>(buffer_size, content_length - received));
+        if (bytes <= 0) 
+        {
+            log_message("Upload cut off after " + std::to_string(received) + " bytes");
+            return 400;
+        }
+        received += bytes;
+        if (multipart) ok = parser.feed(buffer, bytes);
+    }
+
+    for (const std::string& path : uploads.saved()) 
+    {
+        log_message("File saved: " + path);
+    }
+    if (!ok) 
+    {
+        switch (parser.error()) 
+        {
+        case MultipartError::TOO_LARGE:
+            log_message("Upload part over " + std::to_string(UPLOAD_FILE_MAX) + " bytes");
+            return 413;
+        case MultipartError::SINK:
+            log_message("Failed to save upload");
+            return 500;
+        default:
+            return 400;
+        }
+    }
+    return multipart && !parser.done() ? 400 : 200;
+}
+
+void handle_client(SSL* ssl) 
 {
-    int total_size = 0;
     std::string buffer_str;
-    char buffer[50000] = {0};
+    char buffer[MULTIPART_CHUNK];
 
     int bytes = SSL_read(ssl, buffer, sizeof(buffer));
+    if (bytes <= 0) 
+    {
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        return;
+    }
     buffer_str.append(buffer, bytes);
 
     RequestParser request_parser = RequestParser(buffer_str);
@@ -224,125 +731,69 @@ void handle_client(SSL* ssl, int msg_queue_id)
 
     if (http_request.method == "POST") 
     {
-        total_size += bytes;
-        bytes = 0;
-        
-        while (total_size < std::stoi(http_request.headers["Content-Length"])) 
-        {
-            bytes = SSL_read(ssl, buffer, sizeof(buffer));
-            buffer_str.append(buffer, bytes);
-            total_size += bytes;
-            printf("bytes: %d / %d\n", bytes,total_size);
-        }
         printf("http_request.method: %s\n", http_request.method.c_str());
-
-        while (true) 
+        int status = receive_upload(ssl, http_request, buffer_str, buffer, sizeof(buffer));
+        if (status != 200) 
         {
-            // Find the boundary
-            size_t boundary_pos = buffer_str.find(http_request.boundary);
-            if (boundary_pos == std::string::npos) 
-            {
-                printf("Boundary not found\n");
-                break; // No more boundaries, exit the loop
-            }
-    
-            // Remove the boundary
-            buffer_str.erase(0, boundary_pos + http_request.boundary.length() + 2); // +2 for "\r\n"
-    
-            // Find the end of the headers
-            size_t headers_end = buffer_str.find("\r\n\r\n");
-            if (headers_end == std::string::npos) 
-            {
-                break; // Malformed data, exit the loop
-            }
-    
-            // Extract headers
-            std::string headers = buffer_str.substr(0, headers_end);
-            buffer_str.erase(0, headers_end + 4); // +4 for "\r\n\r\n"
-    
-            // Find the filename
-            size_t filename_pos = headers.find("filename=\"");
-            if (filename_pos == std::string::npos) 
-            {
-                continue; // No filename, skip this part
-            }
-            filename_pos += 10; // Move past "filename=\""
-            size_t filename_end = headers.find("\"", filename_pos);
-            if (filename_end == std::string::npos) 
-            {
-                continue; // Malformed filename, skip this part
-            }
-            std::string filename = headers.substr(filename_pos, filename_end - filename_pos);
-    
-            // Find the next boundary
-            size_t next_boundary = buffer_str.find(http_request.boundary);
-            std::string file_content;
-            if (next_boundary != std::string::npos) 
-            {
-                file_content = buffer_str.substr(0, next_boundary - 2); // -2 to remove "\r\n"
-                buffer_str.erase(0, next_boundary);
-            } 
-            else 
-            {
-                file_content = buffer_str; // Last file
-                buffer_str.clear();
-            }
-    
-            std::ofstream output_file(filename, std::ios::binary);
-            if (output_file.is_open()) 
-            {
-                output_file.write(file_content.c_str(), file_content.size());
-                output_file.close();
-                log_message(msg_queue_id, "File saved: " + filename);
-            } 
-            else 
-            {
-                log_message(msg_queue_id, "Failed to save file: " + filename);
-            }
+            Response response;
+            response.setStatusCode(status);
+            std::string response_message = response.buildResponse("Upload failed\n", "text/plain");
+            SSL_write(ssl, response_message.c_str(), response_message.length());
+            SSL_shutdown(ssl);
+            SSL_free(ssl);
+            return;
         }
     }
 
     Response response;
     std::string body;
-    std::string file_path = "www" + http_request.path;
+    // The query string only matters to scripts, files are looked up by the path before it
+    std::string target_path = http_request.path.substr(0, http_request.path.find('?'));
+    std::string file_path = "www" + target_path;
     std::string mime_type = get_mime_type(file_path);
     std::string file_extension = get_file_extension(file_path);
 
-    log_message(msg_queue_id, "Request received: " + http_request.path);
-    log_message(msg_queue_id, "File path: " + file_path);
+    log_message("Request received: " + http_request.path);
+    log_message("File path: " + file_path);
+
+    if (executable_types.count(file_extension) && response.fileExists(file_path)) 
+    {
+        log_message("Script requested: " + file_path);
+        handle_script(ssl, http_request, file_path, file_extension);
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        return;
+    }
 
     if (response.fileExists(file_path)) 
     {
         body = response.loadFile(file_path);
-        log_message(msg_queue_id, "File found: " + file_path);
+        log_message("File found: " + file_path);
     } 
     else 
     {
         body = response.loadFile(FILE_NOT_FOUND_PATH);
-        log_message(msg_queue_id, "File not found: " + http_request.path);
+        log_message("File not found: " + http_request.path);
     }
 
-    if (executable_types.count(file_extension) && response.fileExists(file_path)) 
-    {
-        mime_type = "text/plain";
-        body = execute_file(file_path, body, file_extension);
-    }
-
-    if (http_request.path == "/") 
+    if (target_path == "/") 
     {
         body = response.loadFile(INDEX_PATH);
-        log_message(msg_queue_id, "Index file requested");
+        log_message("Index file requested");
     }
     
-    std::string response_message = response.buildResponse(body, mime_type);
+    std::string extra_headers = encode_body(http_request, mime_type, body);
+    std::string response_message = response.buildResponse(body, mime_type, extra_headers);
     SSL_write(ssl, response_message.c_str(), response_message.length());
 
     SSL_shutdown(ssl);
     SSL_free(ssl);
 }
 
-void worker_process(int sock_fd, SSL_CTX* ctx, int msg_queue_id) 
+void worker_process(int sock_fd, SSL_CTX* ctx) 
 {
+    // Streamed responses write to clients that may have left, that must not kill the worker
+    signal(SIGPIPE, SIG_IGN);
     while (true) 
     {
         struct msghdr msg = {};
@@ -370,7 +821,7 @@ void worker_process(int sock_fd, SSL_CTX* ctx, int msg_queue_id)
             continue;
         }
         printf("SSL connection established\n");
-        handle_client(ssl, msg_queue_id);
+        handle_client(ssl);
     }
 }
 
@@ -381,7 +832,10 @@ int main()
     OpenSSL_add_all_algorithms();
     SSL_load_error_strings();
     SSL_CTX* ctx = create_ssl_context();
-    msg_queue_id = msgget(LOG_QUEUE_KEY, IPC_CREAT | 0666);
+    if (!log_ring.create(LOG_RING_BYTES)) 
+    {
+        exit(EXIT_FAILURE);
+    }
     
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
     struct sockaddr_in address = {AF_INET, htons(PORT), INADDR_ANY};
@@ -390,7 +844,17 @@ int main()
     
     logger_pid = fork();
     if (logger_pid == 0) {
-        logger_process(msg_queue_id);
+        logger_process();
+        exit(0);
+    }
+
+    if (!script_pool.create(script_pools) || !script_cache.create(SCRIPT_CACHE_BYTES)) 
+    {
+        exit(EXIT_FAILURE);
+    }
+    script_supervisor_pid = fork();
+    if (script_supervisor_pid == 0) {
+        script_pool.supervise();
         exit(0);
     }
     
@@ -401,7 +865,7 @@ int main()
         pid_t pid = fork();
         if (pid == 0) {
             close(worker_pipes[i][1]);
-            worker_process(worker_pipes[i][0], ctx, msg_queue_id);
+            worker_process(worker_pipes[i][0], ctx);
             exit(0);
         }
         workers.push_back(pid);
@@ -0,0 +1,391 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+
+#define MULTIPART_CHUNK         (64 * 1024)             // body bytes read from the socket at a time
+#define MULTIPART_HEADERS_MAX   8192                    // a part header block larger than this is malformed
+#define UPLOAD_BODY_MAX         (256LL * 1024 * 1024)   // Content-Length of a whole upload
+#define UPLOAD_FILE_MAX         (64LL * 1024 * 1024)    // bytes of one file part
+#define UPLOAD_DIR              ""                      // prefix of saved files, the working directory
+
+struct FormPartHeaders
+{
+    std::string name;
+    std::string filename;       // empty for a plain field
+    std::string content_type;
+};
+
+enum class MultipartError
+{
+    NONE,
+    MALFORMED,
+    TOO_LARGE,      // a part went over its limit
+    SINK            // the handler refused a part or failed to store it
+};
+
+// Receives the parts in order. data() sees each part body in the pieces it arrived in, never copied
+class MultipartHandler
+{
+public:
+    virtual ~MultipartHandler() = default;
+    virtual bool begin(const FormPartHeaders& part) = 0;
+    virtual bool data(const char *bytes, size_t length) = 0;
+    virtual bool end() = 0;
+    virtual void abort() {}
+};
+
+// Boyer-Moore-Horspool over a fixed needle, a mismatch skips by the distance of the last byte of the
+// window from the end of the needle, so the scan touches about length / needle size bytes
+class HorspoolScanner
+{
+public:
+    void reset(std::string_view needle)
+    {
+        needle_ = needle;
+        std::fill(skip_, skip_ + 256, needle_.size());
+        for (size_t i = 0; i + 1 < needle_.size(); i++) skip_[(unsigned char)needle_[i]] = needle_.size() - 1 - i;
+    }
+
+    size_t find(const char *text, size_t length) const
+    {
+        size_t n = needle_.size();
+        const char last = needle_[n - 1];
+        size_t pos = 0;
+        while (pos + n <= length)
+        {
+            char c = text[pos + n - 1];
+            if (c == last && memcmp(text + pos, needle_.data(), n - 1) == 0) return pos;
+            pos += skip_[(unsigned char)c];
+        }
+        return std::string_view::npos;
+    }
+
+    size_t size() const { return needle_.size(); }
+
+private:
+    std::string needle_;
+    size_t skip_[256];
+};
+
+// Incremental multipart/form-data parser (RFC 7578). feed() takes the body in pieces of any size, the
+// part bodies go straight to the handler and only a delimiter's worth of bytes or one part header
+// block is ever held back, so memory does not grow with the upload
+class MultipartParser
+{
+public:
+    MultipartParser(std::string_view boundary, MultipartHandler& handler, long long part_max = UPLOAD_FILE_MAX)
+        : handler_(handler), part_max_(part_max)
+    {
+        // The first delimiter may open the body, so parse as if a CRLF came before it
+        delimiter_ = "\r\n--";
+        delimiter_.append(boundary);
+        scanner_.reset(delimiter_);
+        carry_ = "\r\n";
+    }
+
+    ~MultipartParser()
+    {
+        if (in_part_) handler_.abort();
+    }
+
+    // False once the body is malformed or the handler failed, error() tells which
+    bool feed(const char *bytes, size_t length);
+
+    // The closing delimiter was seen, anything after it is ignored
+    bool done() const { return state_ == State::DONE; }
+    MultipartError error() const { return error_; }
+
+private:
+    enum class State { PREAMBLE, DELIMITER, HEADERS, BODY, DONE, FAILED };
+
+    size_t scan_body(const char *bytes, size_t length);
+    size_t scan_delimiter(const char *bytes, size_t length);
+    size_t scan_headers(const char *bytes, size_t length);
+    bool emit(const char *bytes, size_t length);
+    bool found_delimiter();
+    bool fail(MultipartError error);
+
+    MultipartHandler& handler_;
+    long long part_max_;
+    std::string delimiter_;
+    HorspoolScanner scanner_;
+    std::string carry_;         // bytes that may still belong to a delimiter or header block
+    State state_ = State::PREAMBLE;
+    MultipartError error_ = MultipartError::NONE;
+    long long part_size_ = 0;
+    bool in_part_ = false;
+};
+
+bool MultipartParser::fail(MultipartError error)
+{
+    if (in_part_) handler_.abort();
+    in_part_ = false;
+    error_ = error;
+    state_ = State::FAILED;
+    carry_.clear();
+    return false;
+}
+
+bool MultipartParser::emit(const char *bytes, size_t length)
+{
+    if (length == 0 || state_ == State::PREAMBLE) return true;
+    part_size_ += length;
+    if (part_size_ > part_max_) return fail(MultipartError::TOO_LARGE);
+    if (!handler_.data(bytes, length)) return fail(MultipartError::SINK);
+    return true;
+}
+
+bool MultipartParser::found_delimiter()
+{
+    if (state_ == State::BODY)
+    {
+        in_part_ = false;
+        if (!handler_.end()) return fail(MultipartError::SINK);
+    }
+    state_ = State::DELIMITER;
+    carry_.clear();
+    return true;
+}
+
+// Part body or preamble up to the next delimiter. The last delimiter size - 1 bytes of a piece could
+// start a delimiter that ends in the next piece, those wait in carry_
+size_t MultipartParser::scan_body(const char *bytes, size_t length)
+{
+    size_t keep = scanner_.size() - 1;
+    if (!carry_.empty())
+    {
+        // A delimiter starting in the carried bytes ends within the first keep bytes of this piece
+        size_t take = std::min(length, keep);
+        size_t carried = carry_.size();
+        carry_.append(bytes, take);
+        size_t pos = scanner_.find(carry_.data(), carry_.size());
+        if (pos != std::string_view::npos)
+        {
+            if (!emit(carry_.data(), pos)) return 0;
+            size_t consumed = pos + scanner_.size() - carried;
+            return found_delimiter() ? consumed : 0;
+        }
+        if (carry_.size() <= keep)
+        {
+            // Still too short to tell, the whole piece went into carry_
+            return length;
+        }
+        if (take < keep)
+        {
+            size_t ready = carry_.size() - keep;
+            if (!emit(carry_.data(), ready)) return 0;
+            carry_.erase(0, ready);
+            return length;
+        }
+        if (!emit(carry_.data(), carried)) return 0;
+        carry_.clear();
+    }
+
+    size_t pos = scanner_.find(bytes, length);
+    if (pos != std::string_view::npos)
+    {
+        if (!emit(bytes, pos)) return 0;
+        return found_delimiter() ? pos + scanner_.size() : 0;
+    }
+    size_t ready = length > keep ? length - keep : 0;
+    if (!emit(bytes, ready)) return 0;
+    carry_.assign(bytes + ready, length - ready);
+    return length;
+}
+
+// After a delimiter comes "--" for the last one, or optional whitespace and CRLF before the part headers
+size_t MultipartParser::scan_delimiter(const char *bytes, size_t length)
+{
+    size_t i = 0;
+    while (i < length)
+    {
+        char c = bytes[i++];
+        if (carry_ == "-")
+        {
+            if (c != '-') { fail(MultipartError::MALFORMED); return 0; }
+            state_ = State::DONE;
+            return length;
+        }
+        if (!carry_.empty() && carry_.back() == '\r')
+        {
+            if (c != '\n') { fail(MultipartError::MALFORMED); return 0; }
+            state_ = State::HEADERS;
+            carry_ = "\r\n";
+            return i;
+        }
+        bool padding = c == ' ' || c == '\t';
+        if (!(carry_.empty() && c == '-') && !padding && c != '\r') { fail(MultipartError::MALFORMED); return 0; }
+        if (carry_.size() >= 64) { fail(MultipartError::MALFORMED); return 0; }
+        carry_ += c;
+    }
+    return i;
+}
+
+static std::string_view header_param(std::string_view value, std::string_view key)
+{
+    size_t pos = 0;
+    while ((pos = value.find(key, pos)) != std::string_view::npos)
+    {
+        // Whole parameter names only, name= must not match inside filename=
+        bool start = pos == 0 || value[pos - 1] == ';' || value[pos - 1] == ' ' || value[pos - 1] == '\t';
+        pos += key.size();
+        if (!start || pos >= value.size() || value[pos] != '=') continue;
+        pos++;
+        if (pos < value.size() && value[pos] == '"')
+        {
+            size_t close = value.find('"', pos + 1);
+            if (close == std::string_view::npos) return {};
+            return value.substr(pos + 1, close - pos - 1);
+        }
+        size_t end = value.find(';', pos);
+        return value.substr(pos, end == std::string_view::npos ? end : end - pos);
+    }
+    return {};
+}
+
+// The block is held whole until its blank line, carry_ starts with the CRLF that ended the delimiter
+// line so a part without headers is found as well
+size_t MultipartParser::scan_headers(const char *bytes, size_t length)
+{
+    size_t before = carry_.size();
+    size_t search = before >= 3 ? before - 3 : 0;
+    // Never more than the limit plus the blank line, a block that long fails below
+    carry_.append(bytes, std::min(length, (size_t)MULTIPART_HEADERS_MAX + 4 - before));
+    size_t end = carry_.find("\r\n\r\n", search);
+    if (end == std::string::npos)
+    {
+        if (carry_.size() > MULTIPART_HEADERS_MAX) { fail(MultipartError::MALFORMED); return 0; }
+        return carry_.size() - before;
+    }
+
+    FormPartHeaders part;
+    std::string_view headers(carry_.data() + 2, end > 2 ? end - 2 : 0);
+    while (!headers.empty())
+    {
+        size_t eol = headers.find("\r\n");
+        std::string_view line = headers.substr(0, eol);
+        headers = eol == std::string_view::npos ? std::string_view() : headers.substr(eol + 2);
+
+        size_t colon = line.find(':');
+        if (colon == std::string_view::npos) continue;
+        std::string_view key = line.substr(0, colon);
+        std::string_view value = line.substr(colon + 1);
+        while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+
+        if (key.size() == 19 && strncasecmp(key.data(), "Content-Disposition", 19) == 0)
+        {
+            part.name = header_param(value, "name");
+            part.filename = header_param(value, "filename");
+        }
+        else if (key.size() == 12 && strncasecmp(key.data(), "Content-Type", 12) == 0)
+        {
+            part.content_type = value;
+        }
+    }
+
+    size_t consumed = end + 4 - before;
+    carry_.clear();
+    state_ = State::BODY;
+    part_size_ = 0;
+    if (!handler_.begin(part)) { fail(MultipartError::SINK); return 0; }
+    in_part_ = true;
+    return consumed;
+}
+
+bool MultipartParser::feed(const char *bytes, size_t length)
+{
+    while (length > 0)
+    {
+        size_t consumed = 0;
+        switch (state_)
+        {
+        case State::PREAMBLE:
+        case State::BODY:
+            consumed = scan_body(bytes, length);
+            break;
+        case State::DELIMITER:
+            consumed = scan_delimiter(bytes, length);
+            break;
+        case State::HEADERS:
+            consumed = scan_headers(bytes, length);
+            break;
+        case State::DONE:
+            return true;
+        case State::FAILED:
+            return false;
+        }
+        if (state_ == State::FAILED) return false;
+        bytes += consumed;
+        length -= consumed;
+    }
+    return state_ != State::FAILED;
+}
+
+// Writes every file part to UPLOAD_DIR under its own name, fields without a filename are dropped.
+// A file is written under a temporary name and renamed once its part ended, so an upload cut off or
+// over the limit leaves nothing behind
+class FileUploadHandler : public MultipartHandler
+{
+public:
+    ~FileUploadHandler() override { abort(); }
+
+    bool begin(const FormPartHeaders& part) override
+    {
+        if (part.filename.empty()) return true;
+        // Browsers send only the base name, anything with a path in it is not written outside the directory
+        std::string name = part.filename.substr(part.filename.find_last_of("/\\") + 1);
+        if (name.empty() || name == "." || name == "..") return false;
+
+        path_ = UPLOAD_DIR + name;
+        temp_path_ = path_ + ".part";
+        fd_ = open(temp_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd_ < 0) perror("open upload failed");
+        return fd_ >= 0;
+    }
+
+    bool data(const char *bytes, size_t length) override
+    {
+        while (fd_ >= 0 && length > 0)
+        {
+            ssize_t written = write(fd_, bytes, length);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) return false;
+            bytes += written;
+            length -= written;
+        }
+        return true;
+    }
+
+    bool end() override
+    {
+        if (fd_ < 0) return true;
+        bool ok = close(fd_) == 0 && rename(temp_path_.c_str(), path_.c_str()) == 0;
+        fd_ = -1;
+        if (ok) saved_.push_back(path_);
+        else unlink(temp_path_.c_str());
+        return ok;
+    }
+
+    void abort() override
+    {
+        if (fd_ < 0) return;
+        close(fd_);
+        unlink(temp_path_.c_str());
+        fd_ = -1;
+    }
+
+    const std::vector<std::string>& saved() const { return saved_; }
+
+private:
+    int fd_ = -1;
+    std::string path_;
+    std::string temp_path_;
+    std::vector<std::string> saved_;
+};
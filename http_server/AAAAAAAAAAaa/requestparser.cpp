@@ -3,6 +3,8 @@
 #include <unordered_map>
 #include <vector>
 
+#include "multipart.cpp"
+
 struct FormFile {
     std::string filename;
     std::string content_type;
@@ -45,8 +47,11 @@ HttpRequest RequestParser::parse()
     
     // Parse headers
     std::string body;
-    while (std::getline(stream, line) && !line.empty()) 
+    while (std::getline(stream, line)) 
     {
+        // getline leaves the CR of CRLF, without it the blank line never ends the headers
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) break;
         size_t colon_pos = line.find(':');
         if (colon_pos != std::string::npos) {
             std::string key = line.substr(0, colon_pos);
@@ -71,46 +76,41 @@ HttpRequest RequestParser::parse()
 }
 
 
-std::vector<FormFile> RequestParser::parse_files()
+// Keeps every part in memory, for callers that want the whole form at once. handle_client streams
+// uploads to disk with a FileUploadHandler instead
+class FormFileCollector : public MultipartHandler
 {
-    std::vector<FormFile> vector_files;
-    int boundary_len = request.boundary.length();
-    size_t pos = request_.find(request.boundary);
-    while (pos != std::string::npos) 
-    {
-        FormFile file;
-        size_t end_pos = request_.find(request.boundary, pos + boundary_len);
-        std::string file_data = request_.substr(pos, end_pos - pos);
-        
-        size_t filename_pos = file_data.find("filename=\"");
-        if (filename_pos != std::string::npos) 
-        {
-            filename_pos += 10;
-            size_t filename_end = file_data.find("\"", filename_pos);
-            file.filename = file_data.substr(filename_pos, filename_end - filename_pos);
-        }
-        
-        size_t content_type_pos = file_data.find("Content-Type: ");
-        if (content_type_pos != std::string::npos) 
-        {
-            content_type_pos += 14;
-            size_t content_type_end = file_data.find("\r\n", content_type_pos);
-            file.content_type = file_data.substr(content_type_pos, content_type_end - content_type_pos);
-        }
-        
-        size_t data_pos = file_data.find("\r\n\r\n");
-        if (data_pos != std::string::npos) 
-        {
-            data_pos += 4;
-            file.data = file_data.substr(data_pos);
-        }
+public:
+    explicit FormFileCollector(std::vector<FormFile>& files) : files_(files) {}
 
-        vector_files.push_back(file);
+    bool begin(const FormPartHeaders& part) override
+    {
+        files_.push_back({ part.filename, part.content_type, std::string() });
+        return true;
+    }
 
-        pos = end_pos;
+    bool data(const char *bytes, size_t length) override
+    {
+        files_.back().data.append(bytes, length);
+        return true;
     }
+
+    bool end() override { return true; }
+
+private:
+    std::vector<FormFile>& files_;
+};
+
+std::vector<FormFile> RequestParser::parse_files()
+{
+    std::vector<FormFile> vector_files;
+    size_t body_pos = request_.find("\r\n\r\n");
+    if (request.boundary.size() <= 2 || body_pos == std::string::npos) return vector_files;
+
+    FormFileCollector collector(vector_files);
+    MultipartParser parser(std::string_view(request.boundary).substr(2), collector);
+    parser.feed(request_.data() + body_pos + 4, request_.size() - body_pos - 4);
     return vector_files;
-    
 }
 
 void RequestParser::save_files(std::vector<FormFile> vector_files)
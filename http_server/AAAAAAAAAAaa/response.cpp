@@ -2,6 +2,7 @@
 #include <sstream>
 #include <string>
 #include <iostream>
+#include <stdio.h>
 
 class Response {
 public:
@@ -10,12 +11,16 @@ public:
 
     void setStatusCode(int code);
     int getStatusCode() const;
-    std::string buildResponse(std::string body, std::string mime_type);
+    std::string buildResponse(std::string body, std::string mime_type, const std::string& extra_headers = "");
+    std::string buildHead(const std::string& mime_type, size_t content_length, const std::string& extra_headers);
+    std::string buildStreamHead(const std::string& mime_type, bool chunked, const std::string& extra_headers);
+    static void appendChunk(std::string& out, const char* data, size_t length);
     void setBody(const std::string& body);
     std::string getBody() const;
     std::string loadFile(const std::string& path);
     bool fileExists(const std::string& path);
 private:
+    std::string statusLine() const;
     int statusCode;
     std::string body;
 };
@@ -40,29 +45,77 @@ std::string Response::getBody() const {
     return body;
 }
 
-std::string Response::buildResponse(std::string body, std::string mime_type) {
+std::string Response::statusLine() const {
     std::string response = "HTTP/1.1 ";
     switch (statusCode) {
     case 200:
         response += "200 OK\r\n";
         break;
+    case 400:
+        response += "400 Bad Request\r\n";
+        break;
     case 404:
         response += "404 Not Found\r\n";
         break;
+    case 413:
+        response += "413 Content Too Large\r\n";
+        break;
     case 500:
         response += "500 Internal Server Error\r\n";
         break;
+    case 503:
+        response += "503 Service Unavailable\r\n";
+        break;
+    case 504:
+        response += "504 Gateway Timeout\r\n";
+        break;
     default:
         response += "200 OK\r\n";
     }
+    return response;
+}
+
+std::string Response::buildResponse(std::string body, std::string mime_type, const std::string& extra_headers) {
+    std::string response = statusLine();
     response += "Content-Type: " + mime_type + "\r\n";
     response += "Content-Length: " + std::to_string(body.length()) + "\r\n";
+    response += extra_headers;
     response += "\r\n";
     response += body;
 
     return response;
 }
 
+// Head for a body sent separately. extra_headers are complete header lines, CRLF terminated
+std::string Response::buildHead(const std::string& mime_type, size_t content_length, const std::string& extra_headers) {
+    std::string response = statusLine();
+    response += "Content-Type: " + mime_type + "\r\n";
+    response += "Content-Length: " + std::to_string(content_length) + "\r\n";
+    response += extra_headers;
+    response += "\r\n";
+    return response;
+}
+
+// Head of a response whose length is not known yet. The body follows in chunks, or for an HTTP/1.0
+// client as is until the connection closes
+std::string Response::buildStreamHead(const std::string& mime_type, bool chunked, const std::string& extra_headers) {
+    std::string response = statusLine();
+    response += "Content-Type: " + mime_type + "\r\n";
+    response += chunked ? "Transfer-Encoding: chunked\r\n" : "Connection: close\r\n";
+    response += extra_headers;
+    response += "\r\n";
+    return response;
+}
+
+// Size line, data and CRLF. An empty chunk is the last one, it ends the body
+void Response::appendChunk(std::string& out, const char* data, size_t length) {
+    char size_line[24];
+    int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", length);
+    out.append(size_line, n);
+    out.append(data, length);
+    out += "\r\n";
+}
+
 std::string Response::loadFile(const std::string& path) {
     std::ifstream file(path);
     if (!file) {
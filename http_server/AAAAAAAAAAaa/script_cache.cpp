@@ -0,0 +1,415 @@
+#include <sys/mman.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+
+#define SCRIPT_CACHE_ENTRIES    256
+#define SCRIPT_CACHE_BYTES      (16 * 1024 * 1024)  // arena shared by all cached responses
+#define SCRIPT_CACHE_ENTRY_MAX  (1024 * 1024)       // larger output is streamed and not kept
+#define SCRIPT_CACHE_KEY_MAX    512
+#define SCRIPT_CACHE_VARY_MAX   512
+#define SCRIPT_CACHE_TYPE_MAX   128
+#define SCRIPT_CACHE_HEADERS_MAX 256    // Vary and Cache-Control lines sent with a hit
+#define SCRIPT_CACHE_PASS_MS    1000    // how long a key that gave an uncacheable response is run directly
+#define SCRIPT_CACHE_WAIT_MS    10000   // longest wait for another worker's run of the same request
+#define SCRIPT_CACHE_WAIT_US    500     // poll interval while waiting for it
+#define SCRIPT_CACHE_ALIGN      64
+
+enum class ScriptCacheState : uint8_t
+{
+    FREE,
+    FILLING,    // a worker is running the script, identical requests wait for its output
+    READY,
+    PASS        // the last run was not cacheable, identical requests run the script themselves
+};
+
+struct ScriptCacheEntry
+{
+    ScriptCacheState state;
+    bool stale;                 // dropped while pinned, freed when the last reader releases it
+    uint32_t hash;
+    uint32_t refs;              // workers currently sending the body
+    pid_t owner;                // worker filling the entry
+    uint64_t fill;              // which run filled it, waiters of that run may use it even expired
+    uint64_t expires_ms;
+    uint64_t last_used;
+    size_t offset;
+    size_t length;
+    int status;
+    char content_type[SCRIPT_CACHE_TYPE_MAX];
+    char headers[SCRIPT_CACHE_HEADERS_MAX];
+    char key[SCRIPT_CACHE_KEY_MAX];
+    char vary[SCRIPT_CACHE_VARY_MAX];   // "name\nvalue\n" per request header the response varies on
+};
+
+// One MAP_SHARED region created before fork, like the file cache of the main server
+struct ScriptCacheRegion
+{
+    pthread_mutex_t lock;
+    uint64_t clock;
+    size_t capacity;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t coalesced;     // requests answered by another worker's run
+    ScriptCacheEntry entries[SCRIPT_CACHE_ENTRIES];
+};
+
+enum class ScriptCacheLookup
+{
+    HIT,        // send the pinned response, then release()
+    FILL,       // run the script and complete() or abandon() the reserved entry
+    BYPASS      // run the script, nothing is cached
+};
+
+// Pinned cached response, valid until release()
+struct ScriptCacheHit
+{
+    int index;
+    int status;
+    const char *content_type;
+    const char *headers;
+    const char *body;
+    size_t length;
+    bool coalesced;
+};
+
+static uint64_t script_cache_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Output of GET requests for scripts, keyed on the request target and the request headers named in
+// the response's Vary. Concurrent identical requests share one run (single-flight): the first reserves
+// a FILLING entry, the others wait for it and are answered from it, even with a TTL of 0
+class ScriptCache
+{
+public:
+    bool create(size_t budget);
+    ScriptCacheLookup lookup(const std::string& key, const std::unordered_map<std::string, std::string>& headers,
+                             ScriptCacheHit& hit, int& fill);
+    void complete(int fill, int status, const std::string& content_type, const std::string& response_headers,
+                  const std::string& vary, const std::unordered_map<std::string, std::string>& headers,
+                  const std::string& body, uint64_t ttl_ms);
+    void abandon(int fill, bool pass);
+    void release(ScriptCacheHit& hit);
+
+private:
+    ScriptCacheRegion *region_ = nullptr;
+    char *arena_ = nullptr;
+
+    void lock();
+    void unlock();
+    bool vary_matches(const ScriptCacheEntry& entry, const std::unordered_map<std::string, std::string>& headers) const;
+    int reserve(const std::string& key, uint32_t hash);
+    void drop(int index);
+    bool allocate(size_t length, size_t& offset);
+    static uint32_t hash_key(const std::string& key);
+};
+
+bool ScriptCache::create(size_t budget)
+{
+    size_t total = sizeof(ScriptCacheRegion) + budget;
+    void *memory = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        perror("mmap script cache");
+        return false;
+    }
+
+    region_ = (ScriptCacheRegion*)memory;
+    arena_ = (char*)memory + sizeof(ScriptCacheRegion);
+    memset(region_, 0, sizeof(ScriptCacheRegion));
+    region_->capacity = budget;
+
+    // Robust so a worker dying with the lock held does not wedge the others
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&region_->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return true;
+}
+
+void ScriptCache::lock()
+{
+    if (pthread_mutex_lock(&region_->lock) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&region_->lock);
+    }
+}
+
+void ScriptCache::unlock()
+{
+    pthread_mutex_unlock(&region_->lock);
+}
+
+uint32_t ScriptCache::hash_key(const std::string& key)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : key)
+    {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static const std::string *script_cache_header(const std::unordered_map<std::string, std::string>& headers, const std::string& name)
+{
+    for (const auto& header : headers)
+    {
+        if (strcasecmp(header.first.c_str(), name.c_str()) == 0) return &header.second;
+    }
+    return nullptr;
+}
+
+bool ScriptCache::vary_matches(const ScriptCacheEntry& entry, const std::unordered_map<std::string, std::string>& headers) const
+{
+    const char *pos = entry.vary;
+    while (*pos)
+    {
+        const char *name_end = strchr(pos, '\n');
+        const char *value_end = strchr(name_end + 1, '\n');
+        const std::string *value = script_cache_header(headers, std::string(pos, name_end));
+        std::string expected(name_end + 1, value_end);
+        if ((value ? *value : std::string()) != expected) return false;
+        pos = value_end + 1;
+    }
+    return true;
+}
+
+void ScriptCache::drop(int index)
+{
+    ScriptCacheEntry& entry = region_->entries[index];
+    if (entry.refs > 0)
+    {
+        entry.stale = true;
+        return;
+    }
+    entry.state = ScriptCacheState::FREE;
+    entry.stale = false;
+}
+
+// A FREE slot, or the least recently used finished one nobody is reading
+int ScriptCache::reserve(const std::string& key, uint32_t hash)
+{
+    int index = -1;
+    for (int i = 0; i < SCRIPT_CACHE_ENTRIES && index < 0; i++)
+    {
+        if (region_->entries[i].state == ScriptCacheState::FREE) index = i;
+    }
+    if (index < 0)
+    {
+        for (int i = 0; i < SCRIPT_CACHE_ENTRIES; i++)
+        {
+            ScriptCacheEntry& entry = region_->entries[i];
+            if (entry.state == ScriptCacheState::FILLING || entry.refs > 0) continue;
+            if (index < 0 || entry.last_used < region_->entries[index].last_used) index = i;
+        }
+    }
+    if (index < 0) return -1;
+
+    ScriptCacheEntry& entry = region_->entries[index];
+    entry.state = ScriptCacheState::FILLING;
+    entry.stale = false;
+    entry.hash = hash;
+    entry.refs = 0;
+    entry.owner = getpid();
+    entry.fill = ++region_->clock;
+    entry.last_used = entry.fill;
+    entry.length = 0;
+    entry.vary[0] = '\0';
+    memcpy(entry.key, key.c_str(), key.size() + 1);
+    return index;
+}
+
+ScriptCacheLookup ScriptCache::lookup(const std::string& key, const std::unordered_map<std::string, std::string>& headers,
+                                      ScriptCacheHit& hit, int& fill)
+{
+    if (!region_ || key.size() >= SCRIPT_CACHE_KEY_MAX) return ScriptCacheLookup::BYPASS;
+
+    uint32_t hash = hash_key(key);
+    uint64_t deadline = script_cache_now_ms() + SCRIPT_CACHE_WAIT_MS;
+    int waited = -1;        // entry filled by the run this request waits for
+    uint64_t waited_fill = 0;
+    while (true)
+    {
+        lock();
+        uint64_t now = script_cache_now_ms();
+        int filling = -1;
+        for (int i = 0; i < SCRIPT_CACHE_ENTRIES; i++)
+        {
+            ScriptCacheEntry& entry = region_->entries[i];
+            if (entry.state == ScriptCacheState::FREE || entry.stale || entry.hash != hash || key != entry.key) continue;
+
+            if (entry.state == ScriptCacheState::FILLING)
+            {
+                // A worker killed mid-run would leave its waiters hanging until the deadline
+                if (kill(entry.owner, 0) < 0 && errno == ESRCH) drop(i);
+                else filling = i;
+                continue;
+            }
+            if (entry.state == ScriptCacheState::PASS)
+            {
+                if (entry.expires_ms <= now) continue;
+                unlock();
+                return ScriptCacheLookup::BYPASS;
+            }
+            bool ours = i == waited && entry.fill == waited_fill;
+            if ((entry.expires_ms > now || ours) && vary_matches(entry, headers))
+            {
+                entry.refs++;
+                entry.last_used = ++region_->clock;
+                region_->hits++;
+                if (ours) region_->coalesced++;
+                unlock();
+
+                hit.index = i;
+                hit.status = entry.status;
+                hit.content_type = entry.content_type;
+                hit.headers = entry.headers;
+                hit.body = arena_ + entry.offset;
+                hit.length = entry.length;
+                hit.coalesced = ours;
+                return ScriptCacheLookup::HIT;
+            }
+        }
+
+        if (filling >= 0 && now < deadline)
+        {
+            waited = filling;
+            waited_fill = region_->entries[filling].fill;
+            unlock();
+            usleep(SCRIPT_CACHE_WAIT_US);
+            continue;
+        }
+
+        region_->misses++;
+        fill = filling >= 0 ? -1 : reserve(key, hash);
+        unlock();
+        return fill >= 0 ? ScriptCacheLookup::FILL : ScriptCacheLookup::BYPASS;
+    }
+}
+
+// First fit between the live entries, evicting least recently used ones until the block fits
+bool ScriptCache::allocate(size_t length, size_t& offset)
+{
+    if (length > region_->capacity) return false;
+
+    while (1)
+    {
+        std::vector<std::pair<size_t, size_t>> used;
+        for (int i = 0; i < SCRIPT_CACHE_ENTRIES; i++)
+        {
+            ScriptCacheEntry& entry = region_->entries[i];
+            if (entry.state != ScriptCacheState::READY) continue;
+            size_t end = entry.offset + entry.length;
+            used.emplace_back(entry.offset, (end + SCRIPT_CACHE_ALIGN - 1) & ~(size_t)(SCRIPT_CACHE_ALIGN - 1));
+        }
+        std::sort(used.begin(), used.end());
+
+        size_t candidate = 0;
+        for (const auto& block : used)
+        {
+            if (block.first >= candidate + length) break;
+            candidate = std::max(candidate, block.second);
+        }
+        if (candidate + length <= region_->capacity)
+        {
+            offset = candidate;
+            return true;
+        }
+
+        int victim = -1;
+        for (int i = 0; i < SCRIPT_CACHE_ENTRIES; i++)
+        {
+            ScriptCacheEntry& entry = region_->entries[i];
+            if (entry.state != ScriptCacheState::READY || entry.refs > 0) continue;
+            if (victim < 0 || entry.last_used < region_->entries[victim].last_used) victim = i;
+        }
+        if (victim < 0) return false;
+        drop(victim);
+    }
+}
+
+// Stores the output of a FILLING entry. The body is copied under the lock, it is at most
+// SCRIPT_CACHE_ENTRY_MAX and waiting workers are only polling meanwhile
+void ScriptCache::complete(int fill, int status, const std::string& content_type, const std::string& response_headers,
+                           const std::string& vary, const std::unordered_map<std::string, std::string>& headers,
+                           const std::string& body, uint64_t ttl_ms)
+{
+    // Vary names with the values this request had for them
+    std::string vary_values;
+    size_t pos = 0;
+    while (pos < vary.size())
+    {
+        size_t comma = vary.find(',', pos);
+        std::string name = vary.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        pos = comma == std::string::npos ? vary.size() : comma + 1;
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+        if (name.empty()) continue;
+        const std::string *value = script_cache_header(headers, name);
+        vary_values += name + "\n" + (value ? *value : std::string()) + "\n";
+    }
+    if (vary == "*" || vary_values.size() >= SCRIPT_CACHE_VARY_MAX || content_type.size() >= SCRIPT_CACHE_TYPE_MAX ||
+        response_headers.size() >= SCRIPT_CACHE_HEADERS_MAX || body.size() > SCRIPT_CACHE_ENTRY_MAX)
+    {
+        abandon(fill, true);
+        return;
+    }
+
+    lock();
+    ScriptCacheEntry& entry = region_->entries[fill];
+    size_t offset;
+    if (!allocate(body.size(), offset))
+    {
+        entry.state = ScriptCacheState::FREE;
+        unlock();
+        return;
+    }
+    memcpy(arena_ + offset, body.data(), body.size());
+    entry.offset = offset;
+    entry.length = body.size();
+    entry.status = status;
+    memcpy(entry.content_type, content_type.c_str(), content_type.size() + 1);
+    memcpy(entry.headers, response_headers.c_str(), response_headers.size() + 1);
+    memcpy(entry.vary, vary_values.c_str(), vary_values.size() + 1);
+    entry.expires_ms = script_cache_now_ms() + ttl_ms;
+    entry.state = ScriptCacheState::READY;
+    unlock();
+}
+
+// The run failed or its response may not be shared. With pass the key is run directly for a while,
+// so a burst on an uncacheable page does not queue up behind one worker after another
+void ScriptCache::abandon(int fill, bool pass)
+{
+    lock();
+    ScriptCacheEntry& entry = region_->entries[fill];
+    entry.state = pass ? ScriptCacheState::PASS : ScriptCacheState::FREE;
+    entry.expires_ms = script_cache_now_ms() + SCRIPT_CACHE_PASS_MS;
+    unlock();
+}
+
+void ScriptCache::release(ScriptCacheHit& hit)
+{
+    lock();
+    ScriptCacheEntry& entry = region_->entries[hit.index];
+    entry.refs--;
+    if (entry.stale && entry.refs == 0) drop(hit.index);
+    unlock();
+}
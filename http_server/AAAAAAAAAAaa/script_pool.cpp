@@ -0,0 +1,473 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <atomic>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#define SCRIPT_MAX_REQUESTS         500     // an interpreter is restarted after this many requests
+#define SCRIPT_QUEUE_TIMEOUT_MS     2000    // wait for an idle interpreter, then 503
+#define SCRIPT_RUN_TIMEOUT_MS       10000   // wait for the response, then 504 and the interpreter is killed
+#define SCRIPT_QUEUE_POLL_US        200     // retry interval while every interpreter is busy
+#define SCRIPT_SUPERVISE_US         5000    // supervisor tick, reaping and restarting interpreters
+#define SCRIPT_EXEC_FAILED          127     // exit status of a child whose exec failed
+#define SCRIPT_MIN_LIFETIME_MS      1000    // an interpreter exiting sooner on its own is not restarted
+
+// FastCGI 1.0 record types and the responder role
+#define FCGI_VERSION_1          1
+#define FCGI_BEGIN_REQUEST      1
+#define FCGI_END_REQUEST        3
+#define FCGI_PARAMS             4
+#define FCGI_STDIN              5
+#define FCGI_STDOUT             6
+#define FCGI_STDERR             7
+#define FCGI_RESPONDER          1
+#define FCGI_REQUEST_ID         1       // one request per connection
+#define FCGI_RECORD_MAX         65535
+
+// An interpreter started with its listening socket on fd 0, as php-cgi and other FastCGI apps expect
+struct ScriptPoolConfig
+{
+    std::string extension;
+    std::vector<std::string> argv;
+    int size;
+};
+
+enum ScriptSlotState : uint32_t
+{
+    SCRIPT_STARTING,    // not spawned yet
+    SCRIPT_IDLE,
+    SCRIPT_BUSY,        // owned by one worker for one request
+    SCRIPT_RETIRE,      // served its requests or misbehaved, the supervisor kills and restarts it
+    SCRIPT_DISABLED     // the interpreter could not be started, requests fall back to fork and exec
+};
+
+struct alignas(64) ScriptSlot
+{
+    std::atomic<uint32_t> state;
+    std::atomic<int> pid;
+    std::atomic<uint32_t> requests;     // served by the current process
+    int pool;                           // index into the configs
+    int listen_fd;
+    uint64_t started_ms;                // written and read by the supervisor only
+};
+
+enum class ScriptStatus
+{
+    OK,
+    NO_POOL,        // no interpreter for this extension, or none could be started
+    UNAVAILABLE,    // every interpreter stayed busy for SCRIPT_QUEUE_TIMEOUT_MS
+    TIMEOUT,        // no complete response within SCRIPT_RUN_TIMEOUT_MS
+    FAILED,         // connection lost or the response was not FastCGI
+    ABORTED         // the output refused more data, the client went away
+};
+
+struct ScriptResult
+{
+    ScriptStatus status = ScriptStatus::NO_POOL;
+    std::string errors;     // FastCGI stderr
+};
+
+// Receives the script's stdout, CGI headers and body, in the pieces it was read in. Nothing more is read
+// from the script until write() returns, so a slow consumer throttles the script
+class ScriptOutput
+{
+public:
+    virtual ~ScriptOutput() = default;
+    virtual bool write(const char *data, size_t length) = 0;
+};
+
+static uint64_t script_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static volatile sig_atomic_t script_supervisor_stop = 0;
+
+static void stop_script_supervisor(int)
+{
+    script_supervisor_stop = 1;
+}
+
+// Long lived interpreters shared by all workers. The slot table and the listening sockets are created
+// before fork, a supervisor process spawns the interpreters and restarts them, a worker takes an idle
+// slot for one request and talks FastCGI to it over a Unix socket. The listening socket outlives the
+// interpreter behind it, so a connection made while one is being restarted waits in the backlog
+class ScriptPool
+{
+public:
+    bool create(const std::vector<ScriptPoolConfig>& configs);
+    void supervise();
+    ScriptResult run(const std::string& extension, const std::vector<std::pair<std::string, std::string>>& params,
+                     std::string_view body, ScriptOutput& output);
+
+private:
+    int pool_of(const std::string& extension) const;
+    int acquire(int pool, ScriptStatus& status);
+    void release(int index, bool healthy);
+    void spawn(int index);
+    int connect_slot(int index) const;
+    void address(int index, struct sockaddr_un& addr, socklen_t& length) const;
+
+    std::vector<ScriptPoolConfig> configs_;
+    ScriptSlot *slots_ = nullptr;
+    int count_ = 0;
+    pid_t owner_ = 0;
+};
+
+// Abstract namespace, nothing to unlink, the master's pid keeps two servers apart
+void ScriptPool::address(int index, struct sockaddr_un& addr, socklen_t& length) const
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    int n = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "ivos-script-%d-%d", (int)owner_, index);
+    length = offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+bool ScriptPool::create(const std::vector<ScriptPoolConfig>& configs)
+{
+    configs_ = configs;
+    owner_ = getpid();
+    count_ = 0;
+    for (const ScriptPoolConfig& config : configs_) count_ += config.size;
+    if (count_ == 0) return true;
+
+    void *memory = mmap(NULL, sizeof(ScriptSlot) * count_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        perror("mmap script pool");
+        return false;
+    }
+    slots_ = new (memory) ScriptSlot[count_];
+
+    int index = 0;
+    for (size_t pool = 0; pool < configs_.size(); pool++)
+    {
+        for (int i = 0; i < configs_[pool].size; i++, index++)
+        {
+            ScriptSlot& slot = slots_[index];
+            slot.state.store(SCRIPT_STARTING, std::memory_order_relaxed);
+            slot.pid.store(0, std::memory_order_relaxed);
+            slot.requests.store(0, std::memory_order_relaxed);
+            slot.pool = pool;
+
+            struct sockaddr_un addr;
+            socklen_t length;
+            address(index, addr, length);
+            slot.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (slot.listen_fd < 0 || bind(slot.listen_fd, (struct sockaddr*)&addr, length) < 0 ||
+                listen(slot.listen_fd, SOMAXCONN) < 0)
+            {
+                perror("script pool socket");
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void ScriptPool::spawn(int index)
+{
+    ScriptSlot& slot = slots_[index];
+    const ScriptPoolConfig& config = configs_[slot.pool];
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        dup2(slot.listen_fd, STDIN_FILENO);
+        // php-cgi forks its own children unless told not to, the pool does that job
+        setenv("PHP_FCGI_CHILDREN", "0", 1);
+        setenv("PHP_FCGI_MAX_REQUESTS", "0", 1);
+        std::vector<char*> argv;
+        for (const std::string& arg : config.argv) argv.push_back((char*)arg.c_str());
+        argv.push_back(nullptr);
+        execvp(argv[0], argv.data());
+        _exit(SCRIPT_EXEC_FAILED);
+    }
+    if (pid < 0)
+    {
+        perror("fork interpreter failed");
+        return;
+    }
+    slot.started_ms = script_now_ms();
+    slot.requests.store(0, std::memory_order_relaxed);
+    slot.pid.store(pid, std::memory_order_release);
+    uint32_t state = SCRIPT_STARTING;
+    slot.state.compare_exchange_strong(state, SCRIPT_IDLE);
+    state = SCRIPT_RETIRE;
+    slot.state.compare_exchange_strong(state, SCRIPT_IDLE);
+}
+
+// Runs in its own process forked by the master, like the logger
+void ScriptPool::supervise()
+{
+    struct sigaction sa = {};
+    sa.sa_handler = stop_script_supervisor;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    for (int i = 0; i < count_; i++) spawn(i);
+
+    pid_t parent = getppid();
+    while (!script_supervisor_stop && getppid() == parent)
+    {
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            for (int i = 0; i < count_; i++)
+            {
+                if (slots_[i].pid.load(std::memory_order_relaxed) != pid) continue;
+                slots_[i].pid.store(0, std::memory_order_relaxed);
+                // A missing interpreter or a broken command line would otherwise be restarted every tick
+                bool exec_failed = WIFEXITED(status) && WEXITSTATUS(status) == SCRIPT_EXEC_FAILED;
+                bool retired = slots_[i].state.load(std::memory_order_relaxed) == SCRIPT_RETIRE;
+                if (exec_failed || (!retired && script_now_ms() - slots_[i].started_ms < SCRIPT_MIN_LIFETIME_MS))
+                {
+                    fprintf(stderr, "Interpreter %s exited right after start, %s runs fork and exec\n",
+                            configs_[slots_[i].pool].argv[0].c_str(), configs_[slots_[i].pool].extension.c_str());
+                    slots_[i].state.store(SCRIPT_DISABLED, std::memory_order_release);
+                }
+            }
+        }
+
+        for (int i = 0; i < count_; i++)
+        {
+            uint32_t state = slots_[i].state.load(std::memory_order_acquire);
+            int slot_pid = slots_[i].pid.load(std::memory_order_relaxed);
+            if (state == SCRIPT_DISABLED) continue;
+            // Exited on its own or killed below, a worker may hold the slot meanwhile, its connection
+            // waits in the backlog for the new process
+            if (slot_pid == 0) spawn(i);
+            else if (state == SCRIPT_RETIRE) kill(slot_pid, SIGKILL);
+        }
+        usleep(SCRIPT_SUPERVISE_US);
+    }
+
+    for (int i = 0; i < count_; i++)
+    {
+        int slot_pid = slots_[i].pid.load(std::memory_order_relaxed);
+        if (slot_pid > 0) kill(slot_pid, SIGTERM);
+    }
+    while (waitpid(-1, nullptr, 0) > 0);
+}
+
+int ScriptPool::pool_of(const std::string& extension) const
+{
+    for (size_t i = 0; i < configs_.size(); i++)
+    {
+        if (configs_[i].extension == extension && configs_[i].size > 0) return i;
+    }
+    return -1;
+}
+
+// Takes an idle interpreter of the pool, waiting up to SCRIPT_QUEUE_TIMEOUT_MS while all are busy
+int ScriptPool::acquire(int pool, ScriptStatus& status)
+{
+    uint64_t deadline = script_now_ms() + SCRIPT_QUEUE_TIMEOUT_MS;
+    while (true)
+    {
+        bool usable = false;
+        for (int i = 0; i < count_; i++)
+        {
+            if (slots_[i].pool != pool) continue;
+            uint32_t state = slots_[i].state.load(std::memory_order_relaxed);
+            if (state != SCRIPT_DISABLED) usable = true;
+            if (state == SCRIPT_IDLE && slots_[i].state.compare_exchange_strong(state, SCRIPT_BUSY, std::memory_order_acquire))
+            {
+                return i;
+            }
+        }
+        if (!usable)
+        {
+            status = ScriptStatus::NO_POOL;
+            return -1;
+        }
+        if (script_now_ms() >= deadline)
+        {
+            status = ScriptStatus::UNAVAILABLE;
+            return -1;
+        }
+        usleep(SCRIPT_QUEUE_POLL_US);
+    }
+}
+
+void ScriptPool::release(int index, bool healthy)
+{
+    ScriptSlot& slot = slots_[index];
+    uint32_t served = slot.requests.fetch_add(1, std::memory_order_relaxed) + 1;
+    bool retire = !healthy || served >= SCRIPT_MAX_REQUESTS;
+    // The supervisor may have disabled the slot meanwhile, that sticks
+    uint32_t state = SCRIPT_BUSY;
+    slot.state.compare_exchange_strong(state, retire ? SCRIPT_RETIRE : SCRIPT_IDLE, std::memory_order_release);
+}
+
+int ScriptPool::connect_slot(int index) const
+{
+    struct sockaddr_un addr;
+    socklen_t length;
+    address(index, addr, length);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, length) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void fcgi_record(std::string& out, int type, const char *content, size_t length)
+{
+    do
+    {
+        size_t part = std::min(length, (size_t)FCGI_RECORD_MAX);
+        char header[8] = { FCGI_VERSION_1, (char)type, 0, FCGI_REQUEST_ID,
+                           (char)(part >> 8), (char)(part & 0xff), 0, 0 };
+        out.append(header, sizeof(header));
+        out.append(content, part);
+        content += part;
+        length -= part;
+    } while (length > 0);
+}
+
+static void fcgi_length(std::string& out, size_t length)
+{
+    if (length < 128)
+    {
+        out += (char)length;
+        return;
+    }
+    out += (char)((length >> 24) | 0x80);
+    out += (char)(length >> 16);
+    out += (char)(length >> 8);
+    out += (char)length;
+}
+
+// Waits for the socket until the deadline, false on timeout or error
+static bool script_wait(int fd, short events, uint64_t deadline)
+{
+    while (true)
+    {
+        uint64_t now = script_now_ms();
+        if (now >= deadline) return false;
+        struct pollfd pfd = { fd, events, 0 };
+        int ready = poll(&pfd, 1, (int)(deadline - now));
+        if (ready > 0) return true;
+        if (ready < 0 && errno != EINTR) return false;
+    }
+}
+
+ScriptResult ScriptPool::run(const std::string& extension, const std::vector<std::pair<std::string, std::string>>& params,
+                             std::string_view body, ScriptOutput& output)
+{
+    ScriptResult result;
+    int pool = slots_ ? pool_of(extension) : -1;
+    if (pool < 0) return result;
+    int index = acquire(pool, result.status);
+    if (index < 0) return result;
+
+    // Request id 1 without FCGI_KEEP_CONN, the application closes the connection when it is done
+    std::string request;
+    const char begin[8] = { 0, FCGI_RESPONDER, 0, 0, 0, 0, 0, 0 };
+    fcgi_record(request, FCGI_BEGIN_REQUEST, begin, sizeof(begin));
+    std::string encoded;
+    for (const auto& param : params)
+    {
+        fcgi_length(encoded, param.first.size());
+        fcgi_length(encoded, param.second.size());
+        encoded += param.first;
+        encoded += param.second;
+    }
+    if (!encoded.empty()) fcgi_record(request, FCGI_PARAMS, encoded.data(), encoded.size());
+    fcgi_record(request, FCGI_PARAMS, nullptr, 0);
+    if (!body.empty()) fcgi_record(request, FCGI_STDIN, body.data(), body.size());
+    fcgi_record(request, FCGI_STDIN, nullptr, 0);
+
+    uint64_t deadline = script_now_ms() + SCRIPT_RUN_TIMEOUT_MS;
+    int fd = connect_slot(index);
+    result.status = ScriptStatus::FAILED;
+    size_t sent = 0;
+    while (fd >= 0 && sent < request.size())
+    {
+        ssize_t n = send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+        if (n > 0) sent += n;
+        else if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            if (!script_wait(fd, POLLOUT, deadline))
+            {
+                result.status = ScriptStatus::TIMEOUT;
+                break;
+            }
+        }
+        else break;
+    }
+
+    // Records until FCGI_END_REQUEST, stdout goes to the output as it arrives, stderr is collected and
+    // anything else is skipped
+    std::string input;
+    size_t pos = 0;
+    bool ended = false;
+    bool aborted = false;
+    char buffer[16384];
+    while (fd >= 0 && sent == request.size() && !ended && !aborted)
+    {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            if (!script_wait(fd, POLLIN, deadline))
+            {
+                result.status = ScriptStatus::TIMEOUT;
+                break;
+            }
+            continue;
+        }
+        if (n <= 0) break;
+        input.append(buffer, n);
+        while (input.size() - pos >= 8)
+        {
+            const unsigned char *header = (const unsigned char*)input.data() + pos;
+            size_t length = (header[4] << 8) | header[5];
+            size_t record = 8 + length + header[6];
+            if (input.size() - pos < record) break;
+            const char *content = input.data() + pos + 8;
+            if (header[1] == FCGI_STDOUT)
+            {
+                aborted = length > 0 && !output.write(content, length);
+                if (aborted) break;
+            }
+            else if (header[1] == FCGI_STDERR) result.errors.append(content, length);
+            else if (header[1] == FCGI_END_REQUEST) ended = true;
+            pos += record;
+        }
+        if (pos > sizeof(buffer))
+        {
+            input.erase(0, pos);
+            pos = 0;
+        }
+    }
+    if (fd >= 0) close(fd);
+    if (ended) result.status = ScriptStatus::OK;
+    if (aborted) result.status = ScriptStatus::ABORTED;
+
+    // A timed out or broken interpreter is killed, it may still be stuck in the script or in writing
+    // output nobody reads
+    release(index, ended);
+    return result;
+}
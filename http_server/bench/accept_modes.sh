@@ -0,0 +1,45 @@
+#!/bin/bash
+# Compares new TLS connections per second between the master accept/send_fd
+# mode and the per-worker SO_REUSEPORT mode.
+#
+# Usage: bench/accept_modes.sh [seconds] [parallel clients]
+# Run from the http_server directory after `make`, SERVER overrides the binary.
+
+SECONDS_PER_RUN=${1:-10}
+CLIENTS=${2:-8}
+SERVER=${SERVER:-./main}
+HOST=localhost:8080
+
+run_mode() {
+    local name=$1
+    shift
+
+    $SERVER "$@" > /dev/null 2>&1 &
+    local server_pid=$!
+    sleep 1
+
+    local tmp
+    tmp=$(mktemp -d)
+    for ((i = 0; i < CLIENTS; i++)); do
+        openssl s_time -connect "$HOST" -new -time "$SECONDS_PER_RUN" > "$tmp/$i.txt" 2>&1 &
+    done
+    wait $(jobs -p | grep -v "^$server_pid$")
+
+    # s_time prints "<n> connections in <t> real seconds"
+    awk -v name="$name" '
+        / connections in .* real seconds/ { conns += $1; secs = ($4 > secs ? $4 : secs) }
+        END { if (secs > 0) printf "%-22s %8d connections %8.1f conn/s\n", name, conns, conns / secs;
+              else printf "%-22s no result\n", name }
+    ' "$tmp"/*.txt
+
+    pkill -P "$server_pid" 2> /dev/null
+    kill "$server_pid" 2> /dev/null
+    wait "$server_pid" 2> /dev/null
+    rm -rf "$tmp"
+    sleep 1
+}
+
+echo "TLS handshakes, $CLIENTS clients x ${SECONDS_PER_RUN}s"
+run_mode "master accept"
+run_mode "reuseport"              --reuseport
+run_mode "reuseport + cpu steer"  --reuseport --cpu-affinity
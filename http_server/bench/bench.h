@@ -0,0 +1,107 @@
+// Minimal benchmark harness shared by the programs in bench/. Every program is one translation unit,
+// so the replaced global operator new below is defined exactly once per binary
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <new>
+#include <algorithm>
+
+// Heap traffic of the measuring thread only, background threads like the logger's writer are not counted
+static thread_local uint64_t bench_alloc_count = 0;
+static thread_local uint64_t bench_alloc_bytes = 0;
+
+// Out of line, GCC warns about free() on memory from operator new once it sees through both
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    bench_alloc_count++;
+    bench_alloc_bytes += size;
+    void *memory = malloc(size ? size : 1);
+    if (!memory) throw std::bad_alloc();
+    return memory;
+}
+
+__attribute__((noinline)) void *operator new[](size_t size) { return operator new(size); }
+__attribute__((noinline)) void operator delete(void *memory) noexcept { free(memory); }
+__attribute__((noinline)) void operator delete[](void *memory) noexcept { free(memory); }
+__attribute__((noinline)) void operator delete(void *memory, size_t) noexcept { free(memory); }
+__attribute__((noinline)) void operator delete[](void *memory, size_t) noexcept { free(memory); }
+
+static inline uint64_t bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Keeps the compiler from optimizing the measured work away
+template <typename T>
+static inline void do_not_optimize(const T& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Nanoseconds per call, the fastest of three batches of at least min_ns / 3 each, so a preempted batch
+// does not count. Warm up takes up to 1000 calls or a tenth of the budget, so cases that work on
+// megabytes do not take seconds
+template <typename Fn>
+static double bench_run(Fn&& fn, uint64_t min_ns = 200000000ULL)
+{
+    uint64_t iterations = 0;
+    uint64_t warm_start = bench_now_ns();
+    while (iterations < 1000 && bench_now_ns() - warm_start < min_ns / 10)
+    {
+        fn();
+        iterations++;
+    }
+
+    double best = 0;
+    int batches = 0;
+    while (batches < 3)
+    {
+        uint64_t start = bench_now_ns();
+        for (uint64_t i = 0; i < iterations; i++) fn();
+        uint64_t elapsed = bench_now_ns() - start;
+        if (elapsed < min_ns / 3)
+        {
+            iterations *= 2;
+            continue;
+        }
+        double per_call = (double)elapsed / iterations;
+        if (batches++ == 0 || per_call < best) best = per_call;
+    }
+    return best;
+}
+
+struct BenchResult
+{
+    double ns;
+    double allocs;      // heap allocations per call
+    double bytes;       // bytes requested from the heap per call, what the call copied into new buffers
+};
+
+// Time per call, then heap traffic per call over a separate untimed run of about 50 ms
+template <typename Fn>
+static BenchResult bench_measure(Fn&& fn)
+{
+    BenchResult result;
+    result.ns = bench_run(fn);
+    uint64_t calls = std::min<uint64_t>(1000, std::max<uint64_t>(1, (uint64_t)(50000000 / result.ns)));
+    uint64_t count = bench_alloc_count;
+    uint64_t bytes = bench_alloc_bytes;
+    for (uint64_t i = 0; i < calls; i++) fn();
+    result.allocs = (double)(bench_alloc_count - count) / calls;
+    result.bytes = (double)(bench_alloc_bytes - bytes) / calls;
+    return result;
+}
+
+// One line per case, bench/compare.sh reads the value in front of each unit
+static inline void bench_report(const char *name, double ns_per_op)
+{
+    printf("%-48s %10.1f ns/op\n", name, ns_per_op);
+}
+
+static inline void bench_report(const char *name, const BenchResult& result)
+{
+    printf("%-48s %10.1f ns/op %8.2f allocs/op %10.1f B/op\n", name, result.ns, result.allocs, result.bytes);
+}
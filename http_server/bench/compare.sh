@@ -0,0 +1,65 @@
+#!/bin/bash
+# Compares benchmark output against a stored baseline. A case regresses when it got slower by more
+# than the threshold in percent, or when it allocates more per call. Either file may hold several
+# runs of the suite, the fastest time of each case counts so a run on a busy machine does not.
+# Allocation counts do not depend on the machine, timings do, so record the baseline where you compare.
+#
+# Usage: bench/compare.sh baseline.txt current.txt [threshold percent]
+# `make bench-baseline` records bench/baseline.txt, `make bench-compare` runs this against it.
+
+BASELINE=$1
+CURRENT=$2
+THRESHOLD=${3:-20}
+
+if [ ! -f "$BASELINE" ] || [ ! -f "$CURRENT" ]; then
+    echo "usage: $0 baseline.txt current.txt [threshold percent]" >&2
+    exit 2
+fi
+
+awk -v threshold="$THRESHOLD" '
+    # "<name> <ns> ns/op [<allocs> allocs/op <bytes> B/op]", names may contain spaces
+    function parse(    i, unit) {
+        for (i = 1; i <= NF; i++) if ($i == "ns/op") unit = i
+        if (!unit) return 0
+        name = $1
+        for (i = 2; i < unit - 1; i++) name = name " " $i
+        ns = $(unit - 1) + 0
+        allocs = $(unit + 2) == "allocs/op" ? $(unit + 1) + 0 : -1
+        return 1
+    }
+    FNR == NR {
+        if (parse() && (!(name in base_ns) || ns < base_ns[name])) { base_ns[name] = ns; base_allocs[name] = allocs }
+        next
+    }
+    parse() {
+        if (!(name in cur_ns)) order[count++] = name
+        if (!(name in cur_ns) || ns < cur_ns[name]) cur_ns[name] = ns
+        if (allocs > cur_allocs[name] || !(name in cur_allocs)) cur_allocs[name] = allocs
+    }
+    END {
+        printf "%-48s %12s %12s %8s\n", "case", "baseline ns", "current ns", "change"
+        for (i = 0; i < count; i++) {
+            name = order[i]
+            if (!(name in base_ns)) {
+                printf "%-48s %12s %12.1f %8s  new\n", name, "-", cur_ns[name], ""
+                continue
+            }
+            change = base_ns[name] > 0 ? (cur_ns[name] - base_ns[name]) * 100 / base_ns[name] : 0
+            status = ""
+            if (change > threshold) status = "SLOWER"
+            if (base_allocs[name] >= 0 && cur_allocs[name] > base_allocs[name] + 0.005) {
+                status = status (status ? ", " : "") "MORE ALLOCS " base_allocs[name] " -> " cur_allocs[name]
+            }
+            if (status) regressions++
+            printf "%-48s %12.1f %12.1f %+7.1f%%  %s\n", name, base_ns[name], cur_ns[name], change, status
+        }
+        for (name in base_ns) {
+            if (!(name in cur_ns)) printf "%-48s %12.1f %12s %8s  missing\n", name, base_ns[name], "-", ""
+        }
+        if (regressions) {
+            printf "%d regression(s) over %s%%\n", regressions, threshold
+            exit 1
+        }
+        printf "no regressions over %s%%\n", threshold
+    }
+' "$BASELINE" "$CURRENT"
@@ -0,0 +1,37 @@
+// Request heads shared by the parser and hot path benchmarks, from the clients the server sees
+#include <string>
+#include <utility>
+#include <vector>
+
+static const std::vector<std::pair<const char*, std::string>> corpus =
+{
+    { "curl GET",
+      "GET / HTTP/1.1\r\n"
+      "Host: localhost:8080\r\n"
+      "User-Agent: curl/7.88.1\r\n"
+      "Accept: */*\r\n"
+      "\r\n" },
+    { "ab GET",
+      "GET /index.html HTTP/1.0\r\n"
+      "Host: localhost:8080\r\n"
+      "User-Agent: ApacheBench/2.3\r\n"
+      "Accept: */*\r\n"
+      "\r\n" },
+    { "browser GET",
+      "GET /images.jpg?v=3 HTTP/1.1\r\n"
+      "Host: localhost:8080\r\n"
+      "Connection: keep-alive\r\n"
+      "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+      "sec-ch-ua-mobile: ?0\r\n"
+      "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+      "sec-ch-ua-platform: \"Linux\"\r\n"
+      "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+      "Sec-Fetch-Site: same-origin\r\n"
+      "Sec-Fetch-Mode: no-cors\r\n"
+      "Sec-Fetch-Dest: image\r\n"
+      "Referer: https://localhost:8080/\r\n"
+      "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+      "Accept-Language: cs-CZ,cs;q=0.9,en;q=0.8\r\n"
+      "Cookie: session=6f1c2a9e4b7d4e0f9a3b5c8d2e1f0a7b; theme=dark\r\n"
+      "\r\n" },
+};
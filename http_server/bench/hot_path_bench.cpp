@@ -0,0 +1,126 @@
+// Per request work inside a worker: parsing the head, looking up the MIME type, building the response
+// and logging it. Run from the http_server directory, everything runs in a scratch directory that links
+// the certificates and pages the server singleton loads, so no log files are left behind
+#include <stdlib.h>
+#include <filesystem>
+
+#include "bench.h"
+#include "corpus.h"
+#include "../server.cpp"
+
+static void bench_parser()
+{
+    for (const auto& entry : corpus)
+    {
+        const std::string& raw = entry.second;
+        BenchResult result = bench_measure([&]() {
+            RequestParser parser;
+            HttpRequest request;
+            ParseStatus status = parser.parse(raw.data(), raw.size(), request);
+            do_not_optimize(status);
+            do_not_optimize(request);
+        });
+        bench_report((std::string("parse ") + entry.first).c_str(), result);
+    }
+}
+
+static void bench_response()
+{
+    Response page;
+    std::string body = page.loadFile(FILE_NOT_FOUND_PATH);
+    BenchResult result = bench_measure([&]() {
+        Response response;
+        response.setStatusCode(404);
+        std::string out = response.buildResponse(body, "text/html");
+        do_not_optimize(out);
+    });
+    bench_report("buildResponse 404 page", result);
+
+    // What send_response queues before the file itself, the extra fields are added by end_headers
+    result = bench_measure([&]() {
+        Response response;
+        std::string out = response.buildHeader(48213, "image/jpeg", false);
+        do_not_optimize(out);
+    });
+    bench_report("buildHeader 200 image", result);
+}
+
+static void bench_mime_types()
+{
+    Server& server = Server::getInstance();
+    static const char *paths[][2] = {
+        { "html", "www/index.html" },
+        { "jpg", "www/static/images/some_picture.jpg" },
+        { "unknown extension", "www/archive.tar.gz" },
+        { "no extension", "www/LICENSE" },
+    };
+    for (const auto& path : paths)
+    {
+        std::string file_path = path[1];
+        BenchResult result = bench_measure([&]() {
+            std::string mime = server.get_mime_type(file_path);
+            do_not_optimize(mime);
+        });
+        bench_report((std::string("get_mime_type ") + path[0]).c_str(), result);
+    }
+}
+
+// The caller's cost is what the request path pays
+static void bench_loggers()
+{
+    std::string message = "File not found: /static/images/some_picture.jpg";
+
+    {
+        std::ofstream null_stream("/dev/null");
+        std::streambuf *console = std::cout.rdbuf(null_stream.rdbuf());
+        ConsoleLogger logger;
+        bench_report("ConsoleLogger log", bench_measure([&]() { logger.log(message); }));
+        std::cout.rdbuf(console);
+    }
+    {
+        FileLogger logger;
+        bench_report("FileLogger log", bench_measure([&]() { logger.log(message); }));
+    }
+    {
+        // Block, dropped messages would flatter the producer
+        AsyncFileLogger logger("async", LOG_ROTATE_BYTES, LOG_ROTATE_SECONDS, LogOverflow::Block);
+        bench_report("AsyncFileLogger log", bench_measure([&]() { logger.log(message); }));
+    }
+    {
+        LogRing ring;
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (ring.create(LOG_RING_BYTES))
+        {
+            // Drained every 1024 lines so the ring never fills and drops
+            int written = 0;
+            bench_report("LogRing write + drain", bench_measure([&]() {
+                ring.write({ "File not found: ", "/static/images/some_picture.jpg" });
+                if (++written % 1024 == 0) ring.drain(null_fd);
+            }));
+        }
+        close(null_fd);
+    }
+}
+
+int main()
+{
+    char scratch[] = "/tmp/hot_path_bench.XXXXXX";
+    if (!mkdtemp(scratch))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::filesystem::path source = std::filesystem::current_path();
+    std::filesystem::create_directory_symlink(source / "certificates", std::string(scratch) + "/certificates");
+    std::filesystem::create_directory_symlink(source / "www", std::string(scratch) + "/www");
+    std::filesystem::current_path(scratch);
+
+    bench_parser();
+    bench_response();
+    bench_mime_types();
+    bench_loggers();
+
+    std::filesystem::current_path(source);
+    std::filesystem::remove_all(scratch);
+    return 0;
+}
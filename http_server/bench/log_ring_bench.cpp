@@ -0,0 +1,73 @@
+// Cost of one log line on the request path, shared memory ring against the SysV message queue
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <fcntl.h>
+#include <string>
+
+#include "bench.h"
+#include "../log_ring.cpp"
+
+struct QueueMessage {
+    long mtype;
+    char text[256];
+};
+
+int main()
+{
+    std::string path = "/static/images/some_picture.jpg";
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    // Producer and consumer timed apart, the ring is drained between batches so writes never drop
+    LogRing ring;
+    if (!ring.create(1024 * 1024)) return 1;
+    uint64_t write_ns = 0, drain_ns = 0, lines = 0;
+    while (write_ns + drain_ns < 400000000ULL) {
+        uint64_t start = bench_now_ns();
+        for (int i = 0; i < 4096; i++) ring.write({ "File not found: ", path });
+        uint64_t middle = bench_now_ns();
+        while (ring.drain(null_fd) > 0);
+        uint64_t end = bench_now_ns();
+        write_ns += middle - start;
+        drain_ns += end - middle;
+        lines += 4096;
+    }
+    double ring_write_ns = (double)write_ns / lines;
+    double ring_total_ns = (double)(write_ns + drain_ns) / lines;
+    bench_report("log ring write", ring_write_ns);
+    bench_report("log ring write + drain", ring_total_ns);
+    if (ring.dropped()) printf("log ring dropped %lu records\n", (unsigned long)ring.dropped());
+
+    // Previous path, msgsnd in the worker then msgrcv and fprintf + fflush in the logger
+    int queue = msgget(IPC_PRIVATE, IPC_CREAT | 0600);
+    if (queue < 0) {
+        perror("msgget");
+        return 1;
+    }
+    FILE *null_file = fdopen(dup(null_fd), "w");
+    double queue_send_ns = bench_run([&]() {
+        QueueMessage msg;
+        msg.mtype = 1;
+        snprintf(msg.text, sizeof(msg.text), "File not found: %s", path.c_str());
+        msgsnd(queue, &msg, sizeof(msg.text), 0);
+        msgrcv(queue, &msg, sizeof(msg.text), 0, IPC_NOWAIT);
+    });
+    bench_report("msgsnd + msgrcv", queue_send_ns);
+    double queue_total_ns = bench_run([&]() {
+        QueueMessage msg;
+        msg.mtype = 1;
+        snprintf(msg.text, sizeof(msg.text), "File not found: %s", path.c_str());
+        msgsnd(queue, &msg, sizeof(msg.text), 0);
+        if (msgrcv(queue, &msg, sizeof(msg.text), 0, IPC_NOWAIT) > 0) {
+            fprintf(null_file, "%s\n", msg.text);
+            fflush(null_file);
+        }
+    });
+    bench_report("msgsnd + msgrcv + fprintf/fflush", queue_total_ns);
+    msgctl(queue, IPC_RMID, nullptr);
+
+    printf("%-48s %10.1fx\n", "request path speedup", queue_send_ns / ring_write_ns);
+    printf("%-48s %10.1fx\n", "end to end speedup", queue_total_ns / ring_total_ns);
+    fclose(null_file);
+    close(null_fd);
+    return 0;
+}
@@ -0,0 +1,104 @@
+// Upload handling of the variant server in AAAAAAAAAAaa: its istringstream RequestParser, parse_files
+// collecting the parts in memory and the streaming MultipartParser as handle_client drives it, over
+// forms of different shapes
+#include <fstream>
+#include <random>
+
+#include "bench.h"
+#include "../AAAAAAAAAAaa/requestparser.cpp"
+
+#define BOUNDARY "----WebKitFormBoundary7MA4YWxkTrZu0gW"
+
+struct FormPart
+{
+    std::string name;
+    std::string filename;   // empty for a plain field
+    size_t size;
+};
+
+// Counts the bytes instead of writing them, so the stream case measures the parser and not the disk
+class DiscardHandler : public MultipartHandler
+{
+public:
+    bool begin(const FormPartHeaders&) override { return true; }
+    bool data(const char *, size_t length) override { bytes += length; return true; }
+    bool end() override { return true; }
+    size_t bytes = 0;
+};
+
+// Body bytes are random so no search gets lucky on repeated content
+static std::string build_request(const std::vector<FormPart>& parts)
+{
+    std::mt19937 random(42);
+    std::string body;
+    for (const FormPart& part : parts)
+    {
+        body += "--" BOUNDARY "\r\nContent-Disposition: form-data; name=\"" + part.name + "\"";
+        if (!part.filename.empty())
+        {
+            body += "; filename=\"" + part.filename + "\"\r\nContent-Type: application/octet-stream";
+        }
+        body += "\r\n\r\n";
+        for (size_t i = 0; i < part.size; i++) body += (char)random();
+        body += "\r\n";
+    }
+    body += "--" BOUNDARY "--\r\n";
+
+    return "POST /upload HTTP/1.1\r\n"
+           "Host: localhost:8080\r\n"
+           "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+           "Content-Type: multipart/form-data; boundary=" BOUNDARY "\r\n"
+           "Content-Length: " + std::to_string(body.size()) + "\r\n"
+           "\r\n" + body;
+}
+
+int main()
+{
+    std::vector<FormPart> many_files;
+    for (int i = 0; i < 10; i++) many_files.push_back({ "file" + std::to_string(i), "part" + std::to_string(i) + ".bin", 16 * 1024 });
+
+    const std::vector<std::pair<const char*, std::string>> corpus =
+    {
+        { "form + 1KB file", build_request({ { "title", "", 12 }, { "comment", "", 140 }, { "file", "notes.txt", 1024 } }) },
+        { "10 x 16KB files", build_request(many_files) },
+        { "1MB photo", build_request({ { "file", "photo.jpg", 1024 * 1024 } }) },
+    };
+
+    for (const auto& entry : corpus)
+    {
+        const std::string& raw = entry.second;
+        std::string name = entry.first;
+
+        BenchResult parse = bench_measure([&]() {
+            RequestParser parser(raw);
+            HttpRequest request = parser.parse();
+            do_not_optimize(request);
+        });
+        bench_report((name + " parse").c_str(), parse);
+
+        RequestParser parsed(raw);
+        parsed.parse();
+        BenchResult files = bench_measure([&]() {
+            std::vector<FormFile> result = parsed.parse_files();
+            do_not_optimize(result);
+        });
+        bench_report((name + " parse_files").c_str(), files);
+        printf("%-48s %10.2f GB/s\n", (name + " parse + parse_files").c_str(), raw.size() / (parse.ns + files.ns));
+
+        // Fed in socket reads of MULTIPART_CHUNK bytes, the way receive_upload does
+        std::string_view body(raw);
+        body.remove_prefix(body.find("\r\n\r\n") + 4);
+        BenchResult stream = bench_measure([&]() {
+            DiscardHandler handler;
+            MultipartParser parser(BOUNDARY, handler);
+            for (size_t pos = 0; pos < body.size(); pos += MULTIPART_CHUNK)
+            {
+                parser.feed(body.data() + pos, std::min(body.size() - pos, (size_t)MULTIPART_CHUNK));
+            }
+            do_not_optimize(handler.bytes);
+        });
+        bench_report((name + " stream").c_str(), stream);
+        printf("%-48s %10.2f GB/s\n", (name + " parse + stream").c_str(), raw.size() / (parse.ns + stream.ns));
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+// Compares the incremental RequestParser against the previous istringstream parser
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#include "bench.h"
+#include "corpus.h"
+#include "../requestparser.cpp"
+
+// Snapshot of the parser the server used before, without its debug printf
+namespace legacy
+{
+struct HttpRequest {
+    std::string method;
+    std::string path;
+    std::string version;
+    std::unordered_map<std::string, std::string> headers;
+};
+
+HttpRequest parse(const std::string& request_)
+{
+    std::istringstream stream(request_);
+    HttpRequest request;
+    std::string line;
+
+    if (std::getline(stream, line)) {
+        std::istringstream line_stream(line);
+        line_stream >> request.method >> request.path >> request.version;
+    }
+
+    while (std::getline(stream, line) && !line.empty()) {
+        size_t colon_pos = line.find(':');
+        if (colon_pos != std::string::npos) {
+            std::string key = line.substr(0, colon_pos);
+            std::string value = line.substr(colon_pos + 1);
+            while (!value.empty() && (value[0] == ' ' || value[0] == '\t')) {
+                value.erase(0, 1);
+            }
+            request.headers[key] = value;
+        }
+    }
+    return request;
+}
+}
+
+int main()
+{
+    for (const auto& entry : corpus)
+    {
+        const std::string& raw = entry.second;
+        std::string name = entry.first;
+
+        BenchResult old = bench_measure([&]() {
+            legacy::HttpRequest request = legacy::parse(raw);
+            do_not_optimize(request);
+        });
+        bench_report((name + " istringstream").c_str(), old);
+
+        // Every kernel set this CPU can run, the last one is what the server picks
+        std::vector<const ScanKernels*> kernels = { &scalar_kernels };
+#if defined(__x86_64__)
+        kernels.push_back(&sse2_kernels);
+        if (__builtin_cpu_supports("avx2")) kernels.push_back(&avx2_kernels);
+#endif
+        double new_ns = 0;
+        double scalar_ns = 0;
+        for (const ScanKernels *set : kernels)
+        {
+            scan_kernels = set;
+            BenchResult current = bench_measure([&]() {
+                RequestParser parser;
+                HttpRequest request;
+                ParseStatus status = parser.parse(raw.data(), raw.size(), request);
+                do_not_optimize(status);
+                do_not_optimize(request);
+            });
+            bench_report((name + " incremental " + set->name).c_str(), current);
+            new_ns = current.ns;
+            if (set == &scalar_kernels) scalar_ns = new_ns;
+
+            // Same request arriving in 64 byte reads, the parser is resumed after each one
+            BenchResult split = bench_measure([&]() {
+                RequestParser parser;
+                HttpRequest request;
+                ParseStatus status = ParseStatus::INCOMPLETE;
+                for (size_t length = 64; status == ParseStatus::INCOMPLETE; length += 64)
+                {
+                    status = parser.parse(raw.data(), std::min(length, raw.size()), request);
+                }
+                do_not_optimize(request);
+            });
+            bench_report((name + " incremental " + set->name + ", 64B reads").c_str(), split);
+        }
+        printf("%-48s %10.1fx\n", (name + " speedup").c_str(), old.ns / new_ns);
+        printf("%-48s %10.1fx\n", (name + " simd vs scalar").c_str(), scalar_ns / new_ns);
+    }
+    return 0;
+}
@@ -0,0 +1,778 @@
+// TLS load generator for the server, every connection is driven from a per-thread epoll loop:
+//   make client && ./client --connections 50 --duration 10 /index.html
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.cpp"
+
+#define CLIENT_MAX_EVENTS   256
+#define CLIENT_READ_SIZE    16384
+#define CLIENT_TIMEOUT_MS   10000   // a request still unanswered after this counts as an error
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct ClientOptions
+{
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    std::string path = "/";
+    int threads = 1;
+    int connections = 10;
+    double duration_s = 10;
+    uint64_t requests = 0;          // stop after this many instead of the duration, 0 for no limit
+    double rate = 0;                // open loop requests per second over all connections, 0 for closed loop
+    bool keep_alive = true;
+    bool resume = false;            // offer the last session to new connections
+    std::string upload;             // file sent as multipart/form-data with every request
+};
+
+// Incremental HTTP/1.1 response reader. Only the head is buffered, body bytes are counted and dropped
+class ResponseReader
+{
+public:
+    enum Result { MORE, DONE, FAILED };
+
+    void reset()
+    {
+        head_.clear();
+        in_body_ = false;
+        status = 0;
+        close = false;
+        body_mode_ = LENGTH;
+        remaining_ = 0;
+        chunk_state_ = SIZE;
+        line_.clear();
+    }
+
+    // Everything after the end of the response is ignored, requests are never pipelined
+    Result feed(const char *data, size_t length)
+    {
+        size_t used = 0;
+        if (!in_body_)
+        {
+            size_t before = head_.size();
+            head_.append(data, length);
+            size_t end = head_.find("\r\n\r\n", before > 3 ? before - 3 : 0);
+            if (end == std::string::npos) return head_.size() > 65536 ? FAILED : MORE;
+            if (!parse_head(end)) return FAILED;
+            used = end + 4 - before;
+            in_body_ = true;
+            if (body_mode_ == LENGTH && remaining_ == 0) return DONE;
+        }
+        return feed_body(data + used, length - used);
+    }
+
+    // The server closed the connection, which only completes a response without framing
+    Result finish() const { return in_body_ && body_mode_ == UNTIL_CLOSE ? DONE : FAILED; }
+    bool started() const { return !head_.empty(); }
+
+    int status = 0;
+    bool close = false;             // the server will not take another request on this connection
+
+private:
+    enum BodyMode { LENGTH, CHUNKED, UNTIL_CLOSE };
+    enum ChunkState { SIZE, DATA, DATA_END, TRAILER };
+
+    std::string head_;
+    bool in_body_ = false;
+    BodyMode body_mode_ = LENGTH;
+    uint64_t remaining_ = 0;
+    ChunkState chunk_state_ = SIZE;
+    std::string line_;
+
+    bool parse_head(size_t end)
+    {
+        if (head_.compare(0, 5, "HTTP/") != 0 || head_.size() < 12) return false;
+        close = head_.compare(0, 8, "HTTP/1.0") == 0;
+        status = atoi(head_.c_str() + 9);
+        bool has_length = false;
+
+        size_t pos = head_.find("\r\n") + 2;
+        while (pos < end)
+        {
+            size_t line_end = head_.find("\r\n", pos);
+            size_t colon = head_.find(':', pos);
+            if (colon < line_end)
+            {
+                std::string name = head_.substr(pos, colon - pos);
+                size_t value_start = head_.find_first_not_of(" \t", colon + 1);
+                std::string value = head_.substr(value_start, line_end - value_start);
+                if (strcasecmp(name.c_str(), "Content-Length") == 0)
+                {
+                    remaining_ = strtoull(value.c_str(), NULL, 10);
+                    has_length = true;
+                }
+                else if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0 && strcasestr(value.c_str(), "chunked"))
+                {
+                    body_mode_ = CHUNKED;
+                }
+                else if (strcasecmp(name.c_str(), "Connection") == 0)
+                {
+                    if (strcasestr(value.c_str(), "close")) close = true;
+                    else if (strcasestr(value.c_str(), "keep-alive")) close = false;
+                }
+            }
+            pos = line_end + 2;
+        }
+        if (body_mode_ != CHUNKED && !has_length)
+        {
+            // 204 and 304 never carry a body, anything else without framing runs until the server closes
+            body_mode_ = status == 204 || status == 304 ? LENGTH : UNTIL_CLOSE;
+            if (body_mode_ == UNTIL_CLOSE) close = true;
+        }
+        return true;
+    }
+
+    Result feed_body(const char *data, size_t length)
+    {
+        if (body_mode_ == UNTIL_CLOSE) return MORE;
+        if (body_mode_ == LENGTH)
+        {
+            remaining_ -= std::min<uint64_t>(remaining_, length);
+            return remaining_ == 0 ? DONE : MORE;
+        }
+
+        for (size_t i = 0; i < length; )
+        {
+            if (chunk_state_ == DATA)
+            {
+                size_t n = std::min<uint64_t>(remaining_, length - i);
+                remaining_ -= n;
+                i += n;
+                if (remaining_ == 0) chunk_state_ = DATA_END;
+                continue;
+            }
+            char c = data[i++];
+            if (c != '\n')
+            {
+                line_ += c;
+                if (line_.size() > 1024) return FAILED;
+                continue;
+            }
+            if (!line_.empty() && line_.back() == '\r') line_.pop_back();
+            if (chunk_state_ == SIZE)
+            {
+                char *end;
+                remaining_ = strtoull(line_.c_str(), &end, 16);
+                if (end == line_.c_str()) return FAILED;
+                chunk_state_ = remaining_ == 0 ? TRAILER : DATA;
+            }
+            else if (chunk_state_ == DATA_END)
+            {
+                if (!line_.empty()) return FAILED;
+                chunk_state_ = SIZE;
+            }
+            else if (line_.empty())
+            {
+                return DONE;
+            }
+            line_.clear();
+        }
+        return MORE;
+    }
+};
+
+enum class ClientState
+{
+    IDLE,           // waiting for the next request to be due
+    CONNECTING,
+    HANDSHAKE,
+    WRITING,
+    READING
+};
+
+struct ClientConnection
+{
+    int fd = -1;
+    SSL *ssl = nullptr;
+    ClientState state = ClientState::IDLE;
+    size_t out_offset = 0;
+    ResponseReader reader;
+    uint64_t due = 0;           // when the next request should start, open loop only
+    uint64_t intended = 0;      // when the current request should have started
+    uint64_t started = 0;       // when it actually did
+    bool reused = false;        // the current request went out on a connection that already served one
+    bool retried = false;
+    bool finished = false;      // no more requests for this connection
+    SSL_SESSION *session = nullptr;     // offered on the next connect with --resume, like a returning user
+};
+
+struct ThreadResult
+{
+    LatencyHistogram latency;   // from the intended start, corrects for coordinated omission in open loop
+    LatencyHistogram service;   // from the actual start
+    uint64_t completed = 0;
+    uint64_t errors = 0;
+    uint64_t non_2xx = 0;
+    uint64_t bytes = 0;
+    uint64_t connects = 0;
+    uint64_t resumed = 0;
+    uint64_t retries = 0;
+};
+
+class LoadThread
+{
+public:
+    LoadThread(const ClientOptions& options, SSL_CTX *ctx, const struct sockaddr_in& address, const std::string& request,
+               int connections, uint64_t first_due, uint64_t interval, std::atomic<uint64_t>& issued)
+        : result(new ThreadResult()), options_(options), ctx_(ctx), address_(address), request_(request),
+          connections_(connections), first_due_(first_due), interval_(interval), issued_(issued) {}
+
+    void run(uint64_t start, uint64_t end);
+    std::unique_ptr<ThreadResult> result;
+
+private:
+    const ClientOptions& options_;
+    SSL_CTX *ctx_;
+    struct sockaddr_in address_;
+    const std::string& request_;
+    int connections_;
+    uint64_t first_due_;            // offset of this thread's first connection, spreads the open loop schedule
+    uint64_t interval_;             // between two requests of one connection in open loop
+    std::atomic<uint64_t>& issued_;
+    int epoll_fd_ = -1;
+    int timer_fd_ = -1;             // next due request in open loop, epoll_wait only has millisecond timeouts
+    std::vector<ClientConnection> conns_;
+
+    void start_request(ClientConnection& conn, uint64_t now);
+    bool open_connection(ClientConnection& conn);
+    void close_connection(ClientConnection& conn);
+    void handle(ClientConnection& conn, uint32_t events);
+    void fail(ClientConnection& conn);
+    void complete(ClientConnection& conn);
+    void step_handshake(ClientConnection& conn);
+    void step_write(ClientConnection& conn);
+    void step_read(ClientConnection& conn);
+    void watch(ClientConnection& conn, uint32_t events);
+    bool stopping(uint64_t now) const { return now >= end_; }
+    uint64_t end_ = 0;
+};
+
+void LoadThread::run(uint64_t start, uint64_t end)
+{
+    end_ = end;
+    epoll_fd_ = epoll_create1(0);
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event timer_event = {};
+    timer_event.data.u32 = UINT32_MAX;
+    timer_event.events = EPOLLIN;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &timer_event);
+    conns_.resize(connections_);
+    for (int i = 0; i < connections_; i++)
+    {
+        conns_[i].due = start + first_due_ + i * (options_.rate > 0 ? interval_ / connections_ : 0);
+    }
+
+    struct epoll_event events[CLIENT_MAX_EVENTS];
+    while (1)
+    {
+        uint64_t now = now_ns();
+        bool active = false;
+        uint64_t next_due = UINT64_MAX;
+        for (size_t i = 0; i < conns_.size(); i++)
+        {
+            ClientConnection& conn = conns_[i];
+            if (conn.finished) continue;
+            if (conn.state == ClientState::IDLE)
+            {
+                if (stopping(now) || (options_.requests && issued_.load(std::memory_order_relaxed) >= options_.requests))
+                {
+                    close_connection(conn);
+                    conn.finished = true;
+                    continue;
+                }
+                if (conn.due <= now)
+                {
+                    start_request(conn, now);
+                }
+                else
+                {
+                    next_due = std::min(next_due, conn.due);
+                }
+            }
+            else if (now - conn.started > (uint64_t)CLIENT_TIMEOUT_MS * 1000000)
+            {
+                fail(conn);
+            }
+            active = active || !conn.finished;
+        }
+        if (!active) break;
+
+        struct itimerspec timer = {};
+        if (next_due != UINT64_MAX)
+        {
+            timer.it_value.tv_sec = next_due / 1000000000;
+            timer.it_value.tv_nsec = next_due % 1000000000;
+        }
+        timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &timer, NULL);
+
+        int ready = epoll_wait(epoll_fd_, events, CLIENT_MAX_EVENTS, 100);
+        for (int i = 0; i < ready; i++)
+        {
+            // The timer only wakes the loop, the due connections are found on the next pass
+            uint64_t expirations;
+            if (events[i].data.u32 != UINT32_MAX) handle(conns_[events[i].data.u32], events[i].events);
+            else if (read(timer_fd_, &expirations, sizeof(expirations)) < 0) perror("read timerfd");
+        }
+    }
+
+    for (ClientConnection& conn : conns_)
+    {
+        close_connection(conn);
+        if (conn.session) SSL_SESSION_free(conn.session);
+    }
+    close(timer_fd_);
+    close(epoll_fd_);
+}
+
+void LoadThread::start_request(ClientConnection& conn, uint64_t now)
+{
+    if (options_.requests && issued_.fetch_add(1, std::memory_order_relaxed) >= options_.requests)
+    {
+        close_connection(conn);
+        conn.finished = true;
+        return;
+    }
+    // Open loop requests keep their slot in the schedule however late they start
+    conn.intended = options_.rate > 0 ? conn.due : now;
+    conn.due += interval_;
+    conn.started = now;
+    conn.retried = false;
+    conn.reader.reset();
+    conn.out_offset = 0;
+
+    if (conn.fd >= 0)
+    {
+        conn.reused = true;
+        conn.state = ClientState::WRITING;
+        step_write(conn);
+        return;
+    }
+    conn.reused = false;
+    if (!open_connection(conn)) fail(conn);
+}
+
+bool LoadThread::open_connection(ClientConnection& conn)
+{
+    conn.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn.fd < 0) return false;
+    int one = 1;
+    setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    result->connects++;
+
+    conn.ssl = SSL_new(ctx_);
+    SSL_set_fd(conn.ssl, conn.fd);
+    SSL_set_tlsext_host_name(conn.ssl, options_.host.c_str());
+    if (conn.session) SSL_set_session(conn.ssl, conn.session);
+
+    struct epoll_event ev = {};
+    ev.data.u32 = &conn - conns_.data();
+    ev.events = EPOLLOUT;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, conn.fd, &ev);
+    if (connect(conn.fd, (struct sockaddr*)&address_, sizeof(address_)) < 0 && errno != EINPROGRESS)
+    {
+        return false;
+    }
+    conn.state = ClientState::CONNECTING;
+    return true;
+}
+
+void LoadThread::close_connection(ClientConnection& conn)
+{
+    if (conn.ssl)
+    {
+        // The ticket of a finished exchange is the one worth resuming, TLS 1.3 tickets are single use
+        if (options_.resume && conn.state == ClientState::IDLE && SSL_is_init_finished(conn.ssl))
+        {
+            SSL_SESSION *session = SSL_get1_session(conn.ssl);
+            if (session && SSL_SESSION_is_resumable(session))
+            {
+                if (conn.session) SSL_SESSION_free(conn.session);
+                conn.session = session;
+            }
+            else if (session)
+            {
+                SSL_SESSION_free(session);
+            }
+        }
+        // Freed without a shutdown OpenSSL marks the session as not resumable, the quiet one sends nothing
+        SSL_set_quiet_shutdown(conn.ssl, 1);
+        SSL_shutdown(conn.ssl);
+        SSL_free(conn.ssl);
+        conn.ssl = nullptr;
+    }
+    if (conn.fd >= 0)
+    {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, conn.fd, NULL);
+        close(conn.fd);
+        conn.fd = -1;
+    }
+}
+
+void LoadThread::watch(ClientConnection& conn, uint32_t events)
+{
+    struct epoll_event ev = {};
+    ev.data.u32 = &conn - conns_.data();
+    ev.events = events;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn.fd, &ev);
+}
+
+void LoadThread::handle(ClientConnection& conn, uint32_t events)
+{
+    switch (conn.state)
+    {
+    case ClientState::CONNECTING:
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error || (events & EPOLLERR))
+        {
+            fail(conn);
+            return;
+        }
+        conn.state = ClientState::HANDSHAKE;
+        step_handshake(conn);
+        break;
+    }
+    case ClientState::HANDSHAKE:
+        step_handshake(conn);
+        break;
+    case ClientState::WRITING:
+        step_write(conn);
+        break;
+    case ClientState::READING:
+        step_read(conn);
+        break;
+    case ClientState::IDLE:
+        // The server closed an idle keep-alive connection, reconnect with the next request
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) close_connection(conn);
+        break;
+    }
+}
+
+void LoadThread::step_handshake(ClientConnection& conn)
+{
+    int ret = SSL_connect(conn.ssl);
+    if (ret == 1)
+    {
+        if (SSL_session_reused(conn.ssl)) result->resumed++;
+        conn.state = ClientState::WRITING;
+        step_write(conn);
+        return;
+    }
+    int err = SSL_get_error(conn.ssl, ret);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    {
+        watch(conn, err == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT);
+        return;
+    }
+    fail(conn);
+}
+
+void LoadThread::step_write(ClientConnection& conn)
+{
+    while (conn.out_offset < request_.size())
+    {
+        int written = SSL_write(conn.ssl, request_.data() + conn.out_offset, request_.size() - conn.out_offset);
+        if (written > 0)
+        {
+            conn.out_offset += written;
+            continue;
+        }
+        int err = SSL_get_error(conn.ssl, written);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+        {
+            watch(conn, err == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT);
+            return;
+        }
+        fail(conn);
+        return;
+    }
+    conn.state = ClientState::READING;
+    watch(conn, EPOLLIN);
+    step_read(conn);
+}
+
+void LoadThread::step_read(ClientConnection& conn)
+{
+    char buffer[CLIENT_READ_SIZE];
+    while (1)
+    {
+        int got = SSL_read(conn.ssl, buffer, sizeof(buffer));
+        if (got > 0)
+        {
+            result->bytes += got;
+            ResponseReader::Result state = conn.reader.feed(buffer, got);
+            if (state == ResponseReader::DONE)
+            {
+                complete(conn);
+                return;
+            }
+            if (state == ResponseReader::FAILED)
+            {
+                fail(conn);
+                return;
+            }
+            continue;
+        }
+        int err = SSL_get_error(conn.ssl, got);
+        if (err == SSL_ERROR_WANT_READ) return;
+        if (err == SSL_ERROR_WANT_WRITE)
+        {
+            watch(conn, EPOLLOUT);
+            return;
+        }
+        if (err == SSL_ERROR_ZERO_RETURN || err == SSL_ERROR_SYSCALL)
+        {
+            if (conn.reader.finish() == ResponseReader::DONE)
+            {
+                complete(conn);
+                return;
+            }
+            // A keep-alive connection the server gave up on, like browsers retry once on a fresh one
+            if (conn.reused && !conn.reader.started() && !conn.retried)
+            {
+                close_connection(conn);
+                result->retries++;
+                conn.retried = true;
+                conn.reused = false;
+                conn.out_offset = 0;
+                if (!open_connection(conn)) fail(conn);
+                return;
+            }
+        }
+        fail(conn);
+        return;
+    }
+}
+
+void LoadThread::complete(ClientConnection& conn)
+{
+    uint64_t now = now_ns();
+    result->completed++;
+    if (conn.reader.status < 200 || conn.reader.status > 299) result->non_2xx++;
+    result->latency.record((now - conn.intended) / 1000);
+    result->service.record((now - conn.started) / 1000);
+    conn.state = ClientState::IDLE;
+    if (!options_.keep_alive || conn.reader.close)
+    {
+        close_connection(conn);
+    }
+    else
+    {
+        watch(conn, EPOLLIN);
+    }
+}
+
+void LoadThread::fail(ClientConnection& conn)
+{
+    result->errors++;
+    conn.state = ClientState::IDLE;
+    close_connection(conn);
+    // Closed loop would spin on a server that refuses connections
+    if (options_.rate <= 0) conn.due = now_ns() + 10000000;
+}
+
+static std::string build_request(const ClientOptions& options)
+{
+    std::string host = options.host + ":" + std::to_string(options.port);
+    std::string request;
+    if (options.upload.empty())
+    {
+        request = "GET " + options.path + " HTTP/1.1\r\nHost: " + host + "\r\nUser-Agent: ivos-client\r\n";
+        if (!options.keep_alive) request += "Connection: close\r\n";
+        return request + "\r\n";
+    }
+
+    std::ifstream file(options.upload, std::ios::binary);
+    if (!file)
+    {
+        fprintf(stderr, "Cannot read %s\n", options.upload.c_str());
+        exit(1);
+    }
+    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    std::string name = options.upload.substr(options.upload.find_last_of('/') + 1);
+    std::string boundary = "----ivos-client-boundary-7d3f9a";
+    std::string body = "--" + boundary + "\r\nContent-Disposition: form-data; name=\"file\"; filename=\"" + name +
+                       "\"\r\nContent-Type: application/octet-stream\r\n\r\n" + content + "\r\n--" + boundary + "--\r\n";
+    request = "POST " + options.path + " HTTP/1.1\r\nHost: " + host + "\r\nUser-Agent: ivos-client\r\n" +
+              "Content-Type: multipart/form-data; boundary=" + boundary + "\r\nContent-Length: " +
+              std::to_string(body.size()) + "\r\n";
+    if (!options.keep_alive) request += "Connection: close\r\n";
+    return request + "\r\n" + body;
+}
+
+static void print_latency(const char *title, const LatencySnapshot& snapshot)
+{
+    if (snapshot.total == 0) return;
+    printf("%s\n", title);
+    printf("  %-6s %9.3f ms\n", "mean", snapshot.sum_us / 1e3 / snapshot.total);
+    static const double quantiles[] = { 0.5, 0.75, 0.9, 0.99, 0.999, 0.9999, 1.0 };
+    static const char *labels[] = { "p50", "p75", "p90", "p99", "p99.9", "p99.99", "max" };
+    for (int i = 0; i < 7; i++)
+    {
+        printf("  %-6s %9.3f ms\n", labels[i], snapshot.quantile(quantiles[i]) / 1e3);
+    }
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [--host H] [--port P] [--threads N] [--connections N] [--duration S | --requests N]\n"
+                    "          [--rate R] [--no-keepalive] [--resume] [--upload FILE] [PATH]\n", program);
+    fprintf(stderr, "  --connections   concurrent connections, split over the threads (default 10)\n");
+    fprintf(stderr, "  --rate          open loop: R requests per second in total on a fixed schedule, latency is\n"
+                    "                  measured from the scheduled start so stalls are not hidden (coordinated omission)\n");
+    fprintf(stderr, "  --no-keepalive  a new connection and handshake for every request\n");
+    fprintf(stderr, "  --resume        offer the previous TLS session when connecting again\n");
+    fprintf(stderr, "  --upload        POST FILE as multipart/form-data to PATH instead of GET\n");
+}
+
+int main(int argc, char *argv[])
+{
+    ClientOptions options;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--host" && has_value) options.host = argv[++i];
+        else if (arg == "--port" && has_value) options.port = atoi(argv[++i]);
+        else if (arg == "--threads" && has_value) options.threads = atoi(argv[++i]);
+        else if (arg == "--connections" && has_value) options.connections = atoi(argv[++i]);
+        else if (arg == "--duration" && has_value) options.duration_s = atof(argv[++i]);
+        else if (arg == "--requests" && has_value) options.requests = strtoull(argv[++i], NULL, 10);
+        else if (arg == "--rate" && has_value) options.rate = atof(argv[++i]);
+        else if (arg == "--no-keepalive") options.keep_alive = false;
+        else if (arg == "--resume") options.resume = true;
+        else if (arg == "--upload" && has_value) options.upload = argv[++i];
+        else if (arg[0] == '/') options.path = arg;
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.threads < 1 || options.connections < options.threads)
+    {
+        fprintf(stderr, "Need at least one connection per thread\n");
+        return 1;
+    }
+    if (options.requests) options.duration_s = 3600;
+
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.port);
+    struct hostent *host = gethostbyname(options.host.c_str());
+    if (!host)
+    {
+        fprintf(stderr, "Unknown host %s\n", options.host.c_str());
+        return 1;
+    }
+    memcpy(&address.sin_addr, host->h_addr_list[0], sizeof(address.sin_addr));
+
+    signal(SIGPIPE, SIG_IGN);
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    // The server runs with a self-signed certificate on localhost
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+
+    std::string request = build_request(options);
+    std::atomic<uint64_t> issued{0};
+    // Open loop: connection k of the whole run starts at k / rate, then repeats every connections / rate
+    uint64_t interval = options.rate > 0 ? (uint64_t)(1e9 * options.connections / options.rate) : 0;
+    std::vector<std::unique_ptr<LoadThread>> loads;
+    int assigned = 0;
+    for (int t = 0; t < options.threads; t++)
+    {
+        int count = options.connections / options.threads + (t < options.connections % options.threads);
+        uint64_t first_due = options.rate > 0 ? (uint64_t)(1e9 * assigned / options.rate) : 0;
+        loads.emplace_back(new LoadThread(options, ctx, address, request, count, first_due, interval, issued));
+        assigned += count;
+    }
+
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(options.duration_s * 1e9);
+    std::vector<std::thread> threads;
+    for (auto& load : loads)
+    {
+        threads.emplace_back(&LoadThread::run, load.get(), start, end);
+    }
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    ThreadResult total{};
+    LatencySnapshot latency, service;
+    for (auto& load : loads)
+    {
+        ThreadResult& part = *load->result;
+        latency.add(part.latency);
+        service.add(part.service);
+        total.completed += part.completed;
+        total.errors += part.errors;
+        total.non_2xx += part.non_2xx;
+        total.bytes += part.bytes;
+        total.connects += part.connects;
+        total.resumed += part.resumed;
+        total.retries += part.retries;
+    }
+
+    printf("Target:       https://%s:%d%s%s\n", options.host.c_str(), options.port, options.path.c_str(),
+           options.upload.empty() ? "" : (" (upload " + options.upload + ")").c_str());
+    if (options.rate > 0)
+    {
+        printf("Mode:         open loop at %.1f req/s, %d connections, %d threads, %s\n", options.rate, options.connections,
+               options.threads, options.keep_alive ? "keep-alive" : "connection per request");
+    }
+    else
+    {
+        printf("Mode:         closed loop, %d connections, %d threads, %s\n", options.connections, options.threads,
+               options.keep_alive ? "keep-alive" : "connection per request");
+    }
+    printf("Requests:     %lu completed, %lu errors, %lu non-2xx, %lu retried on a fresh connection\n",
+           (unsigned long)total.completed, (unsigned long)total.errors, (unsigned long)total.non_2xx,
+           (unsigned long)total.retries);
+    printf("Connections:  %lu opened, %lu resumed TLS sessions\n", (unsigned long)total.connects, (unsigned long)total.resumed);
+    printf("Throughput:   %.1f req/s, %.2f MB/s received over %.2f s\n", total.completed / elapsed,
+           total.bytes / elapsed / 1e6, elapsed);
+    if (options.rate > 0)
+    {
+        print_latency("Latency from the scheduled start (corrected for coordinated omission):", latency);
+        print_latency("Service time from the actual start:", service);
+    }
+    else
+    {
+        // A closed loop only sends when a response came back, its stalls hide the requests that would have queued
+        print_latency("Latency (closed loop, not corrected for coordinated omission, use --rate):", service);
+    }
+    SSL_CTX_free(ctx);
+    return total.errors ? 2 : 0;
+}
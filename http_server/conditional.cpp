@@ -0,0 +1,82 @@
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <string_view>
+
+#define ETAG_MAX    64      // quoted ETag with its terminator, as stored in the file cache
+
+// Strong validator from the inode, size and nanosecond modification time. Any write or replacement
+// of the file changes it and nothing of the content has to be read
+static std::string make_etag(const struct stat& st)
+{
+    char etag[ETAG_MAX];
+    uint64_t mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx\"", (unsigned long)st.st_ino, (unsigned long)st.st_size,
+             (unsigned long)mtime_ns);
+    return etag;
+}
+
+// IMF-fixdate as used by Last-Modified, the only date format we generate
+static std::string http_date(time_t time)
+{
+    struct tm gmt;
+    gmtime_r(&time, &gmt);
+    char text[32];
+    size_t length = strftime(text, sizeof(text), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+    return std::string(text, length);
+}
+
+// Accepts the IMF-fixdate and the two obsolete formats recipients must still understand (RFC 9110 5.6.7)
+static bool parse_http_date(std::string_view value, time_t& time)
+{
+    static const char *formats[] = { "%a, %d %b %Y %H:%M:%S GMT", "%A, %d-%b-%y %H:%M:%S GMT", "%a %b %e %H:%M:%S %Y" };
+    if (value.size() >= 64) return false;
+    char text[64];
+    memcpy(text, value.data(), value.size());
+    text[value.size()] = '\0';
+    for (const char *format : formats)
+    {
+        struct tm parsed = {};
+        const char *end = strptime(text, format, &parsed);
+        if (end && *end == '\0')
+        {
+            time = timegm(&parsed);
+            return true;
+        }
+    }
+    return false;
+}
+
+// If-None-Match list against our tag with the weak comparison, "*" matches any existing file
+static bool etag_list_matches(std::string_view list, std::string_view etag)
+{
+    while (!list.empty())
+    {
+        size_t comma = list.find(',');
+        std::string_view tag = list.substr(0, comma);
+        list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+
+        while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) tag.remove_prefix(1);
+        while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) tag.remove_suffix(1);
+        if (tag == "*") return true;
+        if (tag.substr(0, 2) == "W/") tag.remove_prefix(2);
+        if (tag == etag) return true;
+    }
+    return false;
+}
+
+// RFC 9110 13.2.2 for GET: If-None-Match decides when present, If-Modified-Since only counts without it
+static bool not_modified(const HttpRequest& request, std::string_view etag, time_t mtime)
+{
+    if (request.method != "GET" && request.method != "HEAD") return false;
+
+    std::string_view if_none_match = request.header("If-None-Match");
+    if (!if_none_match.empty()) return etag_list_matches(if_none_match, etag);
+
+    std::string_view if_modified_since = request.header("If-Modified-Since");
+    time_t since;
+    return !if_modified_since.empty() && parse_http_date(if_modified_since, since) && mtime <= since;
+}
@@ -0,0 +1,51 @@
+#include <openssl/ssl.h>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+
+enum class ConnState
+{
+    HANDSHAKE,
+    READING,
+    WRITING,
+    CLOSING
+};
+
+struct Connection
+{
+    int fd;
+    SSL *ssl;
+    ConnState state;
+    std::string in;         // bytes read but not yet consumed by a request
+    RequestParser parser;   // progress through the request head at the front of in
+    std::string out;        // response bytes waiting for SSL_write
+    size_t out_offset;      // how much of out was already written
+    bool want_write;        // last SSL call asked for EPOLLOUT
+    uint32_t events;        // mask currently registered with epoll
+    bool shed;              // answer with the 503 page right after the handshake
+    bool close_after_write; // close once out is flushed
+    uint64_t request_start; // monotonic ns when the current request was parsed
+    bool ktls;              // kernel TLS send offload is active, bodies go out with SSL_sendfile
+    int file_fd;            // body still to be sent after out, -1 when none
+    off_t file_offset;
+    size_t file_remaining;
+    std::vector<RangePart> parts;   // multipart/byteranges parts sharing file_fd, sent after the current span
+    size_t next_part;
+    TimerNode timer;        // idle, header or body timeout depending on what we wait for
+    uint64_t head_start;    // monotonic ms when the first byte of the pending request head arrived
+    size_t body_remaining;  // request body bytes still to be read and dropped
+    uint32_t requests;      // requests served on this connection
+    uint64_t handshake_start;   // monotonic ns when the connection was handed to this worker
+    uint64_t handshake_cpu;     // ns spent inside SSL_do_handshake so far
+    RequestTrace trace;         // phases of the request in progress, for the access log and --trace
+
+    Connection(int fd, SSL *ssl) : fd(fd), ssl(ssl), state(ConnState::HANDSHAKE), out_offset(0), want_write(false),
+                                   events(0), shed(false), close_after_write(false), request_start(0),
+                                   ktls(false), file_fd(-1), file_offset(0), file_remaining(0), next_part(0),
+                                   head_start(0), body_remaining(0), requests(0), handshake_start(0),
+                                   handshake_cpu(0)
+    {
+        timer.owner = this;
+    }
+};
@@ -1,6 +1,38 @@
 #define PORT                8080
 #define SEM_NAME            "/semaphore"
-#define MAX_WORKERS         2
+#define MIN_WORKERS         2
+#define MAX_WORKERS         16      // scoreboard slots, upper bound for --max-workers
+#define WORKER_CONNECTIONS  1024    // worker load at which new connections get the 503 page
+#define MASTER_SHED_MAX     64      // connections the master answers with the 503 page itself when no worker can take them
+#define MASTER_SHED_TIMEOUT_MS 1000 // time the master gives such a connection for the handshake and the page
+#define SCALE_INTERVAL_MS   500
+#define GROW_LOAD           256     // average worker load that adds a worker
+#define GROW_LATENCY_US     50000   // or average request latency that adds a worker
+#define SHRINK_LOAD         16      // average worker load below which the pool may shrink
+#define SHRINK_TICKS        10      // consecutive quiet intervals before a worker is retired
+#define MAX_EVENTS          256
+#define READ_BUFFER_SIZE    16384
+#define MAX_REQUEST_SIZE    65536
+#define MAX_BODY_SIZE       (1024 * 1024)   // request bodies are read and discarded up to this size
+#define KEEPALIVE_REQUESTS  1000    // requests served on one connection before it is closed
+#define KEEPALIVE_TIMEOUT_MS 15000  // idle time allowed between requests
+#define HEADER_TIMEOUT_MS   10000   // time to receive a whole request head once it started
+#define BODY_TIMEOUT_MS     30000   // time allowed between two reads of a request body
+#define HANDSHAKE_TIMEOUT_MS 10000  // time to complete the TLS handshake after the connection reached a worker
+#define HANDSHAKES_PER_LOOP 32      // handshake steps per event loop pass, the rest wait behind established connections
+#define TIMER_TICK_MS       100
+#define FILE_CHUNK_SIZE     65536   // pread chunk when kTLS is not available
+#define FILE_CACHE_BYTES    (64 * 1024 * 1024)  // shared static file cache budget, --cache-bytes
+#define FILE_CACHE_MAX_FILE (1024 * 1024)       // larger files are always streamed from disk
+#define SESSION_CACHE_ENTRIES 4096  // shared TLS session ID cache slots, --session-cache
+#define TICKET_KEY_LIFETIME_S 3600  // ticket key rotation period, also the session lifetime
+#define TLS_REPORT_INTERVAL_MS 10000
+#define LOG_RING_BYTES      (1024 * 1024)   // shared log ring, records are dropped while it is full
+#define LOG_DIRECTORY       "logs"          // rotating log files, named by the minute they were opened
+#define CACHE_CONTROL_DEFAULT "no-cache"                  // always revalidated, answered with 304 while unchanged
+#define CACHE_CONTROL_ASSETS  "public, max-age=3600"      // stylesheets and scripts
+#define CACHE_CONTROL_IMAGES  "public, max-age=86400"
+#define METRICS_PATH        "/metrics"      // reserved, answered with Prometheus text instead of a file
 #define INDEX_PATH          "www/index.html"
 #define FILE_NOT_FOUND_PATH "www/404.html"
 #define SERVICE_UNAVAILABLE "www/503.html"
@@ -0,0 +1,474 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#define FILE_CACHE_ENTRIES  1024
+#define FILE_CACHE_PATH_MAX 256
+#define FILE_CACHE_ALIGN    64
+#define FILE_CACHE_PINS     64      // processes holding entries at the same time, beyond that acquire misses
+
+enum class CacheState : uint8_t
+{
+    FREE,
+    LOADING,    // space reserved, a worker is reading the file into it
+    READY
+};
+
+struct CacheEntry
+{
+    CacheState state;
+    bool stale;             // invalidated while loading or pinned, freed as soon as nobody uses it
+    uint32_t hash;
+    uint32_t refs;          // workers currently copying out of the entry
+    pid_t owner;            // worker loading the entry
+    uint64_t last_used;     // LRU clock value of the last hit
+    size_t offset;          // header fields followed by the body in the arena
+    size_t header_len;
+    size_t body_len;
+    off_t size;
+    time_t mtime;
+    ino_t inode;
+    uint8_t variants;       // precompressed variants of this file that were current when it was cached
+    char etag[ETAG_MAX];    // answers conditional requests without touching the body
+    char path[FILE_CACHE_PATH_MAX];
+};
+
+// References one process holds on one entry, so they can be given back when the process dies
+struct CachePin
+{
+    pid_t pid;
+    int index;
+    uint32_t count;
+};
+
+// Everything lives in one MAP_SHARED region created before fork
+struct CacheRegion
+{
+    pthread_mutex_t lock;
+    uint64_t clock;
+    size_t capacity;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    CacheEntry entries[FILE_CACHE_ENTRIES];
+    CachePin pins[FILE_CACHE_PINS];
+};
+
+struct FileCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+};
+
+// Pinned view of a cached file, valid until release()
+struct CachedFile
+{
+    int index;
+    const char *header;     // status line and header fields without the blank line
+    size_t header_len;
+    const char *body;
+    size_t body_len;
+    off_t size;
+    time_t mtime;
+    ino_t inode;
+    uint8_t variants;
+    const char *etag;
+};
+
+class FileCache
+{
+public:
+    bool create(size_t budget);
+    bool enabled() const { return region_ != nullptr; }
+    bool acquire(const std::string& path, CachedFile& file);
+    void release(CachedFile& file);
+    void insert(const std::string& path, int fd, const struct stat& st, const std::string& header, const std::string& etag,
+                uint8_t variants = 0);
+    void invalidate(const std::string& path);
+    void invalidate_prefix(const std::string& prefix);
+    void invalidate_all();
+    void reclaim(pid_t pid);
+    FileCacheStats stats();
+
+private:
+    CacheRegion *region_ = nullptr;
+    char *arena_ = nullptr;
+
+    void lock();
+    void unlock();
+    int find(const std::string& path, uint32_t hash);
+    void drop(int index);
+    CachePin *pin(pid_t pid, int index, bool add);
+    void reset_owner(pid_t pid);
+    bool allocate(size_t length, size_t& offset);
+    static uint32_t hash_path(const std::string& path);
+};
+
+bool FileCache::create(size_t budget)
+{
+    if (budget == 0) return false;
+
+    size_t total = sizeof(CacheRegion) + budget;
+    void *memory = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        perror("mmap file cache");
+        return false;
+    }
+
+    region_ = (CacheRegion*)memory;
+    arena_ = (char*)memory + sizeof(CacheRegion);
+    memset(region_, 0, sizeof(CacheRegion));
+    region_->capacity = budget;
+
+    // Robust so a worker dying with the lock held does not wedge the others
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&region_->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return true;
+}
+
+void FileCache::lock()
+{
+    if (pthread_mutex_lock(&region_->lock) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&region_->lock);
+
+        // The holder died, give back whatever dead workers left loading or pinned
+        for (int i = 0; i < FILE_CACHE_ENTRIES; i++)
+        {
+            CacheEntry& entry = region_->entries[i];
+            if (entry.state == CacheState::LOADING && kill(entry.owner, 0) < 0 && errno == ESRCH) reset_owner(entry.owner);
+        }
+        for (int i = 0; i < FILE_CACHE_PINS; i++)
+        {
+            pid_t pid = region_->pins[i].pid;
+            if (pid != 0 && kill(pid, 0) < 0 && errno == ESRCH) reset_owner(pid);
+        }
+    }
+}
+
+void FileCache::unlock()
+{
+    pthread_mutex_unlock(&region_->lock);
+}
+
+uint32_t FileCache::hash_path(const std::string& path)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : path)
+    {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int FileCache::find(const std::string& path, uint32_t hash)
+{
+    for (int i = 0; i < FILE_CACHE_ENTRIES; i++)
+    {
+        CacheEntry& entry = region_->entries[i];
+        if (entry.state != CacheState::FREE && !entry.stale && entry.hash == hash && path == entry.path) return i;
+    }
+    return -1;
+}
+
+bool FileCache::acquire(const std::string& path, CachedFile& file)
+{
+    if (!region_) return false;
+
+    uint32_t hash = hash_path(path);
+    lock();
+    int index = find(path, hash);
+    if (index < 0 || region_->entries[index].state != CacheState::READY)
+    {
+        region_->misses++;
+        unlock();
+        return false;
+    }
+
+    CachePin *held = pin(getpid(), index, true);
+    if (!held)
+    {
+        region_->misses++;
+        unlock();
+        return false;
+    }
+    held->count++;
+    CacheEntry& entry = region_->entries[index];
+    entry.refs++;
+    entry.last_used = ++region_->clock;
+    region_->hits++;
+    unlock();
+
+    file.index = index;
+    file.header = arena_ + entry.offset;
+    file.header_len = entry.header_len;
+    file.body = arena_ + entry.offset + entry.header_len;
+    file.body_len = entry.body_len;
+    file.size = entry.size;
+    file.mtime = entry.mtime;
+    file.inode = entry.inode;
+    file.variants = entry.variants;
+    file.etag = entry.etag;
+    return true;
+}
+
+FileCacheStats FileCache::stats()
+{
+    FileCacheStats stats;
+    if (!region_) return stats;
+    lock();
+    stats.hits = region_->hits;
+    stats.misses = region_->misses;
+    stats.evictions = region_->evictions;
+    unlock();
+    return stats;
+}
+
+void FileCache::release(CachedFile& file)
+{
+    lock();
+    CachePin *held = pin(getpid(), file.index, false);
+    if (held && --held->count == 0) *held = {};
+    CacheEntry& entry = region_->entries[file.index];
+    entry.refs--;
+    if (entry.stale && entry.refs == 0) drop(file.index);
+    unlock();
+}
+
+// Pin record of the process for the entry, a free one is taken when add is set. Lock held
+CachePin *FileCache::pin(pid_t pid, int index, bool add)
+{
+    CachePin *empty = nullptr;
+    for (int i = 0; i < FILE_CACHE_PINS; i++)
+    {
+        CachePin& held = region_->pins[i];
+        if (held.pid == pid && held.index == index) return &held;
+        if (held.pid == 0 && !empty) empty = &held;
+    }
+    if (!add || !empty) return nullptr;
+    empty->pid = pid;
+    empty->index = index;
+    empty->count = 0;
+    return empty;
+}
+
+// Frees what the process was loading and drops the references it held. Lock held
+void FileCache::reset_owner(pid_t pid)
+{
+    for (int i = 0; i < FILE_CACHE_PINS; i++)
+    {
+        CachePin& held = region_->pins[i];
+        if (held.pid != pid) continue;
+        int index = held.index;
+        CacheEntry& entry = region_->entries[index];
+        entry.refs -= std::min(entry.refs, held.count);
+        held = {};
+        if (entry.stale && entry.refs == 0) drop(index);
+    }
+    for (int i = 0; i < FILE_CACHE_ENTRIES; i++)
+    {
+        CacheEntry& entry = region_->entries[i];
+        if (entry.state != CacheState::LOADING || entry.owner != pid) continue;
+        entry.state = CacheState::FREE;
+        entry.stale = false;
+    }
+}
+
+void FileCache::drop(int index)
+{
+    CacheEntry& entry = region_->entries[index];
+    if (entry.refs > 0 || entry.state == CacheState::LOADING)
+    {
+        entry.stale = true;
+        return;
+    }
+    entry.state = CacheState::FREE;
+    entry.stale = false;
+}
+
+// First fit between the live entries, evicting least recently used ones until the block fits
+bool FileCache::allocate(size_t length, size_t& offset)
+{
+    if (length > region_->capacity) return false;
+
+    while (1)
+    {
+        std::vector<std::pair<size_t, size_t>> used;
+        for (int i = 0; i < FILE_CACHE_ENTRIES; i++)
+        {
+            CacheEntry& entry = region_->entries[i];
+            if (entry.state == CacheState::FREE) continue;
+            size_t end = entry.offset + entry.header_len + entry.body_len;
+            used.emplace_back(entry.offset, (end + FILE_CACHE_ALIGN - 1) & ~(size_t)(FILE_CACHE_ALIGN - 1));
+        }
+        std::sort(used.begin(), used.end());
+
+        size_t candidate = 0;
+        bool found = true;
+        for (const auto& block : used)
+        {
+            if (block.first >= candidate + length) break;
+            candidate = std::max(candidate, block.second);
+        }
+        if (candidate + length > region_->capacity) found = false;
+        if (found)
+        {
+            offset = candidate;
+            return true;
+        }
+
+        int victim = -1;
+        for (int i = 0; i < FILE_CACHE_ENTRIES; i++)
+        {
+            CacheEntry& entry = region_->entries[i];
+            if (entry.state != CacheState::READY || entry.refs > 0) continue;
+            if (victim < 0 || entry.last_used < region_->entries[victim].last_used) victim = i;
+        }
+        if (victim < 0) return false;
+        drop(victim);
+        region_->evictions++;
+    }
+}
+
+void FileCache::insert(const std::string& path, int fd, const struct stat& st, const std::string& header, const std::string& etag,
+                       uint8_t variants)
+{
+    if (!region_ || path.size() >= FILE_CACHE_PATH_MAX || etag.size() >= ETAG_MAX) return;
+
+    uint32_t hash = hash_path(path);
+    size_t length = header.size() + st.st_size;
+    lock();
+    int index = -1;
+    size_t offset = 0;
+    if (find(path, hash) < 0)
+    {
+        for (int i = 0; i < FILE_CACHE_ENTRIES && index < 0; i++)
+        {
+            if (region_->entries[i].state == CacheState::FREE) index = i;
+        }
+        if (index < 0)
+        {
+            // Out of slots, recycle the least recently used entry
+            for (int i = 0; i < FILE_CACHE_ENTRIES; i++)
+            {
+                CacheEntry& entry = region_->entries[i];
+                if (entry.state != CacheState::READY || entry.refs > 0) continue;
+                if (index < 0 || entry.last_used < region_->entries[index].last_used) index = i;
+            }
+            if (index >= 0)
+            {
+                drop(index);
+                region_->evictions++;
+            }
+        }
+    }
+    if (index < 0 || !allocate(length, offset))
+    {
+        unlock();
+        return;
+    }
+
+    CacheEntry& entry = region_->entries[index];
+    entry.state = CacheState::LOADING;
+    entry.stale = false;
+    entry.hash = hash;
+    entry.refs = 0;
+    entry.owner = getpid();
+    entry.last_used = ++region_->clock;
+    entry.offset = offset;
+    entry.header_len = header.size();
+    entry.body_len = st.st_size;
+    entry.size = st.st_size;
+    entry.mtime = st.st_mtime;
+    entry.inode = st.st_ino;
+    entry.variants = variants;
+    memcpy(entry.etag, etag.c_str(), etag.size() + 1);
+    memcpy(entry.path, path.c_str(), path.size() + 1);
+    unlock();
+
+    // Read outside the lock, other workers skip LOADING entries and serve from disk meanwhile
+    char *data = arena_ + offset;
+    memcpy(data, header.data(), header.size());
+    size_t done = 0;
+    while (done < (size_t)st.st_size)
+    {
+        ssize_t got = pread(fd, data + header.size() + done, st.st_size - done, done);
+        if (got <= 0) break;
+        done += got;
+    }
+
+    // An invalidate that ran between the caller's fstat and the entry above found nothing to mark,
+    // the file itself tells whether the bytes still belong to the version the header describes
+    struct stat now;
+    bool changed = fstat(fd, &now) < 0 || now.st_size != st.st_size || now.st_ino != st.st_ino ||
+                   now.st_mtim.tv_sec != st.st_mtim.tv_sec || now.st_mtim.tv_nsec != st.st_mtim.tv_nsec;
+
+    lock();
+    if (done != (size_t)st.st_size || changed || entry.stale)
+    {
+        // Short read or the file changed while we were reading it
+        entry.state = CacheState::FREE;
+        entry.stale = false;
+    }
+    else
+    {
+        entry.state = CacheState::READY;
+    }
+    unlock();
+}
+
+void FileCache::invalidate(const std::string& path)
+{
+    if (!region_) return;
+
+    uint32_t hash = hash_path(path);
+    lock();
+    int index = find(path, hash);
+    if (index >= 0) drop(index);
+    unlock();
+}
+
+void FileCache::invalidate_prefix(const std::string& prefix)
+{
+    if (!region_) return;
+
+    lock();
+    for (int i = 0; i < FILE_CACHE_ENTRIES; i++)
+    {
+        CacheEntry& entry = region_->entries[i];
+        if (entry.state != CacheState::FREE && strncmp(entry.path, prefix.c_str(), prefix.size()) == 0) drop(i);
+    }
+    unlock();
+}
+
+void FileCache::invalidate_all()
+{
+    invalidate_prefix("");
+}
+
+// Called for every reaped worker, one that died outside the lock leaves no EOWNERDEAD behind
+void FileCache::reclaim(pid_t pid)
+{
+    if (!region_) return;
+
+    lock();
+    reset_owner(pid);
+    unlock();
+}
@@ -0,0 +1,354 @@
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <new>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <initializer_list>
+
+#define LOG_RECORD_MAX      4096    // longer messages are truncated
+#define LOG_RECORD_ALIGN    32      // keeps room for a padding header at every record boundary
+#define LOG_DRAIN_RECORDS   256     // records per writev, three iovecs each
+#define LOG_DRAIN_IDLE_US   10000   // consumer sleep while the ring is empty
+#define LOG_STALL_MS        1000    // an unclaimed record this long after its reservation belongs to a dead producer
+
+enum LogRecordState : uint32_t
+{
+    LOG_EMPTY,
+    LOG_READY,
+    LOG_PADDING,    // rest of the ring is unused, the next record starts at offset 0
+    LOG_RESERVED    // length and pid are set, the text is still being copied
+};
+
+struct LogRecord
+{
+    std::atomic<uint32_t> state;    // published last, with release ordering
+    uint32_t length;                // message bytes, or bytes skipped for LOG_PADDING
+    uint64_t time_ns;               // CLOCK_REALTIME, read through the vDSO
+    int32_t pid;                    // producer, set before LOG_RESERVED
+    uint32_t reserved;
+    char text[];
+};
+
+// Positions grow forever, offset in the ring is position & (capacity - 1)
+struct LogRingHeader
+{
+    alignas(64) std::atomic<uint64_t> head;     // next byte to reserve, bumped by producers
+    alignas(64) std::atomic<uint64_t> tail;     // first byte not consumed yet, only the consumer moves it
+    alignas(64) std::atomic<uint64_t> dropped;  // records lost because the ring was full
+    uint64_t capacity;
+};
+
+// getpid() is a real syscall in current glibc, cache it and forget it in forked children
+static pid_t log_pid = 0;
+
+static void log_forget_pid()
+{
+    log_pid = 0;
+}
+
+// Multi-producer single-consumer ring in shared memory created before fork. Workers append
+// binary records with one CAS and a memcpy, the logger process formats and writes them in batches
+class LogRing
+{
+public:
+    bool create(size_t capacity);
+    bool write(std::string_view message) { return write({ message }); }
+    bool write(std::initializer_list<std::string_view> parts);
+    size_t drain(int fd);
+    size_t drain(std::string& out);
+    template <typename Sink> void consume(Sink& sink);
+    uint64_t dropped() const { return header_ ? header_->dropped.load(std::memory_order_relaxed) : 0; }
+
+private:
+    LogRingHeader *header_ = nullptr;
+    char *data_ = nullptr;
+    uint64_t mask_ = 0;
+
+    // Consumer only, the formatted clock is reused for records in the same second
+    time_t prefix_second_ = -1;
+    char prefix_clock_[16];
+    uint64_t stall_position_ = UINT64_MAX;     // record the consumer is waiting on, and since when
+    uint64_t stall_since_ns_ = 0;
+
+    size_t format_prefix(char *out, const LogRecord *record);
+    uint64_t skip_stalled(uint64_t position, uint32_t state, const LogRecord *record);
+    uint64_t gather(uint64_t tail, struct iovec *iov, char (*prefixes)[48], size_t& records);
+    void release(uint64_t tail, uint64_t position);
+    void clear(uint64_t from, uint64_t to);
+    static size_t record_size(size_t length);
+};
+
+bool LogRing::create(size_t capacity)
+{
+    // Power of two so positions map onto offsets with a mask
+    size_t size = 4096;
+    while (size < capacity) size <<= 1;
+
+    void *memory = mmap(NULL, sizeof(LogRingHeader) + size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        perror("mmap log ring");
+        return false;
+    }
+    // Anonymous mappings start zeroed, every record slot reads as LOG_EMPTY
+    header_ = new (memory) LogRingHeader();
+    header_->capacity = size;
+    data_ = (char*)memory + sizeof(LogRingHeader);
+    mask_ = size - 1;
+    pthread_atfork(NULL, NULL, log_forget_pid);
+    return true;
+}
+
+size_t LogRing::record_size(size_t length)
+{
+    return (sizeof(LogRecord) + length + LOG_RECORD_ALIGN - 1) & ~(size_t)(LOG_RECORD_ALIGN - 1);
+}
+
+// Never blocks and never enters the kernel, a full ring drops the record and counts it
+bool LogRing::write(std::initializer_list<std::string_view> parts)
+{
+    if (!header_) return false;
+
+    size_t length = 0;
+    for (std::string_view part : parts) length += part.size();
+    if (length > LOG_RECORD_MAX) length = LOG_RECORD_MAX;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (!log_pid) log_pid = getpid();
+
+    uint64_t capacity = header_->capacity;
+    size_t need = record_size(length);
+    uint64_t head = header_->head.load(std::memory_order_relaxed);
+    uint64_t total, offset;
+    do
+    {
+        // A record never wraps, when it does not fit before the end the rest is reserved as padding
+        offset = head & mask_;
+        uint64_t room = capacity - offset;
+        total = need <= room ? need : room + need;
+        if (head + total - header_->tail.load(std::memory_order_acquire) > capacity)
+        {
+            header_->dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    } while (!header_->head.compare_exchange_weak(head, head + total, std::memory_order_relaxed));
+
+    if (total != need)
+    {
+        LogRecord *padding = (LogRecord*)(data_ + offset);
+        padding->length = capacity - offset;
+        padding->state.store(LOG_PADDING, std::memory_order_release);
+        offset = 0;
+    }
+
+    // Claimed first, so the consumer can step over the record if this process dies before publishing
+    LogRecord *record = (LogRecord*)(data_ + offset);
+    record->time_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    record->pid = log_pid;
+    record->length = length;
+    record->state.store(LOG_RESERVED, std::memory_order_release);
+    size_t copied = 0;
+    for (std::string_view part : parts)
+    {
+        size_t n = std::min(part.size(), length - copied);
+        memcpy(record->text + copied, part.data(), n);
+        copied += n;
+    }
+    record->state.store(LOG_READY, std::memory_order_release);
+    return true;
+}
+
+// "[HH:MM:SS.mmm] [pid] ", formatted by hand since snprintf cost more than the rest of the drain
+size_t LogRing::format_prefix(char *out, const LogRecord *record)
+{
+    time_t second = record->time_ns / 1000000000ULL;
+    if (second != prefix_second_)
+    {
+        struct tm local;
+        localtime_r(&second, &local);
+        strftime(prefix_clock_, sizeof(prefix_clock_), "[%H:%M:%S.", &local);
+        prefix_second_ = second;
+    }
+    char *p = out;
+    memcpy(p, prefix_clock_, 10);
+    p += 10;
+    unsigned millis = record->time_ns / 1000000 % 1000;
+    *p++ = '0' + millis / 100;
+    *p++ = '0' + millis / 10 % 10;
+    *p++ = '0' + millis % 10;
+    memcpy(p, "] [", 3);
+    p += 3;
+
+    char digits[12];
+    int n = 0;
+    uint32_t pid = record->pid;
+    do
+    {
+        digits[n++] = '0' + pid % 10;
+        pid /= 10;
+    } while (pid);
+    while (n) *p++ = digits[--n];
+    memcpy(p, "] ", 2);
+    return p + 2 - out;
+}
+
+// Zeroes consumed bytes before handing them back, so any later record boundary reads LOG_EMPTY
+// until its producer publishes it
+void LogRing::clear(uint64_t from, uint64_t to)
+{
+    while (from < to)
+    {
+        uint64_t offset = from & mask_;
+        uint64_t n = std::min(to - from, header_->capacity - offset);
+        memset(data_ + offset, 0, n);
+        from += n;
+    }
+}
+
+// Position after a record that will never be published, the position itself while it should be waited
+// for. A reserved record is given up once its producer is gone. An empty one is given up after
+// LOG_STALL_MS, its producer died right after the CAS and left zeroes behind, so the next record
+// header is the first nonzero state on an aligned boundary before head
+uint64_t LogRing::skip_stalled(uint64_t position, uint32_t state, const LogRecord *record)
+{
+    uint64_t head = header_->head.load(std::memory_order_acquire);
+    if (position == head) return position;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (position != stall_position_)
+    {
+        stall_position_ = position;
+        stall_since_ns_ = now;
+    }
+    // A live producer still writes into a reserved record, it must not be handed back under it
+    bool stalled = state == LOG_RESERVED ? kill(record->pid, 0) < 0 && errno == ESRCH
+                                         : now - stall_since_ns_ >= LOG_STALL_MS * 1000000ULL;
+    if (!stalled) return position;
+
+    uint64_t next = position;
+    if (state == LOG_RESERVED)
+    {
+        next += record_size(record->length);
+    }
+    else
+    {
+        for (next += LOG_RECORD_ALIGN; next < head; next += LOG_RECORD_ALIGN)
+        {
+            if (((LogRecord*)(data_ + (next & mask_)))->state.load(std::memory_order_acquire) != LOG_EMPTY) break;
+        }
+        if (next >= head) return position;
+    }
+    header_->dropped.fetch_add(1, std::memory_order_relaxed);
+    return next;
+}
+
+// Published records at the tail as prefix, text and newline iovecs, returns the position after them.
+// Stops at the first record still being written, records behind it wait for the next call
+uint64_t LogRing::gather(uint64_t tail, struct iovec *iov, char (*prefixes)[48], size_t& records)
+{
+    int count = 0;
+    uint64_t position = tail;
+    // A completely full ring would otherwise lead back to the first record of this batch, not cleared yet
+    while (records < LOG_DRAIN_RECORDS && position - tail < header_->capacity)
+    {
+        LogRecord *record = (LogRecord*)(data_ + (position & mask_));
+        uint32_t state = record->state.load(std::memory_order_acquire);
+        if (state == LOG_EMPTY || state == LOG_RESERVED)
+        {
+            uint64_t next = skip_stalled(position, state, record);
+            if (next == position) break;
+            position = next;
+            continue;
+        }
+        if (state == LOG_PADDING)
+        {
+            position += record->length;
+            continue;
+        }
+
+        iov[count++] = { prefixes[records], format_prefix(prefixes[records], record) };
+        iov[count++] = { record->text, record->length };
+        iov[count++] = { (void*)"\n", 1 };
+        records++;
+        position += record_size(record->length);
+    }
+    return position;
+}
+
+// Hands the space of the gathered records back to the producers
+void LogRing::release(uint64_t tail, uint64_t position)
+{
+    clear(tail, position);
+    header_->tail.store(position, std::memory_order_release);
+}
+
+// Writes out the published records at the tail with one writev, returns how many there were
+size_t LogRing::drain(int fd)
+{
+    struct iovec iov[LOG_DRAIN_RECORDS * 3];
+    char prefixes[LOG_DRAIN_RECORDS][48];
+    size_t records = 0;
+
+    uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+    uint64_t position = gather(tail, iov, prefixes, records);
+    if (position == tail) return 0;
+
+    // Regular files take the whole vector, a short write only happens on errors like a full disk
+    if (records > 0 && writev(fd, iov, records * 3) < 0) perror("writev log");
+    release(tail, position);
+    return records;
+}
+
+// Appends the published records at the tail to out as formatted lines, for a sink doing its own writes
+size_t LogRing::drain(std::string& out)
+{
+    struct iovec iov[LOG_DRAIN_RECORDS * 3];
+    char prefixes[LOG_DRAIN_RECORDS][48];
+    size_t records = 0;
+
+    uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+    uint64_t position = gather(tail, iov, prefixes, records);
+    if (position == tail) return 0;
+
+    for (size_t i = 0; i < records * 3; i++) out.append((const char*)iov[i].iov_base, iov[i].iov_len);
+    release(tail, position);
+    return records;
+}
+
+// Logger process main loop, exits once the master is gone and the ring is empty. The sink takes the
+// batches through append(std::string_view)
+template <typename Sink>
+void LogRing::consume(Sink& sink)
+{
+    std::string batch;
+    pid_t parent = getppid();
+    while (1)
+    {
+        if (drain(batch) > 0)
+        {
+            sink.append(batch);
+            batch.clear();
+            continue;
+        }
+        if (getppid() != parent) break;
+        usleep(LOG_DRAIN_IDLE_US);
+    }
+    while (drain(batch) > 0)
+    {
+        sink.append(batch);
+        batch.clear();
+    }
+}
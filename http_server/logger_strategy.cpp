@@ -1,4 +1,6 @@
 #include <string>
+#include <string_view>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <unordered_map>
@@ -6,6 +8,22 @@
 #include <fstream>
 #include <chrono>
 #include <iomanip>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_BUFFER_BYTES    (1024 * 1024)       // pending text before the overflow policy applies
+#define LOG_BATCH_BYTES     (64 * 1024)         // wakes the writer before the flush interval
+#define LOG_FLUSH_MS        200
+#define LOG_ROTATE_BYTES    (16 * 1024 * 1024)
+#define LOG_ROTATE_SECONDS  (24 * 3600)
 
 class LoggerStrategy {
 public:
@@ -56,6 +74,191 @@ public:
     }
 };
 
+enum class LogOverflow {
+    Drop,       // the message is counted and thrown away, the caller never waits
+    Block       // the caller waits until the writer made room
+};
+
+// Producers only append to a buffer under a mutex, a background thread swaps it out and writes it
+// with one write() per batch, rotating by size or age on its own. The thread starts with the first
+// message. A logger belongs to the process that created it: fork only before the first message, and
+// log from children through the shared log ring. The server's logger process drains the ring into one
+class AsyncFileLogger : public LoggerStrategy {
+private:
+    std::string directory;
+    size_t max_file_bytes;
+    time_t max_file_age;
+    LogOverflow overflow;
+
+    std::mutex mutex;
+    std::condition_variable ready;      // signals the writer
+    std::condition_variable space;      // signals producers blocked by LogOverflow::Block
+    std::string pending;
+    bool stopping = false;
+    std::unique_ptr<std::thread> writer;
+    time_t cached_second = -1;
+    char cached_prefix[16];
+
+    // Writer thread only, besides construction
+    int fd = -1;
+    size_t file_bytes = 0;
+    time_t file_opened = 0;
+    uint64_t reported_drops = 0;
+
+    std::atomic<uint64_t> logged{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> rotations{0};
+
+    // Starting up appends to the file of the current minute like FileLogger, rotating always starts a new one
+    void open_file(time_t now, bool rotating) {
+        std::filesystem::create_directories(directory);
+        struct tm local;
+        localtime_r(&now, &local);
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%d_%m_%Y_%H_%M", &local);
+
+        // Several rotations within one minute get numbered files
+        std::string path = directory + "/" + stamp + ".txt";
+        for (int n = 1; rotating && std::filesystem::exists(path); n++) {
+            path = directory + "/" + stamp + "_" + std::to_string(n) + ".txt";
+        }
+        int new_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (new_fd < 0) {
+            std::cerr << "Error during creating the file " << path << ": " << strerror(errno) << std::endl;
+            return;
+        }
+        if (fd >= 0) close(fd);
+        fd = new_fd;
+        file_bytes = lseek(fd, 0, SEEK_END);
+        file_opened = now;
+        write_all("==== Logger started ====\n");
+    }
+
+    void write_all(std::string_view data) {
+        while (!data.empty()) {
+            ssize_t n = ::write(fd, data.data(), data.size());
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                // Nothing better to do with log lines the disk refuses
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            data.remove_prefix(n);
+            file_bytes += n;
+        }
+    }
+
+    void write_batch(const std::string &batch) {
+        time_t now = time(nullptr);
+        if (file_bytes > 0 && (file_bytes + batch.size() > max_file_bytes || now - file_opened >= max_file_age)) {
+            open_file(now, true);
+            rotations.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (fd < 0) return;
+
+        uint64_t drops = dropped.load(std::memory_order_relaxed);
+        if (drops != reported_drops) {
+            write_all("==== " + std::to_string(drops - reported_drops) + " messages dropped ====\n");
+            reported_drops = drops;
+        }
+        write_all(batch);
+    }
+
+    // Waits for room or drops the messages, with the lock held. False when they were dropped
+    bool make_room(std::unique_lock<std::mutex> &lock, size_t need, uint64_t messages) {
+        while (pending.size() + need > LOG_BUFFER_BYTES && !pending.empty()) {
+            if (overflow == LogOverflow::Drop || stopping) {
+                dropped.fetch_add(messages, std::memory_order_relaxed);
+                return false;
+            }
+            ready.notify_one();
+            space.wait(lock);
+        }
+        return true;
+    }
+
+    void queued(uint64_t messages) {
+        logged.fetch_add(messages, std::memory_order_relaxed);
+        if (!writer && !stopping) {
+            writer.reset(new std::thread(&AsyncFileLogger::run, this));
+        }
+        if (pending.size() >= LOG_BATCH_BYTES) ready.notify_one();
+    }
+
+    void run() {
+        std::string batch;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            ready.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_MS),
+                           [this] { return stopping || pending.size() >= LOG_BATCH_BYTES; });
+            if (pending.empty()) {
+                if (stopping) break;
+                continue;
+            }
+            // Producers fill the other buffer while this one is on its way to disk
+            batch.swap(pending);
+            lock.unlock();
+            space.notify_all();
+            write_batch(batch);
+            batch.clear();
+            lock.lock();
+        }
+    }
+
+public:
+    AsyncFileLogger(const std::string &directory = "logs", size_t max_file_bytes = LOG_ROTATE_BYTES,
+                    time_t max_file_age = LOG_ROTATE_SECONDS, LogOverflow overflow = LogOverflow::Drop)
+        : directory(directory), max_file_bytes(max_file_bytes), max_file_age(max_file_age), overflow(overflow) {
+        pending.reserve(LOG_BATCH_BYTES);
+        open_file(time(nullptr), false);
+    }
+
+    ~AsyncFileLogger() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_one();
+        space.notify_all();
+        if (writer) {
+            writer->join();
+        } else if (fd >= 0 && !pending.empty()) {
+            write_batch(pending);
+        }
+        if (fd >= 0) close(fd);
+    }
+
+    void log(const std::string &message) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!make_room(lock, sizeof("[00:00:00] ") - 1 + message.size() + 1, 1)) return;
+
+        time_t now = time(nullptr);
+        if (now != cached_second) {
+            struct tm local;
+            localtime_r(&now, &local);
+            strftime(cached_prefix, sizeof(cached_prefix), "[%H:%M:%S] ", &local);
+            cached_second = now;
+        }
+        pending.append(cached_prefix);
+        pending.append(message);
+        pending.push_back('\n');
+        queued(1);
+    }
+
+    // Whole lines that already carry their own prefix, like a batch drained from the log ring
+    void append(std::string_view lines) {
+        uint64_t messages = std::count(lines.begin(), lines.end(), '\n');
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!make_room(lock, lines.size(), messages)) return;
+        pending.append(lines);
+        queued(messages);
+    }
+
+    uint64_t logged_count() const { return logged.load(std::memory_order_relaxed); }
+    uint64_t dropped_count() const { return dropped.load(std::memory_order_relaxed); }
+    uint64_t rotation_count() const { return rotations.load(std::memory_order_relaxed); }
+};
+
 class Logger {
 private:
     LoggerStrategy *strategy;
@@ -1,8 +1,78 @@
 #include "server.cpp"
 
-int main()
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [--reuseport] [--cpu-affinity] [--route least|p2c]\n"
+                    "          [--min-workers N] [--max-workers N] [--cache-bytes N]\n"
+                    "          [--session-cache N] [--trace FILE]\n", program);
+    fprintf(stderr, "  --reuseport     every worker accepts on its own SO_REUSEPORT socket\n");
+    fprintf(stderr, "  --cpu-affinity  pin workers to CPUs and steer accepts with SO_INCOMING_CPU\n");
+    fprintf(stderr, "  --route         least: least loaded worker (default), p2c: power of two choices\n");
+    fprintf(stderr, "  --min-workers   workers kept alive even when idle (default %d)\n", MIN_WORKERS);
+    fprintf(stderr, "  --max-workers   pool size at which new connections get the 503 page (default/limit %d)\n", MAX_WORKERS);
+    fprintf(stderr, "  --cache-bytes   shared static file cache size, 0 disables it (default %d)\n", FILE_CACHE_BYTES);
+    fprintf(stderr, "  --session-cache shared TLS 1.2 session ID cache slots, 0 leaves only tickets (default %d)\n", SESSION_CACHE_ENTRIES);
+    fprintf(stderr, "  --trace         write per-request phases as Chrome trace events to FILE\n");
+}
+
+int main(int argc, char *argv[])
 {
     Server& server = Server::getInstance();
+    for (int i = 1; i < argc; i++) 
+    {
+        std::string arg = argv[i];
+        if (arg == "--reuseport") 
+        {
+            server.accept_mode = AcceptMode::REUSEPORT;
+        }
+        else if (arg == "--cpu-affinity") 
+        {
+            server.cpu_affinity = true;
+        }
+        else if (arg == "--route" && i + 1 < argc) 
+        {
+            std::string policy = argv[++i];
+            if (policy == "least") server.route_policy = RoutePolicy::LEAST_LOADED;
+            else if (policy == "p2c") server.route_policy = RoutePolicy::TWO_CHOICES;
+            else 
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (arg == "--min-workers" && i + 1 < argc) 
+        {
+            server.min_workers = atoi(argv[++i]);
+        }
+        else if (arg == "--max-workers" && i + 1 < argc) 
+        {
+            server.max_workers = atoi(argv[++i]);
+        }
+        else if (arg == "--cache-bytes" && i + 1 < argc) 
+        {
+            server.cache_bytes = strtoull(argv[++i], NULL, 10);
+        }
+        else if (arg == "--session-cache" && i + 1 < argc) 
+        {
+            server.session_entries = strtoul(argv[++i], NULL, 10);
+        }
+        else if (arg == "--trace" && i + 1 < argc) 
+        {
+            server.trace_path = argv[++i];
+        }
+        else 
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (server.min_workers < 1 || server.max_workers > MAX_WORKERS || server.min_workers > server.max_workers) 
+    {
+        fprintf(stderr, "Worker bounds must satisfy 1 <= min <= max <= %d\n", MAX_WORKERS);
+        return 1;
+    }
+
     server.create_socket();
     server.bind_socket();
     server.listen_socket();
@@ -0,0 +1,199 @@
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <new>
+#include <string>
+
+#define LATENCY_SUB_BITS    4       // 16 sub-buckets per power of two, values land within 6.25% of their bucket
+#define LATENCY_MAX_BITS    27      // 2^27 us, about two minutes, longer samples share the last bucket
+#define LATENCY_BUCKETS     ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+#define STATUS_MIN          100
+#define STATUS_MAX          599
+
+// Log-linear buckets as in HdrHistogram: exact below 16 us, then 16 equal steps per power of two
+struct LatencyHistogram
+{
+    std::atomic<uint64_t> counts[LATENCY_BUCKETS];
+    std::atomic<uint64_t> sum_us;
+
+    void record(uint64_t us)
+    {
+        counts[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+        sum_us.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    static int bucket(uint64_t us)
+    {
+        if (us < (1u << LATENCY_SUB_BITS)) return us;
+        int msb = 63 - __builtin_clzll(us);
+        if (msb >= LATENCY_MAX_BITS) return LATENCY_BUCKETS - 1;
+        int shift = msb - LATENCY_SUB_BITS;
+        return ((shift + 1) << LATENCY_SUB_BITS) + ((us >> shift) & ((1u << LATENCY_SUB_BITS) - 1));
+    }
+
+    // First value past the bucket, every sample in it is below
+    static uint64_t upper_bound(int index)
+    {
+        if (index < (1 << LATENCY_SUB_BITS)) return index + 1;
+        int shift = (index >> LATENCY_SUB_BITS) - 1;
+        uint64_t sub = (1u << LATENCY_SUB_BITS) + (index & ((1u << LATENCY_SUB_BITS) - 1));
+        return (sub + 1) << shift;
+    }
+};
+
+// Counters one worker adds to with relaxed atomics. Slots are never reset, a respawned worker keeps
+// adding to its predecessor's totals so the aggregated counters only ever grow
+struct alignas(64) WorkerMetrics
+{
+    std::atomic<uint64_t> responses[STATUS_MAX - STATUS_MIN + 1];   // by status code
+    std::atomic<uint64_t> bytes_sent;
+    std::atomic<uint64_t> handshake_failures;   // errors and timeouts before the handshake completed
+    LatencyHistogram request_latency;           // first byte of the request to the last byte of the response
+    LatencyHistogram handshake_latency;
+
+    void record_response(int status, uint64_t bytes)
+    {
+        if (status >= STATUS_MIN && status <= STATUS_MAX)
+        {
+            responses[status - STATUS_MIN].fetch_add(1, std::memory_order_relaxed);
+        }
+        bytes_sent.fetch_add(bytes, std::memory_order_relaxed);
+    }
+};
+
+// Sum of the histograms of every worker, taken when the endpoint is read
+struct LatencySnapshot
+{
+    uint64_t counts[LATENCY_BUCKETS] = {};
+    uint64_t total = 0;
+    uint64_t sum_us = 0;
+
+    void add(const LatencyHistogram& histogram)
+    {
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            uint64_t n = histogram.counts[i].load(std::memory_order_relaxed);
+            counts[i] += n;
+            total += n;
+        }
+        sum_us += histogram.sum_us.load(std::memory_order_relaxed);
+    }
+
+    // Upper bound of the bucket holding the q-th sample, in microseconds
+    uint64_t quantile(double q) const
+    {
+        if (total == 0) return 0;
+        uint64_t rank = (uint64_t)(q * total);
+        if (rank >= total) rank = total - 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            seen += counts[i];
+            if (seen > rank) return LatencyHistogram::upper_bound(i);
+        }
+        return LatencyHistogram::upper_bound(LATENCY_BUCKETS - 1);
+    }
+};
+
+// Shared memory table created before fork next to the scoreboard, read by whichever worker serves /metrics
+class Metrics
+{
+public:
+    void create(int slots);
+    WorkerMetrics& slot(int index) { return slots_[index]; }
+    int size() const { return count_; }
+
+private:
+    WorkerMetrics *slots_ = nullptr;
+    int count_ = 0;
+};
+
+void Metrics::create(int slots)
+{
+    void *memory = mmap(NULL, sizeof(WorkerMetrics) * slots, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        perror("mmap metrics");
+        exit(EXIT_FAILURE);
+    }
+    // Anonymous mappings start zeroed, every counter at 0
+    slots_ = (WorkerMetrics*)memory;
+    count_ = slots;
+}
+
+// Prometheus text exposition format 0.0.4
+static inline void metric_family(std::string& out, const char *name, const char *type, const char *help)
+{
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+static inline void metric_sample(std::string& out, const char *name, const std::string& labels, const char *number)
+{
+    out += name;
+    if (!labels.empty())
+    {
+        out += '{';
+        out += labels;
+        out += '}';
+    }
+    out += ' ';
+    out += number;
+    out += '\n';
+}
+
+static inline void metric_sample(std::string& out, const char *name, const std::string& labels, uint64_t value)
+{
+    char number[24];
+    snprintf(number, sizeof(number), "%lu", (unsigned long)value);
+    metric_sample(out, name, labels, number);
+}
+
+static inline void metric_sample(std::string& out, const char *name, const std::string& labels, double value)
+{
+    char number[32];
+    snprintf(number, sizeof(number), "%.10g", value);
+    metric_sample(out, name, labels, number);
+}
+
+// Buckets at the usual latency boundaries rather than all of ours, plus p50/p99/p999 from the
+// full resolution as a separate gauge family
+static inline void metric_histogram(std::string& out, const char *name, const char *help, const LatencySnapshot& snapshot)
+{
+    static const double bounds[] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+                                     0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+    metric_family(out, name, "histogram", help);
+    std::string series = name;
+    int index = 0;
+    uint64_t cumulative = 0;
+    for (double bound : bounds)
+    {
+        // Our buckets never straddle these boundaries by more than their 6.25% width
+        while (index < LATENCY_BUCKETS && LatencyHistogram::upper_bound(index) <= bound * 1e6)
+        {
+            cumulative += snapshot.counts[index++];
+        }
+        char label[32];
+        snprintf(label, sizeof(label), "le=\"%g\"", bound);
+        metric_sample(out, (series + "_bucket").c_str(), label, cumulative);
+    }
+    metric_sample(out, (series + "_bucket").c_str(), "le=\"+Inf\"", snapshot.total);
+    metric_sample(out, (series + "_sum").c_str(), "", snapshot.sum_us / 1e6);
+    metric_sample(out, (series + "_count").c_str(), "", snapshot.total);
+
+    std::string quantiles = series + "_quantile";
+    std::string quantile_help = std::string("Quantiles of ") + name + " from log-linear buckets, upper bounds within 6.25%.";
+    metric_family(out, quantiles.c_str(), "gauge", quantile_help.c_str());
+    metric_sample(out, quantiles.c_str(), "quantile=\"0.5\"", snapshot.quantile(0.5) / 1e6);
+    metric_sample(out, quantiles.c_str(), "quantile=\"0.99\"", snapshot.quantile(0.99) / 1e6);
+    metric_sample(out, quantiles.c_str(), "quantile=\"0.999\"", snapshot.quantile(0.999) / 1e6);
+}
@@ -0,0 +1,228 @@
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#include <string>
+#include <string_view>
+#include <filesystem>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#define PRECOMPRESS_DIR         "precompressed"     // mirrors www outside the served tree
+#define PRECOMPRESS_MAX_FILE    (16 * 1024 * 1024)  // larger files are only sent as they are
+
+// Precompressed variants kept as PRECOMPRESS_DIR/www/file.br and .gz, in server preference order. A
+// variant counts only while its modification time equals the original's, which precompress_file sets.
+// The file cache keys them as the original's path with the suffix
+struct ContentEncoding
+{
+    const char *name;       // Accept-Encoding and Content-Encoding token
+    const char *suffix;
+};
+
+static const ContentEncoding content_encodings[] =
+{
+#ifdef HAVE_BROTLI
+    { "br", ".br" },
+#endif
+    { "gzip", ".gz" },
+};
+
+#define ENCODING_COUNT  (int)(sizeof(content_encodings) / sizeof(content_encodings[0]))
+
+// Text formats gain from compression, the image formats we serve besides SVG are compressed already
+static bool precompressible(const std::string& mime_type)
+{
+    return mime_type.compare(0, 5, "text/") == 0 || mime_type == "application/javascript" || mime_type == "image/svg+xml";
+}
+
+static std::string variant_path(const std::string& path, int encoding)
+{
+    return std::string(PRECOMPRESS_DIR "/") + path + content_encodings[encoding].suffix;
+}
+
+// Bit i set for every variant on disk that belongs to the current version of the original
+static uint8_t fresh_variants(const std::string& path, const struct stat& original)
+{
+    uint8_t variants = 0;
+    for (int i = 0; i < ENCODING_COUNT; i++)
+    {
+        struct stat st;
+        std::string variant = variant_path(path, i);
+        if (stat(variant.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_mtim.tv_sec == original.st_mtim.tv_sec &&
+            st.st_mtim.tv_nsec == original.st_mtim.tv_nsec)
+        {
+            variants |= 1 << i;
+        }
+    }
+    return variants;
+}
+
+// Best of the available variants by the client's q-values (RFC 9110 12.5.3), ties go to the order of
+// content_encodings. "*" covers codings the header does not name, -1 means send the original
+static int choose_encoding(std::string_view accept, uint8_t variants)
+{
+    if (variants == 0 || accept.empty()) return -1;
+
+    double q[ENCODING_COUNT];
+    double any = -1;
+    for (int i = 0; i < ENCODING_COUNT; i++) q[i] = -1;
+    while (!accept.empty())
+    {
+        size_t comma = accept.find(',');
+        std::string_view item = accept.substr(0, comma);
+        accept = comma == std::string_view::npos ? std::string_view() : accept.substr(comma + 1);
+
+        size_t semicolon = item.find(';');
+        std::string_view name = item.substr(0, semicolon);
+        while (!name.empty() && (name.front() == ' ' || name.front() == '\t')) name.remove_prefix(1);
+        while (!name.empty() && (name.back() == ' ' || name.back() == '\t')) name.remove_suffix(1);
+        double value = 1;
+        if (semicolon != std::string_view::npos)
+        {
+            size_t q_pos = item.find("q=", semicolon);
+            if (q_pos != std::string_view::npos) value = atof(std::string(item.substr(q_pos + 2)).c_str());
+        }
+        if (name == "*")
+        {
+            any = value;
+            continue;
+        }
+        for (int i = 0; i < ENCODING_COUNT; i++)
+        {
+            if (name.size() == strlen(content_encodings[i].name) &&
+                strncasecmp(name.data(), content_encodings[i].name, name.size()) == 0) q[i] = value;
+        }
+    }
+
+    int best = -1;
+    for (int i = 0; i < ENCODING_COUNT; i++)
+    {
+        double value = q[i] < 0 ? any : q[i];
+        if (!(variants & (1 << i)) || value <= 0) continue;
+        if (best < 0 || value > (q[best] < 0 ? any : q[best])) best = i;
+    }
+    return best;
+}
+
+// Vary on every compressible type, the identity response included, so caches keep the codings apart
+static void add_encoding_headers(Response& response, const std::string& mime_type, int encoding)
+{
+    if (!precompressible(mime_type)) return;
+    response.addHeader("Vary", "Accept-Encoding");
+    if (encoding >= 0) response.addHeader("Content-Encoding", content_encodings[encoding].name);
+}
+
+// Maximum compression, the work is done once per version of the file instead of once per request
+static bool gzip_compress(const std::string& data, std::string& out)
+{
+    z_stream stream = {};
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+    out.resize(deflateBound(&stream, data.size()));
+    stream.next_in = (Bytef*)data.data();
+    stream.avail_in = data.size();
+    stream.next_out = (Bytef*)&out[0];
+    stream.avail_out = out.size();
+    int result = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END;
+}
+
+static bool compress_variant(int encoding, const std::string& data, std::string& out)
+{
+#ifdef HAVE_BROTLI
+    if (strcmp(content_encodings[encoding].name, "br") == 0)
+    {
+        size_t length = BrotliEncoderMaxCompressedSize(data.size());
+        if (length == 0) return false;
+        out.resize(length);
+        if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_MAX_WINDOW_BITS, BROTLI_MODE_TEXT, data.size(),
+                                   (const uint8_t*)data.data(), &length, (uint8_t*)&out[0])) return false;
+        out.resize(length);
+        return true;
+    }
+#else
+    (void)encoding;
+#endif
+    return gzip_compress(data, out);
+}
+
+// Writes the variants of one original that are missing or belong to an older version, removes those of
+// a deleted original. Files are replaced by rename so a worker never sends a half written variant
+static void precompress_file(const std::string& path)
+{
+    struct stat st;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        if (fd >= 0) close(fd);
+        if (fd < 0 && errno == ENOENT)
+        {
+            for (int i = 0; i < ENCODING_COUNT; i++) unlink(variant_path(path, i).c_str());
+        }
+        return;
+    }
+    uint8_t fresh = fresh_variants(path, st);
+    if (fresh == (1 << ENCODING_COUNT) - 1 || st.st_size > PRECOMPRESS_MAX_FILE)
+    {
+        close(fd);
+        return;
+    }
+
+    std::string data(st.st_size, '\0');
+    size_t done = 0;
+    while (done < data.size())
+    {
+        ssize_t got = pread(fd, &data[done], data.size() - done, done);
+        if (got <= 0) break;
+        done += got;
+    }
+    close(fd);
+    if (done != data.size()) return;
+
+    for (int i = 0; i < ENCODING_COUNT; i++)
+    {
+        if (fresh & (1 << i)) continue;
+        std::string variant = variant_path(path, i);
+        std::string compressed;
+        if (!compress_variant(i, data, compressed) || compressed.size() >= data.size())
+        {
+            // Not worth sending, an outdated one must not stay around either
+            unlink(variant.c_str());
+            continue;
+        }
+
+        std::error_code error;
+        std::filesystem::create_directories(std::filesystem::path(variant).parent_path(), error);
+        std::string temporary = variant + "." + std::to_string(getpid()) + ".tmp";
+        int out = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out < 0)
+        {
+            perror(temporary.c_str());
+            continue;
+        }
+        size_t written = 0;
+        while (written < compressed.size())
+        {
+            ssize_t sent = write(out, compressed.data() + written, compressed.size() - written);
+            if (sent <= 0) break;
+            written += sent;
+        }
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        bool ok = written == compressed.size() && futimens(out, times) == 0;
+        close(out);
+        if (!ok || rename(temporary.c_str(), variant.c_str()) < 0)
+        {
+            perror(variant.c_str());
+            unlink(temporary.c_str());
+        }
+    }
+}
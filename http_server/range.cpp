@@ -0,0 +1,127 @@
+#include <sys/types.h>
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+
+#define MAX_RANGES      16      // a Range header with more is ignored and the whole file sent
+
+// Inclusive byte offsets as in Content-Range
+struct ByteRange
+{
+    off_t first;
+    off_t last;
+};
+
+// One part of a multipart/byteranges body: delimiter and part headers, then a span of the file.
+// The closing delimiter is a last part without a span
+struct RangePart
+{
+    std::string head;
+    off_t offset;
+    size_t length;
+};
+
+enum class RangeResult
+{
+    IGNORE,         // no usable Range, send the whole file with 200
+    SATISFIABLE,    // 206 with the ranges
+    UNSATISFIABLE   // 416, no range overlaps the file
+};
+
+static bool parse_range_number(std::string_view& text, off_t& value)
+{
+    size_t i = 0;
+    uint64_t number = 0;
+    while (i < text.size() && text[i] >= '0' && text[i] <= '9')
+    {
+        // Saturates, anything this large lies past the end of any file
+        number = number > (uint64_t)INT64_MAX / 10 ? (uint64_t)INT64_MAX : number * 10 + (text[i] - '0');
+        i++;
+    }
+    if (i == 0) return false;
+    value = (off_t)std::min(number, (uint64_t)INT64_MAX);
+    text.remove_prefix(i);
+    return true;
+}
+
+// Range: bytes=0-499, 1000-, -200 (RFC 9110 14.1.2). A syntax error anywhere makes the whole header
+// ignored, unsatisfiable ranges are only dropped. Overlapping and adjacent ranges are merged, more than
+// MAX_RANGES in one header are ignored so a request cannot ask for the file in thousands of pieces
+static RangeResult parse_range(std::string_view value, off_t size, std::vector<ByteRange>& ranges)
+{
+    ranges.clear();
+    if (value.size() < 6 || strncasecmp(value.data(), "bytes=", 6) != 0) return RangeResult::IGNORE;
+    value.remove_prefix(6);
+
+    int count = 0;
+    while (!value.empty())
+    {
+        size_t comma = value.find(',');
+        std::string_view spec = value.substr(0, comma);
+        value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+
+        while (!spec.empty() && (spec.front() == ' ' || spec.front() == '\t')) spec.remove_prefix(1);
+        while (!spec.empty() && (spec.back() == ' ' || spec.back() == '\t')) spec.remove_suffix(1);
+        if (spec.empty()) continue;
+        if (++count > MAX_RANGES) return RangeResult::IGNORE;
+
+        off_t first, last;
+        if (spec.front() == '-')
+        {
+            // Suffix range, the final bytes of the file
+            spec.remove_prefix(1);
+            off_t suffix;
+            if (!parse_range_number(spec, suffix) || !spec.empty()) return RangeResult::IGNORE;
+            if (suffix == 0 || size == 0) continue;
+            first = size - std::min(suffix, size);
+            last = size - 1;
+        }
+        else
+        {
+            if (!parse_range_number(spec, first) || spec.empty() || spec.front() != '-') return RangeResult::IGNORE;
+            spec.remove_prefix(1);
+            last = INT64_MAX;
+            if (!spec.empty() && (!parse_range_number(spec, last) || !spec.empty())) return RangeResult::IGNORE;
+            if (last < first) return RangeResult::IGNORE;
+            if (first >= size) continue;
+            last = std::min(last, size - 1);
+        }
+        ranges.push_back({ first, last });
+    }
+    if (count == 0) return RangeResult::IGNORE;
+    if (ranges.empty()) return RangeResult::UNSATISFIABLE;
+
+    std::sort(ranges.begin(), ranges.end(), [](const ByteRange& a, const ByteRange& b) { return a.first < b.first; });
+    size_t merged = 0;
+    for (size_t i = 1; i < ranges.size(); i++)
+    {
+        if (ranges[i].first <= ranges[merged].last + 1)
+        {
+            ranges[merged].last = std::max(ranges[merged].last, ranges[i].last);
+        }
+        else
+        {
+            ranges[++merged] = ranges[i];
+        }
+    }
+    ranges.resize(merged + 1);
+    return RangeResult::SATISFIABLE;
+}
+
+// If-Range holds the validator the client's partial copy came with. Both are compared strongly:
+// the entity tag must be ours exactly, a date must equal the modification time
+static bool if_range_matches(std::string_view value, std::string_view etag, time_t mtime)
+{
+    if (value.empty()) return true;
+    if (value.front() == '"' || value.substr(0, 2) == "W/") return value == etag;
+    return value == http_date(mtime);
+}
+
+static std::string content_range(const ByteRange& range, off_t size)
+{
+    return "bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) + "/" + std::to_string(size);
+}
@@ -0,0 +1,182 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <algorithm>
+
+#define TRACE_FLUSH_BYTES   (64 * 1024)
+#define TRACE_FLUSH_MS      1000
+
+// Monotonic ns timestamps of one request, CLOCK_MONOTONIC is shared by all processes so the accept
+// time taken by the master lines up with the worker's. Zero means the phase did not happen
+struct RequestTrace
+{
+    uint64_t accepted = 0;          // accept() in the master, or in this worker with --reuseport
+    uint64_t added = 0;             // worker took over the descriptor
+    uint64_t handshake_done = 0;
+    uint64_t first_byte = 0;        // first bytes of this request were read, or it was left over from the last one
+    uint64_t read_ns = 0;           // inside SSL_read for this request
+    uint64_t parse_ns = 0;          // inside the parser, calls on incomplete heads included
+    uint64_t parsed = 0;
+    uint64_t handled = 0;           // response queued, file opened or copied from the cache
+    uint64_t written = 0;
+    int status = 0;
+    uint64_t bytes = 0;             // response bytes handed to TLS, headers included
+    bool connection_phases = true;  // first request on the connection, it carries the accept and handshake
+    std::string method;             // copies, the parsed views die with the input buffer
+    std::string path;
+
+    // Ready for the next request on the same connection, the strings keep their capacity
+    void next()
+    {
+        first_byte = read_ns = parse_ns = parsed = handled = written = bytes = 0;
+        status = 0;
+        connection_phases = false;
+        method.clear();
+        path.clear();
+    }
+};
+
+static inline uint64_t trace_us(uint64_t from, uint64_t to)
+{
+    return from && to > from ? (to - from) / 1000 : 0;
+}
+
+// One logfmt line per request, every duration in microseconds:
+// wait is time spent waiting for the rest of the head, handle covers file lookup and header building,
+// write runs until TLS took the last byte
+static size_t format_access_log(char *out, size_t size, const RequestTrace& trace)
+{
+    uint64_t start = trace.connection_phases && trace.accepted ? trace.accepted : trace.first_byte;
+    uint64_t head = trace_us(trace.first_byte, trace.parsed);
+    uint64_t busy = (trace.read_ns + trace.parse_ns) / 1000;
+    int n = snprintf(out, size, " status=%d bytes=%lu total_us=%lu handoff_us=%lu handshake_us=%lu wait_us=%lu"
+                     " read_us=%lu parse_us=%lu handle_us=%lu write_us=%lu",
+                     trace.status, (unsigned long)trace.bytes, (unsigned long)trace_us(start, trace.written),
+                     (unsigned long)(trace.connection_phases ? trace_us(trace.accepted, trace.added) : 0),
+                     (unsigned long)(trace.connection_phases ? trace_us(trace.added, trace.handshake_done) : 0),
+                     (unsigned long)(head > busy ? head - busy : 0), (unsigned long)(trace.read_ns / 1000),
+                     (unsigned long)(trace.parse_ns / 1000), (unsigned long)trace_us(trace.parsed, trace.handled),
+                     (unsigned long)trace_us(trace.handled, trace.written));
+    return n < 0 ? 0 : (size_t)n < size ? n : size - 1;
+}
+
+// Chrome trace event file (JSON array format, chrome://tracing or ui.perfetto.dev). The master creates it,
+// every worker appends its own batches with O_APPEND. The closing bracket is optional in this format,
+// so the file stays loadable however the server stops
+class TraceWriter
+{
+public:
+    static bool create(const std::string& path);
+    bool open(const std::string& path);
+    bool enabled() const { return fd_ >= 0; }
+    void add(const RequestTrace& trace, int connection);
+    void flush(uint64_t now_ms, bool force = false);
+
+private:
+    int fd_ = -1;
+    int pid_ = 0;
+    std::string buffer_;
+    uint64_t flushed_ms_ = 0;
+
+    void event(const char *name, uint64_t start, uint64_t end, int connection);
+    void append_escaped(std::string_view text);
+};
+
+bool TraceWriter::create(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        perror(("open " + path).c_str());
+        return false;
+    }
+    bool ok = write(fd, "[\n", 2) == 2;
+    close(fd);
+    return ok;
+}
+
+bool TraceWriter::open(const std::string& path)
+{
+    fd_ = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd_ < 0)
+    {
+        perror(("open " + path).c_str());
+        return false;
+    }
+    pid_ = getpid();
+    buffer_.reserve(TRACE_FLUSH_BYTES * 2);
+    return true;
+}
+
+// Complete ("X") event, one row per connection in the worker's process
+void TraceWriter::event(const char *name, uint64_t start, uint64_t end, int connection)
+{
+    if (!start || end < start) return;
+    char line[160];
+    int n = snprintf(line, sizeof(line), "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d},\n",
+                     name, start / 1e3, (end - start) / 1e3, pid_, connection);
+    if (n > 0) buffer_.append(line, std::min((size_t)n, sizeof(line) - 1));
+}
+
+void TraceWriter::add(const RequestTrace& trace, int connection)
+{
+    if (trace.connection_phases)
+    {
+        event("handoff", trace.accepted, trace.added, connection);
+        event("handshake", trace.added, trace.handshake_done, connection);
+    }
+
+    // Shed connections never send a request
+    if (!trace.first_byte || trace.written < trace.first_byte) return;
+
+    // The request span carries what the access log says about it, the phases nest inside
+    char line[160];
+    int n = snprintf(line, sizeof(line), "{\"name\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                     "\"args\":{\"status\":%d,\"bytes\":%lu,\"method\":\"", trace.first_byte / 1e3,
+                     (trace.written - trace.first_byte) / 1e3, pid_, connection, trace.status, (unsigned long)trace.bytes);
+    if (n <= 0 || (size_t)n >= sizeof(line)) return;
+    buffer_.append(line, n);
+    append_escaped(trace.method);
+    buffer_ += "\",\"path\":\"";
+    append_escaped(trace.path);
+    buffer_ += "\"}},\n";
+
+    event("parse", trace.parsed - trace.parse_ns, trace.parsed, connection);
+    event("handle", trace.parsed, trace.handled, connection);
+    event("write", trace.handled, trace.written, connection);
+}
+
+// The parser already refused CTLs. Bytes above ASCII go out as \u00XX since the target need not be UTF-8
+void TraceWriter::append_escaped(std::string_view text)
+{
+    for (char c : text)
+    {
+        if ((unsigned char)c >= 0x80)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c);
+            buffer_ += escaped;
+            continue;
+        }
+        if (c == '"' || c == '\\') buffer_ += '\\';
+        buffer_ += c;
+    }
+}
+
+void TraceWriter::flush(uint64_t now_ms, bool force)
+{
+    if (buffer_.empty())
+    {
+        flushed_ms_ = now_ms;
+        return;
+    }
+    if (!force && buffer_.size() < TRACE_FLUSH_BYTES && now_ms - flushed_ms_ < TRACE_FLUSH_MS) return;
+
+    // Small enough for one write, O_APPEND keeps batches from different workers apart
+    if (write(fd_, buffer_.data(), buffer_.size()) < 0) perror("write trace");
+    buffer_.clear();
+    flushed_ms_ = now_ms;
+}
@@ -1,52 +1,248 @@
 #include <string>
-#include <iostream>
-#include <sstream>
-#include <unordered_map>
+#include <string_view>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
 
+#include "simd_scan.cpp"
+
+#define MAX_HEADERS         64
+#define MAX_REQUEST_LINE    8192
+#define MAX_HEADER_BYTES    16384
+
+enum class ParseStatus {
+    INCOMPLETE,     // need more bytes
+    DONE,           // request head complete, see RequestParser::consumed()
+    ERROR           // malformed or over a limit, see RequestParser::error_status()
+};
+
+struct HttpHeader {
+    std::string_view name;
+    std::string_view value;
+};
+
+// Views point into the connection buffer, they are valid until the buffer is modified
 struct HttpRequest {
-    std::string method;
-    std::string path;
-    std::string version;
-    std::unordered_map<std::string, std::string> headers;
+    std::string_view method;
+    std::string_view path;
+    std::string_view version;
+    HttpHeader headers[MAX_HEADERS];
+    size_t header_count = 0;
+
+    std::string_view header(std::string_view name) const;
+    bool keep_alive() const;
 };
 
+// Resumable parser for the request head. Feed it the whole buffer every time more bytes
+// arrive, it only scans what it has not seen yet and never allocates
 class RequestParser {
 public:
-    RequestParser(const std::string& request) : request_(request) {}
-    HttpRequest parse();
+    RequestParser() { reset(); }
+    void reset();
+    ParseStatus parse(const char *data, size_t length, HttpRequest& request);
+    size_t consumed() const { return scan_; }
+    int error_status() const { return error_; }
+    size_t body_length() const { return body_length_; }
 
 private:
-    HttpRequest http_request;
-    std::string request_;
+    enum class State { REQUEST_LINE, HEADERS, DONE, FAILED };
+
+    struct Span {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    State state_;
+    size_t scan_;       // start of the first line not parsed yet
+    size_t searched_;   // no control byte between scan_ and this offset
+    int error_;
+    Span method_, path_, version_;
+    Span names_[MAX_HEADERS];
+    Span values_[MAX_HEADERS];
+    size_t count_;
+    size_t body_length_;
+
+    ParseStatus fail(int status);
+    int frame_body(const char *data);
+    bool parse_request_line(const char *data, size_t start, size_t end);
+    bool parse_header_line(const char *data, size_t start, size_t end);
 };
 
-HttpRequest RequestParser::parse()
+std::string_view HttpRequest::header(std::string_view name) const
 {
-    printf("--------------------\n");
-    printf("%s\n", request_.c_str());
-    printf("--------------------\n");
+    for (size_t i = 0; i < header_count; i++) {
+        if (headers[i].name.size() == name.size() &&
+            strncasecmp(headers[i].name.data(), name.data(), name.size()) == 0) {
+            return headers[i].value;
+        }
+    }
+    return std::string_view();
+}
 
-    std::istringstream stream(request_);
-    HttpRequest request;
-    std::string line;
-    
-    // Parse request line
-    if (std::getline(stream, line)) {
-        std::istringstream line_stream(line);
-        line_stream >> request.method >> request.path >> request.version;
+// Case-insensitive search of a comma separated header list such as Connection
+static bool has_token(std::string_view list, std::string_view token)
+{
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        std::string_view item = list.substr(0, comma);
+        while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) item.remove_prefix(1);
+        while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) item.remove_suffix(1);
+        if (item.size() == token.size() && strncasecmp(item.data(), token.data(), token.size()) == 0) return true;
+        if (comma == std::string_view::npos) break;
+        list.remove_prefix(comma + 1);
     }
-    
-    // Parse headers
-    while (std::getline(stream, line) && !line.empty()) {
-        size_t colon_pos = line.find(':');
-        if (colon_pos != std::string::npos) {
-            std::string key = line.substr(0, colon_pos);
-            std::string value = line.substr(colon_pos + 1);
-            while (!value.empty() && (value[0] == ' ' || value[0] == '\t')) {
-                value.erase(0, 1);
+    return false;
+}
+
+// HTTP/1.1 connections persist unless the client says close, HTTP/1.0 ones only on request
+bool HttpRequest::keep_alive() const
+{
+    std::string_view connection = header("Connection");
+    if (version == "HTTP/1.0") return has_token(connection, "keep-alive");
+    return !has_token(connection, "close");
+}
+
+void RequestParser::reset()
+{
+    state_ = State::REQUEST_LINE;
+    scan_ = 0;
+    searched_ = 0;
+    error_ = 0;
+    count_ = 0;
+    body_length_ = 0;
+}
+
+ParseStatus RequestParser::fail(int status)
+{
+    state_ = State::FAILED;
+    error_ = status;
+    return ParseStatus::ERROR;
+}
+
+ParseStatus RequestParser::parse(const char *data, size_t length, HttpRequest& request)
+{
+    if (state_ == State::FAILED) return ParseStatus::ERROR;
+
+    while (state_ != State::DONE) {
+        // One pass finds the end of the line and rejects stray control bytes in it
+        size_t from = searched_ > scan_ ? searched_ : scan_;
+        size_t hit = from + scan_kernels->ctl(data + from, length - from);
+        bool incomplete = hit == length || (data[hit] == '\r' && hit + 1 == length);
+        if (incomplete) {
+            searched_ = hit;
+            if (state_ == State::REQUEST_LINE && length - scan_ > MAX_REQUEST_LINE) return fail(414);
+            if (length > MAX_HEADER_BYTES) return fail(431);
+            return ParseStatus::INCOMPLETE;
+        }
+
+        size_t stop = hit;
+        size_t end = hit;
+        if (data[hit] == '\r') {
+            if (data[hit + 1] != '\n') return fail(400);
+            end = hit + 1;
+        }
+        else if (data[hit] != '\n') {
+            return fail(400);
+        }
+
+        if (state_ == State::REQUEST_LINE) {
+            // Empty lines before the request line are ignored (RFC 9112 2.2)
+            if (stop > scan_) {
+                if (stop - scan_ > MAX_REQUEST_LINE) return fail(414);
+                if (!parse_request_line(data, scan_, stop)) return fail(400);
+                state_ = State::HEADERS;
             }
-            request.headers[key] = value;
         }
+        else if (stop == scan_) {
+            state_ = State::DONE;
+        }
+        else if (!parse_header_line(data, scan_, stop)) {
+            return fail(error_ ? error_ : 400);
+        }
+
+        scan_ = end + 1;
+        if (scan_ > MAX_HEADER_BYTES) return fail(431);
+    }
+
+    int status = frame_body(data);
+    if (status) return fail(status);
+
+    request.method = std::string_view(data + method_.offset, method_.length);
+    request.path = std::string_view(data + path_.offset, path_.length);
+    request.version = std::string_view(data + version_.offset, version_.length);
+    request.header_count = count_;
+    for (size_t i = 0; i < count_; i++) {
+        request.headers[i].name = std::string_view(data + names_[i].offset, names_[i].length);
+        request.headers[i].value = std::string_view(data + values_[i].offset, values_[i].length);
+    }
+    return ParseStatus::DONE;
+}
+
+bool RequestParser::parse_request_line(const char *data, size_t start, size_t end)
+{
+    // method SP request-target SP HTTP-version
+    size_t pos = start + scan_kernels->token(data + start, end - start);
+    if (pos == start || pos >= end || data[pos] != ' ') return false;
+    method_ = { (uint32_t)start, (uint32_t)(pos - start) };
+
+    // The line scan already rejected control bytes, only HTAB can still hide in the target
+    size_t target = ++pos;
+    const char *space = (const char*)memchr(data + target, ' ', end - target);
+    if (!space || space == data + target) return false;
+    pos = space - data;
+    if (memchr(data + target, '\t', pos - target)) return false;
+    path_ = { (uint32_t)target, (uint32_t)(pos - target) };
+
+    size_t version = ++pos;
+    if (end - version != 8 || memcmp(data + version, "HTTP/1.", 7) != 0) return false;
+    if (data[version + 7] != '0' && data[version + 7] != '1') return false;
+    version_ = { (uint32_t)version, 8 };
+    return true;
+}
+
+bool RequestParser::parse_header_line(const char *data, size_t start, size_t end)
+{
+    // Obsolete line folding is rejected (RFC 9112 5.2)
+    if (data[start] == ' ' || data[start] == '\t') return false;
+    if (count_ == MAX_HEADERS) {
+        error_ = 431;
+        return false;
+    }
+
+    size_t pos = start + scan_kernels->token(data + start, end - start);
+    if (pos == start || pos >= end || data[pos] != ':') return false;
+    names_[count_] = { (uint32_t)start, (uint32_t)(pos - start) };
+
+    pos++;
+    while (pos < end && (data[pos] == ' ' || data[pos] == '\t')) pos++;
+    size_t value_end = end;
+    while (value_end > pos && (data[value_end - 1] == ' ' || data[value_end - 1] == '\t')) value_end--;
+    values_[count_] = { (uint32_t)pos, (uint32_t)(value_end - pos) };
+    count_++;
+    return true;
+}
+
+// Works out how many body bytes follow the head (RFC 9112 6.3). Transfer codings are not
+// decoded, so a request using one cannot be framed and gets 501
+int RequestParser::frame_body(const char *data)
+{
+    bool seen = false;
+    for (size_t i = 0; i < count_; i++) {
+        std::string_view name(data + names_[i].offset, names_[i].length);
+        std::string_view value(data + values_[i].offset, values_[i].length);
+        if (name.size() == 17 && strncasecmp(name.data(), "Transfer-Encoding", 17) == 0) return 501;
+        if (name.size() != 14 || strncasecmp(name.data(), "Content-Length", 14) != 0) continue;
+
+        if (value.empty() || value.size() > 18) return 400;
+        size_t length = 0;
+        for (char c : value) {
+            if (c < '0' || c > '9') return 400;
+            length = length * 10 + (c - '0');
+        }
+        // Repeated fields must agree or the message boundary is ambiguous
+        if (seen && length != body_length_) return 400;
+        body_length_ = length;
+        seen = true;
     }
-    return request;
+    return 0;
 }
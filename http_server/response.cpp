@@ -2,6 +2,7 @@
 #include <sstream>
 #include <string>
 #include <iostream>
+#include <vector>
 
 class Response {
 public:
@@ -11,13 +12,16 @@ public:
     void setStatusCode(int code);
     int getStatusCode() const;
     std::string buildResponse(std::string body, std::string mime_type);
+    std::string buildHeader(size_t content_length, const std::string& mime_type, bool end_of_headers = true);
     void setBody(const std::string& body);
     std::string getBody() const;
     std::string loadFile(const std::string& path);
     bool fileExists(const std::string& path);
+    void addHeader(const std::string& name, const std::string& value);
 private:
     int statusCode;
     std::string body;
+    std::vector<std::pair<std::string, std::string>> headers;
 };
 
 Response::Response() : statusCode(200), body("") {}
@@ -40,25 +44,74 @@ std::string Response::getBody() const {
     return body;
 }
 
+void Response::addHeader(const std::string& name, const std::string& value) {
+    headers.emplace_back(name, value);
+}
+
 std::string Response::buildResponse(std::string body, std::string mime_type) {
+    std::string response = buildHeader(body.length(), mime_type);
+    response += body;
+
+    return response;
+}
+
+// Without end_of_headers the blank line is left out so the caller can still append header fields
+std::string Response::buildHeader(size_t content_length, const std::string& mime_type, bool end_of_headers) {
     std::string response = "HTTP/1.1 ";
     switch (statusCode) {
     case 200:
         response += "200 OK\r\n";
         break;
+    case 206:
+        response += "206 Partial Content\r\n";
+        break;
+    case 304:
+        response += "304 Not Modified\r\n";
+        break;
+    case 400:
+        response += "400 Bad Request\r\n";
+        break;
     case 404:
         response += "404 Not Found\r\n";
         break;
+    case 408:
+        response += "408 Request Timeout\r\n";
+        break;
+    case 413:
+        response += "413 Content Too Large\r\n";
+        break;
+    case 414:
+        response += "414 URI Too Long\r\n";
+        break;
+    case 416:
+        response += "416 Range Not Satisfiable\r\n";
+        break;
+    case 431:
+        response += "431 Request Header Fields Too Large\r\n";
+        break;
     case 500:
         response += "500 Internal Server Error\r\n";
         break;
+    case 501:
+        response += "501 Not Implemented\r\n";
+        break;
+    case 503:
+        response += "503 Service Unavailable\r\n";
+        break;
     default:
         response += "200 OK\r\n";
     }
-    response += "Content-Type: " + mime_type + "\r\n";
-    response += "Content-Length: " + std::to_string(body.length()) + "\r\n";
-    response += "\r\n";
-    response += body;
+    // A 304 stands for a stored response, it describes no content of its own
+    if (statusCode != 304) {
+        response += "Content-Type: " + mime_type + "\r\n";
+        response += "Content-Length: " + std::to_string(content_length) + "\r\n";
+    }
+    for (const auto& header : headers) {
+        response += header.first + ": " + header.second + "\r\n";
+    }
+    if (end_of_headers) {
+        response += "\r\n";
+    }
 
     return response;
 }
@@ -0,0 +1,72 @@
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <new>
+
+// One cache line per worker so workers updating their own counters do not bounce each other's lines
+struct alignas(64) WorkerSlot
+{
+    std::atomic<int> pid;
+    std::atomic<uint32_t> connections;  // open connections, incremented by whoever hands the fd out
+    std::atomic<uint32_t> inflight;     // requests parsed but not fully written yet
+    std::atomic<uint64_t> requests;     // requests served since the worker started
+    std::atomic<uint32_t> latency_us;   // moving average of request latency
+    std::atomic<uint64_t> shed;         // connections answered with the 503 page
+    std::atomic<uint64_t> handshakes;   // completed TLS handshakes
+    std::atomic<uint64_t> handshake_ns; // wall time from taking the connection over to the finished handshake
+    std::atomic<uint64_t> handshake_cpu_ns; // of that, time spent inside SSL_do_handshake
+    std::atomic<uint64_t> serve_ns;     // time spent reading, parsing and writing requests
+};
+
+// Shared memory table created before fork, the master reads it to route new connections
+class Scoreboard
+{
+public:
+    void create(int slots);
+    void reset(int index);
+    WorkerSlot& slot(int index) { return slots_[index]; }
+    int size() const { return count_; }
+    uint32_t load(int index) const;
+
+private:
+    WorkerSlot *slots_ = nullptr;
+    int count_ = 0;
+};
+
+void Scoreboard::create(int slots)
+{
+    void *memory = mmap(NULL, sizeof(WorkerSlot) * slots, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        perror("mmap scoreboard");
+        exit(EXIT_FAILURE);
+    }
+    slots_ = new (memory) WorkerSlot[slots];
+    count_ = slots;
+    for (int i = 0; i < slots; i++)
+    {
+        reset(i);
+    }
+}
+
+void Scoreboard::reset(int index)
+{
+    slots_[index].pid.store(0, std::memory_order_relaxed);
+    slots_[index].connections.store(0, std::memory_order_relaxed);
+    slots_[index].inflight.store(0, std::memory_order_relaxed);
+    slots_[index].requests.store(0, std::memory_order_relaxed);
+    slots_[index].latency_us.store(0, std::memory_order_relaxed);
+    slots_[index].shed.store(0, std::memory_order_relaxed);
+    slots_[index].handshakes.store(0, std::memory_order_relaxed);
+    slots_[index].handshake_ns.store(0, std::memory_order_relaxed);
+    slots_[index].handshake_cpu_ns.store(0, std::memory_order_relaxed);
+    slots_[index].serve_ns.store(0, std::memory_order_relaxed);
+}
+
+uint32_t Scoreboard::load(int index) const
+{
+    return slots_[index].connections.load(std::memory_order_relaxed) +
+           slots_[index].inflight.load(std::memory_order_relaxed);
+}
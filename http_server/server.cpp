@@ -1,5 +1,6 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -8,20 +9,52 @@
 #include <sys/stat.h>
 #include <string>
 #include <map>
+#include <set>
 #include <vector>
 
 #include <sys/types.h>
-#include <sys/ipc.h>
-#include <sys/msg.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <signal.h>
+#include <unordered_map>
+#include <sched.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/inotify.h>
 
 
 #include "ssl.cpp"
 #include "response.cpp"
 #include "requestparser.cpp"
+#include "conditional.cpp"
 #include "logger_strategy.cpp"
+#include "timer_wheel.cpp"
+#include "request_trace.cpp"
+#include "range.cpp"
+#include "connection.cpp"
+#include "scoreboard.cpp"
+#include "metrics.cpp"
+#include "file_cache.cpp"
+#include "precompress.cpp"
+#include "session_cache.cpp"
+#include "log_ring.cpp"
 
 #include "defs.h"
 
+enum class AcceptMode
+{
+    MASTER,     // master accepts and passes fds to workers
+    REUSEPORT   // every worker listens on its own SO_REUSEPORT socket
+};
+
+enum class RoutePolicy
+{
+    LEAST_LOADED,   // scan every worker and pick the smallest load
+    TWO_CHOICES     // sample two workers and pick the less loaded one
+};
+
 class Server
 {
     private:
@@ -29,7 +62,7 @@ class Server
     struct sockaddr_in address;
     socklen_t addrlen= sizeof(address);
     int opt = 1;
-    int server_fd, new_socket;
+    int server_fd, new_socket = -1;
     SSL_CTX *ctx;
 
     Server();
@@ -45,30 +78,117 @@ class Server
     void bind_socket();
     void listen_socket();
     void run();
-    void send_response(SSL *ssl, HttpRequest http_request);
-    void send_response(SSL *ssl, std::string path);
-    void handle_client(SSL *ssl);
+
+    AcceptMode accept_mode = AcceptMode::MASTER;
+    bool cpu_affinity = false;
+    RoutePolicy route_policy = RoutePolicy::LEAST_LOADED;
+    int min_workers = MIN_WORKERS;
+    int max_workers = MAX_WORKERS;
+    size_t cache_bytes = FILE_CACHE_BYTES;
+    uint32_t session_entries = SESSION_CACHE_ENTRIES;
+    std::string trace_path;     // Chrome trace event file, empty when tracing is off
+    void send_response(Connection *conn, const HttpRequest& http_request);
+    void send_error(Connection *conn, int status);
+    void send_metrics(Connection *conn, const HttpRequest& http_request);
+    bool send_response(Connection *conn, std::string file_path, int status, const HttpRequest *request = nullptr);
+    void send_ranges(Connection *conn, int fd, const struct stat& st, const std::string& mime_type, const std::string& etag,
+                     int encoding, const std::vector<ByteRange>& ranges);
+    void send_not_modified(Connection *conn, const std::string& etag, time_t mtime, const std::string& mime_type);
+    void add_file_headers(Response& response, const struct stat& st, const std::string& mime_type, const std::string& etag,
+                          int encoding);
+    void send_range_not_satisfiable(Connection *conn, off_t size);
+    void start_next_part(Connection *conn);
+    bool send_cached(Connection *conn, const std::string& file_path, const HttpRequest& http_request);
+    void end_headers(Connection *conn);
+    bool fill_from_file(Connection *conn);
+    static bool normalize_path(std::string_view request_path, std::string& file_path);
+
+    // Static file cache shared by all workers, invalidated by the master through inotify
+    FileCache file_cache;
+    int inotify_fd = -1;
+    std::unordered_map<int, std::string> watched_dirs;
+    void watch_directory(const std::string& dir);
+    void handle_file_changes();
+
+    // gzip and brotli variants of the text files in www, written at startup and after every change.
+    // Changed files queue up while one child compresses the previous batch
+    std::set<std::string> precompress_queue;
+    std::vector<std::string> precompress_batch;
+    pid_t precompress_pid = 0;
+    bool precompress_candidate(const std::string& path);
+    void precompress_directory(const std::string& dir);
+    void start_precompress();
+    void finish_precompress();
+
+    // Ticket keys and session IDs shared by all workers so any of them can resume a session
+    SessionCache session_cache;
+
+    // Per-worker event loop
+    int epoll_fd;
+    std::unordered_map<int, Connection*> connections;
+    void worker_loop(int worker_id, int channel);
+    void listen_worker_socket(int worker_id);
+    void accept_passed_fds(int channel);
+    void accept_connections();
+    void add_connection(int fd, bool shed, uint64_t accepted);
+    void queue_shed_response(Connection *conn);
+    void start_draining();
+    void handle_event(Connection *conn, uint32_t events);
+    bool do_handshake(Connection *conn);
+    bool do_read(Connection *conn);
+    bool do_write(Connection *conn);
+    bool process_requests(Connection *conn);
+    void update_events(Connection *conn);
+    void close_connection(Connection *conn);
+    void report_phases();
+    void finish_trace(Connection *conn, uint64_t now);
+    TraceWriter trace_writer;
+    uint64_t reported_phases[4] = {};  // handshakes, handshake ns, handshake cpu ns, serve ns
+    uint64_t reported_requests = 0;
+    TimerWheel timers{TIMER_TICK_MS};
+    void update_timer(Connection *conn);
+    void expire_timers();
     std::string get_mime_type(const std::string& file_path);
+    const std::string& cache_control(const std::string& mime_type);
 
-    ConsoleLogger console_logger;
-    FileLogger file_logger;
-    Logger logger;
     std::map<std::string, std::string> mime_types;
+    std::map<std::string, std::string> cache_policies;  // by MIME type, or by "type/" for all subtypes
 
     int worker_sockets[MAX_WORKERS][2];
+    Scoreboard scoreboard;
+    Metrics metrics;
+    int worker_index = -1;
+    uint32_t route_seed = 2463534242u;
+    int quiet_ticks = 0;
+    bool draining = false;
+    std::string shed_response;
+    std::vector<Connection*> master_shed;   // no worker could take them, the master sends the 503 page
+    int pick_worker();
+    int least_loaded_worker();
+    int free_worker_slot();
+    void accept_and_dispatch();
+    bool pass_connection(int index, char command, uint64_t accepted);
+    void shed_in_master(int fd);
+    void drive_master_shed();
     void create_workers();
+    int spawn_worker(int index);
+    void retire_worker(int index);
+    void reap_workers();
+    void scale_workers();
     void create_logger();
     std::vector<int> workers;
     int logger_worker;
-    int log_queue_id;
-    int recv_fd(int socket);
-    void send_fd(int socket, int fd);
+    LogRing log_ring;
+    int recv_fd(int socket, char *command = NULL, uint64_t *accepted = NULL);
+    int send_fd(int socket, int fd, char command = 'C', uint64_t accepted = 0);
 };
 
-struct log_msg {
-    long mtype;
-    char text[256];
-};
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 Server& Server::getInstance()
 {
@@ -87,7 +207,8 @@ void Server::create_socket()
     }
 
     // Forcefully attaching socket to the port 8080
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) 
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) 
     {
         perror("setsockopt");
         exit(EXIT_FAILURE);
@@ -105,11 +226,17 @@ void Server::bind_socket()
 
 void Server::listen_socket()
 {
-    if (listen(server_fd, 3) < 0) 
+    if (listen(server_fd, SOMAXCONN) < 0) 
     {
         perror("listen");
         exit(EXIT_FAILURE);
     }
+    // Connections that never send a ClientHello stay in the kernel instead of occupying a worker
+    int defer = HANDSHAKE_TIMEOUT_MS / 1000;
+    if (setsockopt(server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer)) < 0) 
+    {
+        perror("setsockopt TCP_DEFER_ACCEPT");
+    }
 }
 
 
@@ -127,219 +254,1829 @@ std::string Server::get_mime_type(const std::string& file_path)
     return "text/html";
 }
 
+// Exact MIME type first, then the policy for its top level type, files without one are revalidated every time
+const std::string& Server::cache_control(const std::string& mime_type)
+{
+    auto policy = cache_policies.find(mime_type);
+    if (policy == cache_policies.end()) 
+    {
+        policy = cache_policies.find(mime_type.substr(0, mime_type.find('/') + 1));
+    }
+    if (policy == cache_policies.end()) policy = cache_policies.find("");
+    return policy->second;
+}
+
+
+// Validators and policy of a 200 or 206, ranges count in the bytes of the representation sent
+void Server::add_file_headers(Response& response, const struct stat& st, const std::string& mime_type, const std::string& etag,
+                              int encoding)
+{
+    response.addHeader("Accept-Ranges", "bytes");
+    response.addHeader("ETag", etag);
+    response.addHeader("Last-Modified", http_date(st.st_mtime));
+    response.addHeader("Cache-Control", cache_control(mime_type));
+    add_encoding_headers(response, mime_type, encoding);
+}
 
-void Server::handle_client(SSL *ssl)
+// Queues the headers, the body is streamed by do_write with SSL_sendfile or pread chunks
+bool Server::send_response(Connection *conn, std::string file_path, int status, const HttpRequest *request)
 {
-    int bytes_read;
-    printf("handle_client start\n");
-    while(1)
+    int fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) 
     {
-        char buffer[1024] = {0};
-        printf("Waiting for client request...\n");
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    std::string mime_type = get_mime_type(file_path);
+    std::string etag = make_etag(st);
 
-        bytes_read = SSL_read(ssl, buffer, 1024-1);
-        printf("Bytes read: %d\n", bytes_read);
-        if(bytes_read == 0)
+    // A precompressed variant replaces the original as the representation sent, with its own validator.
+    // The original is still cached since its entry is where later requests learn about the variants
+    std::string cache_path = file_path;
+    uint8_t variants = 0;
+    int encoding = -1;
+    if (status == 200 && request && precompressible(mime_type)) 
+    {
+        variants = fresh_variants(file_path, st);
+        encoding = choose_encoding(request->header("Accept-Encoding"), variants);
+        if (encoding >= 0) 
         {
-            break;
+            cache_path += content_encodings[encoding].suffix;
+            int variant_fd = open(variant_path(file_path, encoding).c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat variant_st;
+            if (variant_fd < 0 || fstat(variant_fd, &variant_st) < 0) 
+            {
+                if (variant_fd >= 0) close(variant_fd);
+                variants &= ~(1 << encoding);
+                cache_path = file_path;
+                encoding = -1;
+            }
+            else 
+            {
+                if (st.st_size <= FILE_CACHE_MAX_FILE) 
+                {
+                    Response response;
+                    response.setStatusCode(200);
+                    add_file_headers(response, st, mime_type, etag, -1);
+                    file_cache.insert(file_path, fd, st, response.buildHeader(st.st_size, mime_type, false), etag, variants);
+                }
+                close(fd);
+                fd = variant_fd;
+                st = variant_st;
+                etag = make_etag(st);
+            }
         }
-        /*else if(bytes_read < 0)
+    }
+
+    if (status == 200 && request && not_modified(*request, etag, st.st_mtime)) 
+    {
+        close(fd);
+        send_not_modified(conn, etag, st.st_mtime, mime_type);
+        return true;
+    }
+
+    std::string_view range = request ? request->header("Range") : std::string_view();
+    if (status == 200 && !range.empty() && request->method == "GET" && if_range_matches(request->header("If-Range"), etag, st.st_mtime)) 
+    {
+        std::vector<ByteRange> ranges;
+        RangeResult result = parse_range(range, st.st_size, ranges);
+        if (result == RangeResult::UNSATISFIABLE) 
         {
-            perror("read");
-            break;
-        }*/
+            close(fd);
+            send_range_not_satisfiable(conn, st.st_size);
+            return true;
+        }
+        if (result == RangeResult::SATISFIABLE) 
+        {
+            send_ranges(conn, fd, st, mime_type, etag, encoding, ranges);
+            return true;
+        }
+    }
+
+    Response response;
+    response.setStatusCode(status);
+    if (status == 200) 
+    {
+        add_file_headers(response, st, mime_type, etag, encoding);
+    }
+    conn->trace.status = status;
+    std::string header = response.buildHeader(st.st_size, mime_type, false);
+    if (status == 200 && st.st_size <= FILE_CACHE_MAX_FILE) 
+    {
+        // Next request for this path is served from shared memory
+        file_cache.insert(cache_path, fd, st, header, etag, encoding < 0 ? variants : 0);
+    }
+    conn->out += header;
+    end_headers(conn);
+    conn->state = ConnState::WRITING;
+    // HEAD gets the same header fields, Content-Length included, and nothing after them
+    if (st.st_size == 0 || (request && request->method == "HEAD")) 
+    {
+        close(fd);
+        return true;
+    }
+    conn->file_fd = fd;
+    conn->file_offset = 0;
+    conn->file_remaining = st.st_size;
 
-        RequestParser request_parser(buffer);
-        HttpRequest http_request = request_parser.parse();
-        send_response(ssl, http_request);
+    // Without kTLS small bodies go out in the same SSL_write as the headers
+    if (!conn->ktls && !fill_from_file(conn)) 
+    {
+        conn->close_after_write = true;
     }
-    SSL_free(ssl);
+    return true;
 }
 
-void Server::send_response(SSL *ssl, std::string file_path)
+// 206 with only the requested spans read from disk. One range is a plain body, several become
+// multipart/byteranges whose parts do_write sends one after another from the same descriptor
+void Server::send_ranges(Connection *conn, int fd, const struct stat& st, const std::string& mime_type, const std::string& etag,
+                         int encoding, const std::vector<ByteRange>& ranges)
 {
+    off_t size = st.st_size;
     Response response;
-    std::string body = response.loadFile(file_path);
-    std::string mime_type = get_mime_type(file_path);
-    std::string response_message = response.buildResponse(body, mime_type);
-    SSL_write(ssl, response_message.c_str(), response_message.length());
-    //logger.log("Response message sent");
+    response.setStatusCode(206);
+    add_file_headers(response, st, mime_type, etag, encoding);
+    conn->trace.status = 206;
+    conn->file_fd = fd;
+    conn->state = ConnState::WRITING;
+
+    if (ranges.size() == 1) 
+    {
+        response.addHeader("Content-Range", content_range(ranges[0], size));
+        conn->out += response.buildHeader(ranges[0].last - ranges[0].first + 1, mime_type, false);
+        end_headers(conn);
+        conn->file_offset = ranges[0].first;
+        conn->file_remaining = ranges[0].last - ranges[0].first + 1;
+    }
+    else 
+    {
+        // Sequence numbers like nginx, a boundary only has to differ from the lines of this body
+        static uint64_t boundary_sequence = 0;
+        char boundary[32];
+        snprintf(boundary, sizeof(boundary), "%d%016lu", getpid(), (unsigned long)++boundary_sequence);
+
+        size_t content_length = 0;
+        conn->parts.clear();
+        for (const ByteRange& range : ranges) 
+        {
+            std::string head = std::string("\r\n--") + boundary + "\r\nContent-Type: " + mime_type +
+                               "\r\nContent-Range: " + content_range(range, size) + "\r\n\r\n";
+            size_t length = range.last - range.first + 1;
+            content_length += head.size() + length;
+            conn->parts.push_back({ std::move(head), range.first, length });
+        }
+        conn->parts.push_back({ std::string("\r\n--") + boundary + "--\r\n", 0, 0 });
+        content_length += conn->parts.back().head.size();
+
+        conn->out += response.buildHeader(content_length, std::string("multipart/byteranges; boundary=") + boundary, false);
+        end_headers(conn);
+        conn->next_part = 0;
+        start_next_part(conn);
+    }
+
+    if (!conn->ktls && !fill_from_file(conn)) 
+    {
+        conn->close_after_write = true;
+    }
 }
 
+// Queues the next part head and points the file span at its bytes, the closing delimiter releases the file
+void Server::start_next_part(Connection *conn)
+{
+    const RangePart &part = conn->parts[conn->next_part++];
+    conn->out += part.head;
+    conn->file_offset = part.offset;
+    conn->file_remaining = part.length;
+    if (conn->next_part == conn->parts.size()) 
+    {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+        conn->parts.clear();
+        conn->next_part = 0;
+    }
+}
 
-void Server::send_response(SSL *ssl, HttpRequest http_request)
+// Header only, with the validators and policy a cache needs to refresh its stored response
+void Server::send_not_modified(Connection *conn, const std::string& etag, time_t mtime, const std::string& mime_type)
 {
     Response response;
-    std::string body;
-    std::string file_path = "www" + http_request.path;
-    std::string mime_type = get_mime_type(file_path);
-    if (response.fileExists(file_path)) 
+    response.setStatusCode(304);
+    response.addHeader("ETag", etag);
+    response.addHeader("Last-Modified", http_date(mtime));
+    response.addHeader("Cache-Control", cache_control(mime_type));
+    add_encoding_headers(response, mime_type, -1);
+    conn->out += response.buildHeader(0, mime_type, false);
+    end_headers(conn);
+    conn->state = ConnState::WRITING;
+    conn->trace.status = 304;
+}
+
+void Server::send_range_not_satisfiable(Connection *conn, off_t size)
+{
+    Response response;
+    response.setStatusCode(416);
+    response.addHeader("Content-Range", "bytes */" + std::to_string(size));
+    std::string body = "<!DOCTYPE html>\n<html><body><h1>416</h1></body></html>\n";
+    conn->out += response.buildHeader(body.size(), "text/html", false);
+    end_headers(conn);
+    conn->out += body;
+    conn->state = ConnState::WRITING;
+    conn->trace.status = 416;
+}
+
+
+bool Server::send_cached(Connection *conn, const std::string& file_path, const HttpRequest& http_request)
+{
+    CachedFile file;
+    if (!file_cache.acquire(file_path, file)) return false;
+
+    // The original's entry names the variants, the chosen one is another entry. Missing from the cache it
+    // is read from disk rather than answering with the original
+    int encoding = choose_encoding(http_request.header("Accept-Encoding"), file.variants);
+    if (encoding >= 0) 
+    {
+        file_cache.release(file);
+        if (!file_cache.acquire(file_path + content_encodings[encoding].suffix, file)) return false;
+    }
+
+    // Revalidation is answered from the entry's metadata alone
+    if (not_modified(http_request, file.etag, file.mtime)) 
+    {
+        std::string etag = file.etag;
+        file_cache.release(file);
+        send_not_modified(conn, etag, file.mtime, get_mime_type(file_path));
+        return true;
+    }
+
+    conn->out.reserve(conn->out.size() + file.header_len + 2 + file.body_len);
+    conn->out.append(file.header, file.header_len);
+    end_headers(conn);
+    if (http_request.method != "HEAD") conn->out.append(file.body, file.body_len);
+    file_cache.release(file);
+    conn->state = ConnState::WRITING;
+    conn->trace.status = 200;
+    return true;
+}
+
+// Cached and freshly built headers stop before the blank line, the connection fields differ per request
+void Server::end_headers(Connection *conn)
+{
+    if (conn->close_after_write) 
     {
-        body = response.loadFile(file_path);
-        //logger.log("File found at: " + std::string(INDEX_PATH)); 
-    } 
+        conn->out += "Connection: close\r\n\r\n";
+    }
     else 
     {
-        body = response.loadFile(FILE_NOT_FOUND_PATH);
-        //logger.log("File not found: " + http_request.path);
+        conn->out += "Connection: keep-alive\r\nKeep-Alive: timeout=" + std::to_string(KEEPALIVE_TIMEOUT_MS / 1000) + "\r\n\r\n";
+    }
+}
+
+// Maps the request target onto a path under www, also the cache key. Fails for paths escaping www
+bool Server::normalize_path(std::string_view request_path, std::string& file_path)
+{
+    std::string_view path = request_path.substr(0, request_path.find_first_of("?#"));
+    if (path.empty() || path[0] != '/') return false;
+    if (path == "/") 
+    {
+        file_path = INDEX_PATH;
+        return true;
     }
-    if (http_request.path == "/") 
+
+    file_path = "www";
+    size_t pos = 0;
+    while (pos < path.size()) 
     {
-        body = response.loadFile(INDEX_PATH);
-        //logger.log("Index file requested");
+        size_t next = path.find('/', pos + 1);
+        if (next == std::string::npos) next = path.size();
+        std::string_view segment = path.substr(pos + 1, next - pos - 1);
+        pos = next;
+        if (segment.empty() || segment == ".") continue;
+        if (segment == "..") return false;
+        file_path += '/';
+        file_path += segment;
     }
+    if (path.back() == '/') file_path += "/";
+    return true;
+}
 
-    std::string response_message = response.buildResponse(body, mime_type);
-    SSL_write(ssl, response_message.c_str(), response_message.length());
-    //logger.log("Response message sent");
+void Server::send_error(Connection *conn, int status)
+{
+    Response response;
+    response.setStatusCode(status);
+    response.addHeader("Connection", "close");
+    std::string body = "<!DOCTYPE html>\n<html><body><h1>" + std::to_string(status) + "</h1></body></html>\n";
+    conn->out += response.buildResponse(body, "text/html");
+    conn->state = ConnState::WRITING;
+    conn->close_after_write = true;
+    conn->trace.status = status;
 }
-void Server::create_workers()
+
+// Totals over every worker slot, read straight from shared memory by the worker serving the request
+void Server::send_metrics(Connection *conn, const HttpRequest& http_request)
 {
-    for (int i = 0; i < MAX_WORKERS; i++) 
+    std::string body;
+    body.reserve(16384);
+
+    uint64_t responses[STATUS_MAX - STATUS_MIN + 1] = {};
+    uint64_t bytes_sent = 0, handshake_failures = 0;
+    LatencySnapshot request_latency, handshake_latency;
+    for (int i = 0; i < metrics.size(); i++) 
     {
-        if (socketpair(AF_UNIX, SOCK_STREAM, 0, worker_sockets[i]) < 0) 
+        WorkerMetrics &slot = metrics.slot(i);
+        for (int code = 0; code <= STATUS_MAX - STATUS_MIN; code++) 
         {
-            perror("socketpair failed");
-            exit(EXIT_FAILURE);
+            responses[code] += slot.responses[code].load(std::memory_order_relaxed);
         }
+        bytes_sent += slot.bytes_sent.load(std::memory_order_relaxed);
+        handshake_failures += slot.handshake_failures.load(std::memory_order_relaxed);
+        request_latency.add(slot.request_latency);
+        handshake_latency.add(slot.handshake_latency);
+    }
 
-        pid_t pid = fork();
-        workers.push_back(pid);
-        if (pid == -1) 
-        {
-            perror("fork");
-            exit(1);
-        }
-        
-        if (pid == 0)
-        {
-            int new_socket;
-            new_socket = recv_fd(worker_sockets[i][1]);
-            SSL *ssl = sslclass.create_ssl(ctx, new_socket);
-            handle_client(ssl);
-        }
-        else
-        {
-            printf("Worker PID: %d\n", pid);
-            close(new_socket);
-            close(worker_sockets[i][1]);
-        }
+    metric_family(body, "http_responses_total", "counter", "Responses written, by status code.");
+    for (int code = 0; code <= STATUS_MAX - STATUS_MIN; code++) 
+    {
+        if (!responses[code]) continue;
+        metric_sample(body, "http_responses_total", "code=\"" + std::to_string(code + STATUS_MIN) + "\"", responses[code]);
+    }
+    metric_family(body, "http_response_bytes_total", "counter", "Response bytes handed to TLS, headers included.");
+    metric_sample(body, "http_response_bytes_total", "", bytes_sent);
+    metric_histogram(body, "http_request_duration_seconds", "First byte of the request to the last byte of the response.",
+                     request_latency);
+
+    // Live state from the scoreboard, a slot without a pid belongs to no running worker
+    uint64_t connections = 0, inflight = 0, shed = 0, workers_alive = 0;
+    std::string worker_requests, worker_connections;
+    for (int i = 0; i < scoreboard.size(); i++) 
+    {
+        WorkerSlot &slot = scoreboard.slot(i);
+        if (slot.pid.load(std::memory_order_relaxed) <= 0) continue;
+        workers_alive++;
+        connections += slot.connections.load(std::memory_order_relaxed);
+        inflight += slot.inflight.load(std::memory_order_relaxed);
+        shed += slot.shed.load(std::memory_order_relaxed);
+        std::string label = "worker=\"" + std::to_string(i) + "\"";
+        metric_sample(worker_requests, "http_worker_requests_total", label, slot.requests.load(std::memory_order_relaxed));
+        metric_sample(worker_connections, "http_worker_connections", label, (uint64_t)slot.connections.load(std::memory_order_relaxed));
+    }
+    metric_family(body, "http_workers", "gauge", "Running worker processes.");
+    metric_sample(body, "http_workers", "", workers_alive);
+    metric_family(body, "http_connections", "gauge", "Open client connections.");
+    metric_sample(body, "http_connections", "", connections);
+    metric_family(body, "http_requests_inflight", "gauge", "Requests parsed whose response is not fully written.");
+    metric_sample(body, "http_requests_inflight", "", inflight);
+    metric_family(body, "http_shed_connections_total", "counter", "Connections answered with the 503 page, running workers only.");
+    metric_sample(body, "http_shed_connections_total", "", shed);
+    metric_family(body, "http_worker_requests_total", "counter", "Requests served by the current process in each worker slot.");
+    body += worker_requests;
+    metric_family(body, "http_worker_connections", "gauge", "Open connections per worker slot.");
+    body += worker_connections;
+
+    if (const TlsStats *tls = session_cache.stats()) 
+    {
+        metric_family(body, "tls_handshakes_total", "counter", "Completed TLS handshakes.");
+        metric_sample(body, "tls_handshakes_total", "session=\"full\"", tls->full.load(std::memory_order_relaxed));
+        metric_sample(body, "tls_handshakes_total", "session=\"resumed\"", tls->resumed.load(std::memory_order_relaxed));
+        metric_family(body, "tls_session_cache_lookups_total", "counter", "Session ID cache lookups by TLS 1.2 clients without tickets.");
+        metric_sample(body, "tls_session_cache_lookups_total", "result=\"hit\"", tls->cache_hits.load(std::memory_order_relaxed));
+        metric_sample(body, "tls_session_cache_lookups_total", "result=\"miss\"", tls->cache_misses.load(std::memory_order_relaxed));
+    }
+    metric_family(body, "tls_handshake_failures_total", "counter", "Handshakes that failed or timed out.");
+    metric_sample(body, "tls_handshake_failures_total", "", handshake_failures);
+    metric_histogram(body, "tls_handshake_duration_seconds", "Worker taking the connection over to the finished handshake.",
+                     handshake_latency);
+
+    if (file_cache.enabled()) 
+    {
+        FileCacheStats cache = file_cache.stats();
+        metric_family(body, "file_cache_lookups_total", "counter", "Static file cache lookups.");
+        metric_sample(body, "file_cache_lookups_total", "result=\"hit\"", cache.hits);
+        metric_sample(body, "file_cache_lookups_total", "result=\"miss\"", cache.misses);
+        metric_family(body, "file_cache_evictions_total", "counter", "Files evicted to make room for others.");
+        metric_sample(body, "file_cache_evictions_total", "", cache.evictions);
     }
+    metric_family(body, "log_dropped_total", "counter", "Log records lost because the shared log ring was full.");
+    metric_sample(body, "log_dropped_total", "", log_ring.dropped());
+
+    Response response;
+    response.setStatusCode(200);
+    conn->out += response.buildHeader(body.size(), "text/plain; version=0.0.4; charset=utf-8", false);
+    conn->out += "Cache-Control: no-store\r\n";
+    end_headers(conn);
+    if (http_request.method != "HEAD") conn->out += body;
+    conn->state = ConnState::WRITING;
+    conn->trace.status = 200;
 }
-void Server::create_logger()
+
+void Server::send_response(Connection *conn, const HttpRequest& http_request)
 {
-    pid_t pid = fork();
-    logger_worker = pid;
-    if (pid == -1) 
+    if (http_request.path.substr(0, http_request.path.find('?')) == METRICS_PATH) 
     {
-        perror("fork");
-        exit(1);
+        send_metrics(conn, http_request);
+        return;
     }
-    if (pid == 0)
+
+    // Range requests skip the cache, only the file path reads just the requested spans
+    std::string file_path;
+    if (normalize_path(http_request.path, file_path) && http_request.header("Range").empty() && send_cached(conn, file_path, http_request)) 
     {
-        FILE* log_file = fopen("server.log", "a");
-        if (!log_file) exit(EXIT_FAILURE);
-        
-        log_msg msg;
-        while (msgrcv(log_queue_id, &msg, sizeof(msg.text), 0, 0) > 0) {
-            fprintf(log_file, "%s\n", msg.text);
-            fflush(log_file);
-        }
-        fclose(log_file);
-        exit(0);
+        return;
     }
-    else
+
+    if (file_path.empty() || !send_response(conn, file_path, 200, &http_request)) 
     {
-        perror("fork");
+        log_ring.write({ "File not found: ", http_request.path });
+        if (!send_response(conn, FILE_NOT_FOUND_PATH, 404, &http_request)) 
+        {
+            throw std::runtime_error("Could not open file: " FILE_NOT_FOUND_PATH);
+        }
     }
 }
 
+// Appends the next chunk of the file body to out
+bool Server::fill_from_file(Connection *conn)
+{
+    size_t chunk = std::min(conn->file_remaining, (size_t)FILE_CHUNK_SIZE);
+    size_t start = conn->out.size();
+    conn->out.resize(start + chunk);
+    ssize_t got = pread(conn->file_fd, &conn->out[start], chunk, conn->file_offset);
+    if (got <= 0) 
+    {
+        // The file shrank under us, Content-Length can no longer be honoured
+        conn->out.resize(start);
+        close(conn->file_fd);
+        conn->file_fd = -1;
+        conn->file_remaining = 0;
+        return false;
+    }
+    conn->out.resize(start + got);
+    conn->file_offset += got;
+    conn->file_remaining -= got;
+    if (conn->file_remaining == 0 && conn->parts.empty()) 
+    {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+    return true;
+}
 
 
-void Server::run()
+// Every worker gets its own listening socket, the kernel spreads new connections between them
+void Server::listen_worker_socket(int worker_id)
 {
-    create_workers();
-    create_logger();
-
-    while ((new_socket = accept(server_fd, (struct sockaddr*)&address, &addrlen))) 
+    create_socket();
+    if (cpu_affinity) 
     {
-        for (int i = 0; i < MAX_WORKERS; i++) 
+        // Pin the worker and ask the kernel to prefer this socket for connections handled on the same CPU
+        int cpu = worker_id % sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) 
         {
-            if (workers[i] > 0) 
-            {
-                send_fd(worker_sockets[i][0], new_socket);
-                break;
-            }
+            perror("sched_setaffinity");
+        }
+        if (setsockopt(server_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) 
+        {
+            perror("setsockopt SO_INCOMING_CPU");
         }
+    }
+    bind_socket();
+    listen_socket();
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
 
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = server_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0) 
+    {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
     }
-    SSL_CTX_free(ctx);
 }
 
-Server::Server() : sslclass(), ctx(sslclass.create_context()), logger(&file_logger)
+void Server::worker_loop(int worker_id, int channel)
 {
+    signal(SIGPIPE, SIG_IGN);
 
-    sslclass = SSLclass();
-    sslclass.configure_context(ctx);
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) 
+    {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
 
-    mime_types = 
+    if (accept_mode == AcceptMode::REUSEPORT) 
     {
-        {".html", "text/html"},
-        {".css", "text/css"},
-        {".js", "application/javascript"},
-        {".png", "image/png"},
-        {".jpg", "image/jpeg"},
-        {".gif", "image/gif"},
-        {".svg", "image/svg+xml"},
-        {".ico", "image/x-icon"},
-    };
+        listen_worker_socket(worker_id);
+    }
 
-}
+    fcntl(channel, F_SETFL, fcntl(channel, F_GETFL) | O_NONBLOCK);
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = channel;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, channel, &ev) < 0) 
+    {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
 
+    if (!trace_path.empty()) 
+    {
+        trace_writer.open(trace_path);
+    }
+
+    timers.start(monotonic_ns() / 1000000);
+    struct epoll_event events[MAX_EVENTS];
+    while (1)
+    {
+        // Only wake up on the timer tick while some connection has a timeout running
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timers.size() ? TIMER_TICK_MS : -1);
+        if (ready < 0) 
+        {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
 
+        int deferred[MAX_EVENTS];
+        int deferred_count = 0;
 
+        for (int i = 0; i < ready; i++) 
+        {
+            int fd = events[i].data.fd;
+            if (fd == channel) 
+            {
+                accept_passed_fds(channel);
+                continue;
+            }
+            if (fd == server_fd) 
+            {
+                accept_connections();
+                continue;
+            }
+            auto it = connections.find(fd);
+            if (it == connections.end()) continue;
+            if (it->second->state == ConnState::HANDSHAKE) 
+            {
+                deferred[deferred_count++] = i;
+                continue;
+            }
+            handle_event(it->second, events[i].events);
+        }
 
+        // Handshakes run after the established connections and only up to a budget, so a burst of new
+        // clients cannot hold back requests in flight. Level triggering brings the rest back next pass
+        for (int i = 0; i < deferred_count && i < HANDSHAKES_PER_LOOP; i++) 
+        {
+            auto it = connections.find(events[deferred[i]].data.fd);
+            if (it != connections.end()) 
+            {
+                handle_event(it->second, events[deferred[i]].events);
+            }
+        }
+        if (timers.size()) 
+        {
+            expire_timers();
+        }
+        if (trace_writer.enabled()) 
+        {
+            trace_writer.flush(monotonic_ns() / 1000000, connections.empty());
+        }
 
+        if (draining && connections.empty()) 
+        {
+            exit(0);
+        }
+    }
+}
 
-void Server::send_fd(int socket, int fd) {
-    struct msghdr msg = {0};
-    struct cmsghdr *cmsg;
-    char buf[CMSG_SPACE(sizeof(fd))];
-    memset(buf, 0, sizeof(buf));
-    struct iovec io = { .iov_base = (void*)"", .iov_len = 1 };
+void Server::accept_passed_fds(int channel)
+{
+    while (1)
+    {
+        char command;
+        uint64_t accepted;
+        int fd = recv_fd(channel, &command, &accepted);
+        if (fd < 0) 
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EBADMSG) continue;
+            // Master retired us or is gone, nothing more will be passed to us
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, channel, NULL);
+            close(channel);
+            start_draining();
+            return;
+        }
 
-    msg.msg_iov = &io;
-    msg.msg_iovlen = 1;
-    msg.msg_control = buf;
-    msg.msg_controllen = sizeof(buf);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        add_connection(fd, command == 'S', accepted);
+    }
+}
 
-    cmsg = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
-    cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
-    *((int *) CMSG_DATA(cmsg)) = fd;
+// Finish the requests in progress, idle connections are closed right away
+void Server::start_draining()
+{
+    draining = true;
+    if (server_fd >= 0) 
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server_fd, NULL);
+        close(server_fd);
+        server_fd = -1;
+    }
 
-    sendmsg(socket, &msg, 0);
+    std::vector<Connection*> idle;
+    for (auto& entry : connections) 
+    {
+        if (entry.second->state == ConnState::READING && entry.second->in.empty()) 
+        {
+            idle.push_back(entry.second);
+        }
+    }
+    for (Connection *conn : idle) 
+    {
+        close_connection(conn);
+    }
 }
 
-int Server::recv_fd(int socket) {
-    struct msghdr msg = {0};
-    struct cmsghdr *cmsg;
-    char buf[CMSG_SPACE(sizeof(int))];
-    struct iovec io = { .iov_base = (void*)"", .iov_len = 1 };
+void Server::accept_connections()
+{
+    while (1)
+    {
+        int fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) 
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4");
+            return;
+        }
+        uint64_t accepted = monotonic_ns();
+        bool shed = scoreboard.load(worker_index) >= WORKER_CONNECTIONS;
+        scoreboard.slot(worker_index).connections.fetch_add(1, std::memory_order_relaxed);
+        add_connection(fd, shed, accepted);
+    }
+}
 
-    msg.msg_iov = &io;
-    msg.msg_iovlen = 1;
-    msg.msg_control = buf;
-    msg.msg_controllen = sizeof(buf);
+void Server::add_connection(int fd, bool shed, uint64_t accepted)
+{
+    WorkerSlot &slot = scoreboard.slot(worker_index);
+    SSL *ssl = sslclass.create_ssl(ctx, fd);
+    if (!ssl) 
+    {
+        slot.connections.fetch_sub(1, std::memory_order_relaxed);
+        return;
+    }
 
-    if (recvmsg(socket, &msg, 0) < 0) {
-        return -1;
+    Connection *conn = new Connection(fd, ssl);
+    conn->handshake_start = monotonic_ns();
+    conn->trace.accepted = accepted;
+    conn->trace.added = conn->handshake_start;
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) 
+    {
+        perror("epoll_ctl");
+        SSL_free(ssl);
+        close(fd);
+        delete conn;
+        slot.connections.fetch_sub(1, std::memory_order_relaxed);
+        return;
     }
+    conn->events = EPOLLIN;
+    conn->shed = shed;
+    connections[fd] = conn;
+    // The ClientHello is usually already queued, the loop picks it up within the handshake budget
+    update_timer(conn);
+}
 
-    cmsg = CMSG_FIRSTHDR(&msg);
+void Server::queue_shed_response(Connection *conn)
+{
+    WorkerSlot &slot = scoreboard.slot(worker_index);
+    slot.shed.fetch_add(1, std::memory_order_relaxed);
+    slot.inflight.fetch_add(1, std::memory_order_relaxed);
+    conn->out = shed_response;
+    conn->state = ConnState::WRITING;
+    conn->close_after_write = true;
+    conn->trace.status = 503;
+}
+
+void Server::handle_event(Connection *conn, uint32_t events)
+{
+    if (events & EPOLLERR) 
+    {
+        close_connection(conn);
+        return;
+    }
+
+    int fd = conn->fd;
+    bool serving = conn->state != ConnState::HANDSHAKE;
+    uint64_t start = serving ? monotonic_ns() : 0;
+    switch (conn->state)
+    {
+    case ConnState::HANDSHAKE:
+        do_handshake(conn);
+        break;
+    case ConnState::READING:
+        do_read(conn);
+        break;
+    case ConnState::WRITING:
+        if (do_write(conn) && process_requests(conn) && conn->state == ConnState::READING && SSL_has_pending(conn->ssl)) 
+        {
+            // Pipelined records decrypted while we were writing will not raise EPOLLIN again
+            do_read(conn);
+        }
+        break;
+    case ConnState::CLOSING:
+        close_connection(conn);
+        return;
+    }
+
+    if (serving) 
+    {
+        scoreboard.slot(worker_index).serve_ns.fetch_add(monotonic_ns() - start, std::memory_order_relaxed);
+    }
+    auto it = connections.find(fd);
+    if (it != connections.end()) 
+    {
+        update_timer(it->second);
+    }
+}
+
+bool Server::do_handshake(Connection *conn)
+{
+    uint64_t start = monotonic_ns();
+    int ret = SSL_do_handshake(conn->ssl);
+    uint64_t now = monotonic_ns();
+    conn->handshake_cpu += now - start;
+    if (ret == 1) 
+    {
+        conn->want_write = false;
+        conn->trace.handshake_done = now;
+        WorkerSlot &slot = scoreboard.slot(worker_index);
+        slot.handshakes.fetch_add(1, std::memory_order_relaxed);
+        slot.handshake_ns.fetch_add(now - conn->handshake_start, std::memory_order_relaxed);
+        slot.handshake_cpu_ns.fetch_add(conn->handshake_cpu, std::memory_order_relaxed);
+        session_cache.record_handshake(SSL_session_reused(conn->ssl), now - conn->handshake_start);
+        metrics.slot(worker_index).handshake_latency.record((now - conn->handshake_start) / 1000);
+        conn->ktls = BIO_get_ktls_send(SSL_get_wbio(conn->ssl)) > 0;
+        static bool reported = false;
+        if (!reported) 
+        {
+            log_ring.write({ "kTLS send offload ", conn->ktls ? "enabled" : "unavailable, using buffered writes" });
+            reported = true;
+        }
+        if (conn->shed) 
+        {
+            queue_shed_response(conn);
+            do_write(conn);
+            return false;
+        }
+        conn->state = ConnState::READING;
+        // The first request often arrives with the Finished message, its cost belongs to serving
+        bool alive = do_read(conn);
+        slot.serve_ns.fetch_add(monotonic_ns() - now, std::memory_order_relaxed);
+        return alive;
+    }
+
+    int err = SSL_get_error(conn->ssl, ret);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) 
+    {
+        conn->want_write = (err == SSL_ERROR_WANT_WRITE);
+        update_events(conn);
+        return true;
+    }
+
+    fprintf(stderr, "SSL handshake failed.\n");
+    ERR_print_errors_fp(stderr);
+    metrics.slot(worker_index).handshake_failures.fetch_add(1, std::memory_order_relaxed);
+    close_connection(conn);
+    return false;
+}
+
+bool Server::do_read(Connection *conn)
+{
+    uint64_t start = monotonic_ns();
+    while (1)
+    {
+        // Decrypt straight into the tail of the connection buffer
+        size_t used = conn->in.size();
+        conn->in.resize(used + READ_BUFFER_SIZE);
+        int bytes_read = SSL_read(conn->ssl, &conn->in[used], READ_BUFFER_SIZE);
+        conn->in.resize(used + (bytes_read > 0 ? bytes_read : 0));
+        if (bytes_read > 0) 
+        {
+            if (conn->in.size() > MAX_REQUEST_SIZE) 
+            {
+                // Complete requests and dropped body bytes may free the buffer before we give up on it
+                if (!process_requests(conn)) return false;
+                if (conn->state != ConnState::READING) return true;
+                if (conn->in.size() > MAX_REQUEST_SIZE) 
+                {
+                    close_connection(conn);
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        int err = SSL_get_error(conn->ssl, bytes_read);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) 
+        {
+            conn->want_write = (err == SSL_ERROR_WANT_WRITE);
+            if (!conn->in.empty()) 
+            {
+                if (!conn->trace.first_byte) conn->trace.first_byte = start;
+                conn->trace.read_ns += monotonic_ns() - start;
+            }
+            break;
+        }
+        // SSL_ERROR_ZERO_RETURN on clean shutdown, anything else is a broken connection
+        close_connection(conn);
+        return false;
+    }
+
+    if (!process_requests(conn)) return false;
+    update_events(conn);
+    return true;
+}
+
+bool Server::do_write(Connection *conn)
+{
+    while (1)
+    {
+        if (conn->out_offset == conn->out.size() && conn->file_remaining == 0 && !conn->parts.empty()) 
+        {
+            conn->out.clear();
+            conn->out_offset = 0;
+            start_next_part(conn);
+            if (!conn->ktls && conn->file_remaining > 0 && !fill_from_file(conn)) 
+            {
+                close_connection(conn);
+                return false;
+            }
+        }
+        if (conn->out_offset == conn->out.size() && conn->file_remaining > 0) 
+        {
+            if (conn->ktls) 
+            {
+                // File pages go straight from the page cache into kernel TLS records
+                ossl_ssize_t sent = SSL_sendfile(conn->ssl, conn->file_fd, conn->file_offset, conn->file_remaining, 0);
+                if (sent > 0) 
+                {
+                    conn->trace.bytes += sent;
+                    conn->file_offset += sent;
+                    conn->file_remaining -= sent;
+                    if (conn->file_remaining == 0 && conn->parts.empty()) 
+                    {
+                        close(conn->file_fd);
+                        conn->file_fd = -1;
+                    }
+                    continue;
+                }
+                int err = SSL_get_error(conn->ssl, sent);
+                if (err == SSL_ERROR_WANT_WRITE) 
+                {
+                    conn->want_write = true;
+                    update_events(conn);
+                    return false;
+                }
+                close_connection(conn);
+                return false;
+            }
+
+            conn->out.clear();
+            conn->out_offset = 0;
+            if (!fill_from_file(conn)) 
+            {
+                close_connection(conn);
+                return false;
+            }
+        }
+        if (conn->out_offset == conn->out.size()) break;
+
+        int written = SSL_write(conn->ssl, conn->out.data() + conn->out_offset, conn->out.size() - conn->out_offset);
+        if (written > 0) 
+        {
+            conn->trace.bytes += written;
+            conn->out_offset += written;
+            continue;
+        }
+
+        int err = SSL_get_error(conn->ssl, written);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) 
+        {
+            conn->want_write = (err == SSL_ERROR_WANT_WRITE);
+            update_events(conn);
+            return false;
+        }
+        close_connection(conn);
+        return false;
+    }
+
+    conn->out.clear();
+    conn->out_offset = 0;
+    conn->want_write = false;
+    conn->state = ConnState::READING;
+
+    WorkerSlot &slot = scoreboard.slot(worker_index);
+    slot.inflight.fetch_sub(1, std::memory_order_relaxed);
+    uint64_t now = monotonic_ns();
+    finish_trace(conn, now);
+    if (conn->request_start) 
+    {
+        // Moving average with weight 1/8, only this worker writes its slot
+        int64_t sample = (now - conn->request_start) / 1000;
+        int64_t average = slot.latency_us.load(std::memory_order_relaxed);
+        slot.latency_us.store(average + (sample - average) / 8, std::memory_order_relaxed);
+        conn->request_start = 0;
+    }
+
+    if (conn->close_after_write || draining) 
+    {
+        close_connection(conn);
+        return false;
+    }
+    update_events(conn);
+    return true;
+}
+
+// Serves every complete request sitting in the input buffer, stops while a response is still being written
+bool Server::process_requests(Connection *conn)
+{
+    while (1)
+    {
+        if (conn->body_remaining > 0) 
+        {
+            // No handler uses request bodies, drop them as they arrive so the next request lines up
+            size_t drop = std::min(conn->body_remaining, conn->in.size());
+            conn->in.erase(0, drop);
+            conn->body_remaining -= drop;
+            if (conn->body_remaining > 0) break;
+        }
+        if (conn->state != ConnState::READING || conn->in.empty()) break;
+
+        HttpRequest http_request;
+        uint64_t parse_start = monotonic_ns();
+        ParseStatus status = conn->parser.parse(conn->in.data(), conn->in.size(), http_request);
+        uint64_t parsed = monotonic_ns();
+        conn->trace.parse_ns += parsed - parse_start;
+        if (status == ParseStatus::INCOMPLETE) break;
+
+        WorkerSlot &slot = scoreboard.slot(worker_index);
+        slot.inflight.fetch_add(1, std::memory_order_relaxed);
+        slot.requests.fetch_add(1, std::memory_order_relaxed);
+        conn->request_start = parsed;
+        conn->head_start = 0;
+        conn->trace.parsed = parsed;
+        if (!conn->trace.first_byte) conn->trace.first_byte = parse_start;
+        conn->trace.method.assign(http_request.method);
+        conn->trace.path.assign(http_request.path);
+        if (status == ParseStatus::ERROR || conn->parser.body_length() > MAX_BODY_SIZE) 
+        {
+            send_error(conn, status == ParseStatus::ERROR ? conn->parser.error_status() : 413);
+            conn->in.clear();
+        }
+        else 
+        {
+            conn->requests++;
+            if (!http_request.keep_alive() || conn->requests >= KEEPALIVE_REQUESTS || draining) 
+            {
+                conn->close_after_write = true;
+            }
+            // The views in http_request point into conn->in, consume it only after the response is built
+            send_response(conn, http_request);
+            conn->in.erase(0, conn->parser.consumed());
+            conn->body_remaining = conn->parser.body_length();
+        }
+        conn->parser.reset();
+        conn->trace.handled = monotonic_ns();
+
+        int fd = conn->fd;
+        if (!do_write(conn)) 
+        {
+            // Either still waiting for the socket or the connection was closed
+            return connections.count(fd) > 0;
+        }
+    }
+    return true;
+}
+
+// Arms the timeout for whatever the connection waits for, none while a response is being written
+void Server::update_timer(Connection *conn)
+{
+    if (conn->state == ConnState::HANDSHAKE) 
+    {
+        timers.schedule(&conn->timer, conn->handshake_start / 1000000 + HANDSHAKE_TIMEOUT_MS);
+        return;
+    }
+    if (conn->state != ConnState::READING) 
+    {
+        timers.cancel(&conn->timer);
+        return;
+    }
+
+    uint64_t now = monotonic_ns() / 1000000;
+    if (conn->body_remaining > 0) 
+    {
+        timers.schedule(&conn->timer, now + BODY_TIMEOUT_MS);
+    }
+    else if (!conn->in.empty()) 
+    {
+        // Counted from the first byte and not pushed back by later ones, so trickling headers does not help
+        if (!conn->head_start) conn->head_start = now;
+        timers.schedule(&conn->timer, conn->head_start + HEADER_TIMEOUT_MS);
+    }
+    else 
+    {
+        timers.schedule(&conn->timer, now + KEEPALIVE_TIMEOUT_MS);
+    }
+}
+
+void Server::expire_timers()
+{
+    std::vector<void*> expired;
+    timers.advance(monotonic_ns() / 1000000, expired);
+    for (void *owner : expired) 
+    {
+        Connection *conn = (Connection*)owner;
+        if (conn->state == ConnState::READING && conn->body_remaining == 0 && !conn->in.empty()) 
+        {
+            // Request head still incomplete, tell the client why before hanging up
+            scoreboard.slot(worker_index).inflight.fetch_add(1, std::memory_order_relaxed);
+            conn->in.clear();
+            send_error(conn, 408);
+            conn->trace.handled = monotonic_ns();
+            do_write(conn);
+        }
+        else 
+        {
+            if (conn->state == ConnState::HANDSHAKE) 
+            {
+                metrics.slot(worker_index).handshake_failures.fetch_add(1, std::memory_order_relaxed);
+            }
+            close_connection(conn);
+        }
+    }
+}
+
+void Server::update_events(Connection *conn)
+{
+    uint32_t wanted = conn->want_write ? EPOLLOUT : EPOLLIN;
+    if (wanted == conn->events) return;
+
+    struct epoll_event ev = {};
+    ev.events = wanted;
+    ev.data.fd = conn->fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    conn->events = wanted;
+}
+
+void Server::close_connection(Connection *conn)
+{
+    timers.cancel(&conn->timer);
+    WorkerSlot &slot = scoreboard.slot(worker_index);
+    if (conn->state == ConnState::WRITING) 
+    {
+        slot.inflight.fetch_sub(1, std::memory_order_relaxed);
+    }
+    if (conn->file_fd >= 0) 
+    {
+        close(conn->file_fd);
+    }
+    slot.connections.fetch_sub(1, std::memory_order_relaxed);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    SSL_shutdown(conn->ssl);
+    SSL_free(conn->ssl);
+    close(conn->fd);
+    connections.erase(conn->fd);
+    delete conn;
+}
+
+// Average cost of a handshake and of a request over the last report interval, skipped when idle
+void Server::report_phases()
+{
+    uint64_t totals[4] = {};
+    uint64_t requests = 0;
+    for (int i = 0; i < MAX_WORKERS; i++) 
+    {
+        if (workers[i] <= 0) continue;
+        WorkerSlot &slot = scoreboard.slot(i);
+        totals[0] += slot.handshakes.load(std::memory_order_relaxed);
+        totals[1] += slot.handshake_ns.load(std::memory_order_relaxed);
+        totals[2] += slot.handshake_cpu_ns.load(std::memory_order_relaxed);
+        totals[3] += slot.serve_ns.load(std::memory_order_relaxed);
+        requests += slot.requests.load(std::memory_order_relaxed);
+    }
+
+    // A retired or respawned worker takes its counters with it, start over from the new totals
+    uint64_t delta[4];
+    bool valid = requests >= reported_requests;
+    for (int i = 0; i < 4; i++) 
+    {
+        if (totals[i] < reported_phases[i]) valid = false;
+        delta[i] = totals[i] - reported_phases[i];
+        reported_phases[i] = totals[i];
+    }
+    uint64_t served = requests - reported_requests;
+    reported_requests = requests;
+    if (!valid || (delta[0] == 0 && served == 0)) return;
+
+    char line[160];
+    snprintf(line, sizeof(line), "Phases: %lu handshakes %.2f ms wall %.2f ms cpu, %lu requests %.3f ms cpu",
+             (unsigned long)delta[0], delta[0] ? delta[1] / 1e6 / delta[0] : 0.0, delta[0] ? delta[2] / 1e6 / delta[0] : 0.0,
+             (unsigned long)served, served ? delta[3] / 1e6 / served : 0.0);
+    log_ring.write(line);
+}
+
+// Access log line for the response just written, and its events in the trace file when enabled
+void Server::finish_trace(Connection *conn, uint64_t now)
+{
+    RequestTrace &trace = conn->trace;
+    trace.written = now;
+    WorkerMetrics &counters = metrics.slot(worker_index);
+    counters.record_response(trace.status, trace.bytes);
+    if (trace.first_byte) 
+    {
+        counters.request_latency.record((now - trace.first_byte) / 1000);
+    }
+    char phases[256];
+    size_t length = format_access_log(phases, sizeof(phases), trace);
+    log_ring.write({ "method=", trace.method.empty() ? "-" : trace.method, " path=",
+                     trace.path.empty() ? "-" : trace.path, std::string_view(phases, length) });
+    if (trace_writer.enabled()) 
+    {
+        trace_writer.add(trace, conn->fd);
+    }
+
+    trace.next();
+    // A pipelined request is already waiting in the buffer
+    if (!conn->in.empty()) trace.first_byte = now;
+}
+
+void Server::create_workers()
+{
+    for (int i = 0; i < min_workers; i++) 
+    {
+        spawn_worker(i);
+    }
+}
+
+int Server::spawn_worker(int index)
+{
+    // SEQPACKET keeps one passed fd per message
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, worker_sockets[index]) < 0) 
+    {
+        perror("socketpair failed");
+        return -1;
+    }
+    // A worker that stops reading fills its queue, the master must not block on it
+    fcntl(worker_sockets[index][0], F_SETFL, fcntl(worker_sockets[index][0], F_GETFL) | O_NONBLOCK);
+
+    pid_t pid = fork();
+    if (pid == -1) 
+    {
+        perror("fork");
+        close(worker_sockets[index][0]);
+        close(worker_sockets[index][1]);
+        worker_sockets[index][0] = worker_sockets[index][1] = -1;
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        // Only the master may hold the other workers' channels, otherwise they never see EOF
+        for (int j = 0; j < MAX_WORKERS; j++) 
+        {
+            if (worker_sockets[j][0] >= 0) close(worker_sockets[j][0]);
+        }
+        for (Connection *conn : master_shed) 
+        {
+            close(conn->fd);
+        }
+        master_shed.clear();
+        close(server_fd);
+        server_fd = -1;
+        worker_index = index;
+        worker_loop(index, worker_sockets[index][1]);
+        exit(0);
+    }
+
+    printf("Worker PID: %d\n", pid);
+    log_ring.write({ "Worker ", std::to_string(index), " started, PID ", std::to_string(pid) });
+    workers[index] = pid;
+    scoreboard.slot(index).pid.store(pid, std::memory_order_relaxed);
+    close(worker_sockets[index][1]);
+    worker_sockets[index][1] = -1;
+    return pid;
+}
+
+// Closing the channel makes the worker drain and exit, its slot is freed once it is reaped
+void Server::retire_worker(int index)
+{
+    printf("Retiring worker PID: %d\n", workers[index]);
+    log_ring.write({ "Worker ", std::to_string(index), " retired, PID ", std::to_string(workers[index]) });
+    close(worker_sockets[index][0]);
+    worker_sockets[index][0] = -1;
+    workers[index] = 0;
+}
+
+void Server::reap_workers()
+{
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) 
+    {
+        if (pid == precompress_pid) 
+        {
+            finish_precompress();
+            continue;
+        }
+        file_cache.reclaim(pid);
+        for (int i = 0; i < MAX_WORKERS; i++) 
+        {
+            if (scoreboard.slot(i).pid.load(std::memory_order_relaxed) != pid) continue;
+
+            if (workers[i] == pid) 
+            {
+                fprintf(stderr, "Worker PID %d exited unexpectedly\n", pid);
+                log_ring.write({ "Worker ", std::to_string(i), " exited unexpectedly, PID ", std::to_string(pid),
+                                 ", status ", std::to_string(status) });
+                close(worker_sockets[i][0]);
+                worker_sockets[i][0] = -1;
+                workers[i] = 0;
+            }
+            scoreboard.reset(i);
+        }
+    }
+}
+
+int Server::free_worker_slot()
+{
+    for (int i = 0; i < MAX_WORKERS; i++) 
+    {
+        // A retired worker keeps its slot until it has been reaped
+        if (workers[i] == 0 && scoreboard.slot(i).pid.load(std::memory_order_relaxed) == 0) return i;
+    }
+    return -1;
+}
+
+void Server::scale_workers()
+{
+    int alive = 0;
+    uint64_t total_load = 0;
+    uint32_t latency = 0;
+    for (int i = 0; i < MAX_WORKERS; i++) 
+    {
+        if (workers[i] <= 0) continue;
+        alive++;
+        uint32_t load = scoreboard.load(i);
+        total_load += load;
+        // An idle worker's average is stale, it only matters while requests are coming in
+        if (load > 0) latency = std::max(latency, scoreboard.slot(i).latency_us.load(std::memory_order_relaxed));
+    }
+
+    if (alive < min_workers) 
+    {
+        for (int i = alive; i < min_workers; i++) 
+        {
+            int slot = free_worker_slot();
+            if (slot < 0 || spawn_worker(slot) < 0) break;
+        }
+        quiet_ticks = 0;
+        return;
+    }
+
+    uint64_t average = total_load / alive;
+    if (alive < max_workers && (average >= GROW_LOAD || latency >= GROW_LATENCY_US)) 
+    {
+        int slot = free_worker_slot();
+        if (slot >= 0) spawn_worker(slot);
+        quiet_ticks = 0;
+        return;
+    }
+
+    // Retiring a reuseport worker would reset the connections queued on its socket
+    if (accept_mode == AcceptMode::MASTER && alive > min_workers && average < SHRINK_LOAD) 
+    {
+        if (++quiet_ticks >= SHRINK_TICKS) 
+        {
+            retire_worker(least_loaded_worker());
+            quiet_ticks = 0;
+        }
+        return;
+    }
+    quiet_ticks = 0;
+}
+
+// Workers and the master append to the shared ring, this process is the only one touching the log files
+void Server::create_logger()
+{
+    if (!log_ring.create(LOG_RING_BYTES)) 
+    {
+        exit(EXIT_FAILURE);
+    }
+    pid_t pid = fork();
+    logger_worker = pid;
+    if (pid == -1) 
+    {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0)
+    {
+        // Ctrl-C reaches the whole process group, the logger stops once the master is gone and the
+        // rest is written. A full file logger holds the drain up, the ring buffers and counts meanwhile
+        signal(SIGINT, SIG_IGN);
+        signal(SIGTERM, SIG_IGN);
+        {
+            AsyncFileLogger sink(LOG_DIRECTORY, LOG_ROTATE_BYTES, LOG_ROTATE_SECONDS, LogOverflow::Block);
+            log_ring.consume(sink);
+        }
+        exit(0);
+    }
+}
+
+
+
+void Server::run()
+{
+    signal(SIGPIPE, SIG_IGN);
+    if (accept_mode == AcceptMode::REUSEPORT) 
+    {
+        // Workers bind their own sockets, keeping this one would make it part of the reuseport group
+        close(server_fd);
+        server_fd = -1;
+    }
+    else 
+    {
+        fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+    }
+    scoreboard.create(MAX_WORKERS);
+    metrics.create(MAX_WORKERS);
+    if (!trace_path.empty() && !TraceWriter::create(trace_path)) 
+    {
+        trace_path.clear();
+    }
+    if (!session_cache.create(ctx, session_entries, TICKET_KEY_LIFETIME_S)) 
+    {
+        fprintf(stderr, "Session resumption limited to the worker that issued the session\n");
+    }
+    precompress_directory("www");
+    if (file_cache.create(cache_bytes)) 
+    {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0) 
+        {
+            perror("inotify_init1");
+            exit(EXIT_FAILURE);
+        }
+        watch_directory("www");
+    }
+    create_logger();
+    create_workers();
+
+    // In reuseport mode server_fd is -1 and poll only waits for file changes and the next scaling tick
+    std::vector<struct pollfd> fds(2);
+    fds[0].fd = server_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = inotify_fd;
+    fds[1].events = POLLIN;
+    uint64_t next_tick = monotonic_ns() + SCALE_INTERVAL_MS * 1000000ULL;
+    uint64_t next_rotation = monotonic_ns() + TICKET_KEY_LIFETIME_S * 1000000000ULL;
+    uint64_t next_report = monotonic_ns() + TLS_REPORT_INTERVAL_MS * 1000000ULL;
+    while (1) 
+    {
+        uint64_t now = monotonic_ns();
+        int timeout = now >= next_tick ? 0 : (next_tick - now) / 1000000 + 1;
+        // Connections the master sheds itself are polled along, and checked for their timeout every tick
+        fds.resize(2);
+        for (Connection *conn : master_shed) 
+        {
+            fds.push_back({ conn->fd, (short)(conn->want_write ? POLLOUT : POLLIN), 0 });
+        }
+        if (!master_shed.empty()) timeout = std::min(timeout, TIMER_TICK_MS);
+        if (poll(fds.data(), fds.size(), timeout) > 0) 
+        {
+            if (fds[1].revents & POLLIN) handle_file_changes();
+            if (fds[0].revents & POLLIN) accept_and_dispatch();
+        }
+        if (!master_shed.empty()) drive_master_shed();
+
+        if (monotonic_ns() >= next_tick) 
+        {
+            reap_workers();
+            scale_workers();
+            next_tick = monotonic_ns() + SCALE_INTERVAL_MS * 1000000ULL;
+
+            if (next_tick >= next_rotation) 
+            {
+                session_cache.rotate_keys();
+                next_rotation += TICKET_KEY_LIFETIME_S * 1000000000ULL;
+            }
+            if (next_tick >= next_report) 
+            {
+                std::string tls_report = session_cache.report();
+                if (!tls_report.empty()) log_ring.write(tls_report);
+                report_phases();
+                next_report += TLS_REPORT_INTERVAL_MS * 1000000ULL;
+            }
+        }
+    }
+    SSL_CTX_free(ctx);
+}
+
+void Server::watch_directory(const std::string& dir)
+{
+    uint32_t mask = IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE |
+                    IN_DELETE_SELF | IN_MOVE_SELF;
+    int wd = inotify_add_watch(inotify_fd, dir.c_str(), mask);
+    if (wd < 0) 
+    {
+        perror("inotify_add_watch");
+        return;
+    }
+    watched_dirs[wd] = dir;
+
+    DIR *handle = opendir(dir.c_str());
+    if (!handle) return;
+    struct dirent *item;
+    while ((item = readdir(handle)) != NULL) 
+    {
+        std::string name = item->d_name;
+        if (name == "." || name == "..") continue;
+        std::string child = dir + "/" + name;
+        struct stat st;
+        if (stat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) watch_directory(child);
+    }
+    closedir(handle);
+}
+
+void Server::handle_file_changes()
+{
+    alignas(struct inotify_event) char buffer[16384];
+    while (1) 
+    {
+        ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0) return;
+
+        for (char *ptr = buffer; ptr < buffer + length; ) 
+        {
+            struct inotify_event *event = (struct inotify_event*)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) 
+            {
+                file_cache.invalidate_all();
+                continue;
+            }
+            auto dir = watched_dirs.find(event->wd);
+            if (dir == watched_dirs.end()) continue;
+
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) 
+            {
+                file_cache.invalidate_prefix(dir->second + "/");
+                if (event->mask & IN_IGNORED) watched_dirs.erase(dir);
+                continue;
+            }
+            if (event->len == 0) continue;
+
+            std::string path = dir->second + "/" + event->name;
+            if (event->mask & IN_ISDIR) 
+            {
+                file_cache.invalidate_prefix(path + "/");
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) watch_directory(path);
+            }
+            else 
+            {
+                file_cache.invalidate(path);
+                uint32_t changed = IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM;
+                if ((event->mask & changed) && precompress_candidate(path)) precompress_queue.insert(path);
+            }
+        }
+        start_precompress();
+    }
+}
+
+// Only files with a text type of their own, others would fall back to text/html
+bool Server::precompress_candidate(const std::string& path)
+{
+    size_t dot = path.find_last_of("./");
+    if (dot == std::string::npos || path[dot] != '.') return false;
+    auto type = mime_types.find(path.substr(dot));
+    return type != mime_types.end() && precompressible(type->second);
+}
+
+// Maximum compression takes a while, so a child does it while the master keeps accepting. Only one runs
+// at a time, a file written again meanwhile waits for the next batch
+void Server::start_precompress()
+{
+    if (precompress_pid > 0 || precompress_queue.empty()) return;
+
+    precompress_batch.assign(precompress_queue.begin(), precompress_queue.end());
+    precompress_queue.clear();
+    pid_t pid = fork();
+    if (pid == 0) 
+    {
+        for (const std::string& path : precompress_batch) precompress_file(path);
+        _exit(0);
+    }
+    if (pid < 0) 
+    {
+        perror("fork precompress");
+        precompress_queue.insert(precompress_batch.begin(), precompress_batch.end());
+        precompress_batch.clear();
+        return;
+    }
+    precompress_pid = pid;
+}
+
+// The variants live outside www, so no event reports them. The originals' entries list the variants
+// they saw and are dropped with them
+void Server::finish_precompress()
+{
+    for (const std::string& path : precompress_batch) 
+    {
+        file_cache.invalidate(path);
+        for (int i = 0; i < ENCODING_COUNT; i++) file_cache.invalidate(path + content_encodings[i].suffix);
+    }
+    precompress_batch.clear();
+    precompress_pid = 0;
+    start_precompress();
+}
+
+void Server::precompress_directory(const std::string& dir)
+{
+    DIR *handle = opendir(dir.c_str());
+    if (!handle) return;
+    struct dirent *item;
+    while ((item = readdir(handle)) != NULL) 
+    {
+        std::string name = item->d_name;
+        if (name == "." || name == "..") continue;
+        std::string child = dir + "/" + name;
+        struct stat st;
+        if (stat(child.c_str(), &st) < 0) continue;
+        if (S_ISDIR(st.st_mode)) precompress_directory(child);
+        else if (precompress_candidate(child)) precompress_file(child);
+    }
+    closedir(handle);
+}
+
+void Server::accept_and_dispatch()
+{
+    while (1) 
+    {
+        // The worker is chosen, and the pool grown, before accepting so that a forked worker never
+        // inherits a client descriptor and keeps that connection open after its own worker closed it
+        int worker = pick_worker();
+        if (worker >= 0 && scoreboard.load(worker) >= WORKER_CONNECTIONS) 
+        {
+            worker = least_loaded_worker();
+        }
+        if (worker >= 0 && scoreboard.load(worker) >= WORKER_CONNECTIONS) 
+        {
+            // Every worker is full: grow right away instead of waiting for the next tick,
+            // once the pool is at its maximum the connection only gets the 503 page
+            int alive = 0;
+            for (int i = 0; i < MAX_WORKERS; i++) 
+            {
+                if (workers[i] > 0) alive++;
+            }
+            int slot = alive < max_workers ? free_worker_slot() : -1;
+            if (slot >= 0 && spawn_worker(slot) > 0) worker = slot;
+        }
+
+        new_socket = accept4(server_fd, (struct sockaddr*)&address, &addrlen, SOCK_CLOEXEC);
+        if (new_socket < 0) 
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        uint64_t accepted = monotonic_ns();
+
+        // A worker with a full channel or a dead one passes the connection on to any other worker as a 503,
+        // without any the master sends the page itself
+        bool passed = worker >= 0 &&
+                      pass_connection(worker, scoreboard.load(worker) >= WORKER_CONNECTIONS ? 'S' : 'C', accepted);
+        for (int i = 0; i < MAX_WORKERS && !passed; i++) 
+        {
+            if (workers[i] > 0 && i != worker) passed = pass_connection(i, 'S', accepted);
+        }
+        // The worker holds its own copy of the descriptor now
+        if (passed) close(new_socket);
+        else shed_in_master(new_socket);
+        new_socket = -1;
+    }
+}
+
+bool Server::pass_connection(int index, char command, uint64_t accepted)
+{
+    // Counted here rather than in the worker so a burst of accepts sees the fds already queued
+    scoreboard.slot(index).connections.fetch_add(1, std::memory_order_relaxed);
+    if (send_fd(worker_sockets[index][0], new_socket, command, accepted) >= 0) return true;
+    scoreboard.slot(index).connections.fetch_sub(1, std::memory_order_relaxed);
+    if (errno != EAGAIN && errno != EWOULDBLOCK) reap_workers();
+    return false;
+}
+
+// Takes the descriptor over, beyond MASTER_SHED_MAX pending ones it is only closed
+void Server::shed_in_master(int fd)
+{
+    if (master_shed.size() >= MASTER_SHED_MAX) 
+    {
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    SSL *ssl = sslclass.create_ssl(ctx, fd);
+    if (!ssl) return;
+    Connection *conn = new Connection(fd, ssl);
+    conn->handshake_start = monotonic_ns();
+    conn->out = shed_response;
+    conn->close_after_write = true;
+    master_shed.push_back(conn);
+    drive_master_shed();
+}
+
+// Handshake and 503 page for the connections in master_shed, as far as they go without blocking
+void Server::drive_master_shed()
+{
+    uint64_t now = monotonic_ns();
+    for (size_t i = 0; i < master_shed.size();) 
+    {
+        Connection *conn = master_shed[i];
+        bool done = now - conn->handshake_start >= MASTER_SHED_TIMEOUT_MS * 1000000ULL;
+        while (!done) 
+        {
+            int ret = conn->state == ConnState::HANDSHAKE
+                      ? SSL_do_handshake(conn->ssl)
+                      : SSL_write(conn->ssl, conn->out.data() + conn->out_offset, conn->out.size() - conn->out_offset);
+            if (ret <= 0) 
+            {
+                int err = SSL_get_error(conn->ssl, ret);
+                conn->want_write = err == SSL_ERROR_WANT_WRITE;
+                done = err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE;
+                break;
+            }
+            if (conn->state == ConnState::HANDSHAKE) conn->state = ConnState::WRITING;
+            else conn->out_offset += ret;
+            done = conn->out_offset == conn->out.size();
+        }
+        if (!done) 
+        {
+            i++;
+            continue;
+        }
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+        close(conn->fd);
+        delete conn;
+        master_shed[i] = master_shed.back();
+        master_shed.pop_back();
+    }
+}
+
+int Server::pick_worker()
+{
+    int alive[MAX_WORKERS];
+    int alive_count = 0;
+    for (int i = 0; i < MAX_WORKERS; i++) 
+    {
+        if (workers[i] > 0) alive[alive_count++] = i;
+    }
+    if (alive_count == 0) return -1;
+
+    if (route_policy == RoutePolicy::TWO_CHOICES && alive_count > 2) 
+    {
+        // xorshift32, good enough to sample two distinct workers
+        route_seed ^= route_seed << 13;
+        route_seed ^= route_seed >> 17;
+        route_seed ^= route_seed << 5;
+        int first_index = route_seed % alive_count;
+        int second_index = (first_index + 1 + (route_seed / alive_count) % (alive_count - 1)) % alive_count;
+        int first = alive[first_index];
+        int second = alive[second_index];
+        return scoreboard.load(first) <= scoreboard.load(second) ? first : second;
+    }
+
+    return least_loaded_worker();
+}
+
+int Server::least_loaded_worker()
+{
+    int best = -1;
+    for (int i = 0; i < MAX_WORKERS; i++) 
+    {
+        if (workers[i] <= 0) continue;
+        if (best < 0 || scoreboard.load(i) < scoreboard.load(best)) best = i;
+    }
+    return best;
+}
+
+Server::Server() : sslclass(), ctx(sslclass.create_context())
+{
+
+    sslclass = SSLclass();
+    sslclass.configure_context(ctx);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(PORT);
+
+    Response unavailable;
+    unavailable.setStatusCode(503);
+    unavailable.addHeader("Retry-After", "1");
+    unavailable.addHeader("Connection", "close");
+    shed_response = unavailable.buildResponse(unavailable.loadFile(SERVICE_UNAVAILABLE), "text/html");
+
+    workers.assign(MAX_WORKERS, 0);
+    for (int i = 0; i < MAX_WORKERS; i++) 
+    {
+        worker_sockets[i][0] = worker_sockets[i][1] = -1;
+    }
+
+    mime_types = 
+    {
+        {".html", "text/html"},
+        {".css", "text/css"},
+        {".js", "application/javascript"},
+        {".png", "image/png"},
+        {".jpg", "image/jpeg"},
+        {".gif", "image/gif"},
+        {".svg", "image/svg+xml"},
+        {".ico", "image/x-icon"},
+    };
+
+    // Pages are revalidated on every use, which costs a 304. Assets may be reused for a while without asking
+    cache_policies = 
+    {
+        {"", CACHE_CONTROL_DEFAULT},
+        {"text/html", CACHE_CONTROL_DEFAULT},
+        {"text/css", CACHE_CONTROL_ASSETS},
+        {"application/javascript", CACHE_CONTROL_ASSETS},
+        {"image/", CACHE_CONTROL_IMAGES},
+    };
+
+}
+
+
+
+
+
+
+// The payload is the command byte followed by the monotonic accept time, for the access log
+int Server::send_fd(int socket, int fd, char command, uint64_t accepted) {
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+    char buf[CMSG_SPACE(sizeof(fd))];
+    memset(buf, 0, sizeof(buf));
+    struct iovec io[2] = { { .iov_base = &command, .iov_len = 1 }, { .iov_base = &accepted, .iov_len = sizeof(accepted) } };
+
+    msg.msg_iov = io;
+    msg.msg_iovlen = 2;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+    *((int *) CMSG_DATA(cmsg)) = fd;
+
+    return sendmsg(socket, &msg, 0);
+}
+
+int Server::recv_fd(int socket, char *command, uint64_t *accepted) {
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+    char buf[CMSG_SPACE(sizeof(int))];
+    char data;
+    uint64_t stamp = 0;
+    struct iovec io[2] = { { .iov_base = &data, .iov_len = 1 }, { .iov_base = &stamp, .iov_len = sizeof(stamp) } };
+
+    msg.msg_iov = io;
+    msg.msg_iovlen = 2;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+
+    ssize_t received = recvmsg(socket, &msg, 0);
+    if (received < 0) {
+        return -1;
+    }
+    if (received == 0) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        errno = EBADMSG;
+        return -1;
+    }
+    if (command) *command = data;
+    if (accepted) *accepted = stamp;
     return *((int *) CMSG_DATA(cmsg));
 }
@@ -0,0 +1,304 @@
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/core_names.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+
+#define TICKET_KEYS         2       // current key plus the previous one, still accepted for decryption
+#define SESSION_ID_MAX      32
+#define SESSION_DER_MAX     1024    // larger sessions are not cached, the client just does a full handshake
+
+struct TicketKey
+{
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+};
+
+struct SessionEntry
+{
+    time_t expires;         // 0 when the slot is empty
+    uint32_t id_len;
+    uint32_t der_len;
+    unsigned char id[SESSION_ID_MAX];
+    unsigned char der[SESSION_DER_MAX];
+};
+
+// Handshake counters summed over every worker, read by the master for the periodic report
+struct TlsStats
+{
+    std::atomic<uint64_t> full;
+    std::atomic<uint64_t> resumed;
+    std::atomic<uint64_t> full_ns;
+    std::atomic<uint64_t> resumed_ns;
+    std::atomic<uint64_t> cache_hits;       // session ID lookups, TLS 1.2 clients without tickets
+    std::atomic<uint64_t> cache_misses;
+};
+
+// Ticket keys and the session ID table live in one MAP_SHARED region created before fork,
+// so a client can resume on any worker no matter which one issued its session
+struct SessionRegion
+{
+    pthread_mutex_t lock;
+    TicketKey keys[TICKET_KEYS];    // keys[0] encrypts new tickets
+    int key_count;
+    TlsStats stats;
+    uint32_t entry_count;
+    SessionEntry entries[];
+};
+
+class SessionCache
+{
+public:
+    bool create(SSL_CTX *ctx, uint32_t entries, long lifetime);
+    void rotate_keys();
+    void record_handshake(bool resumed, uint64_t ns);
+    std::string report();
+    const TlsStats *stats() const { return region_ ? &region_->stats : nullptr; }
+
+private:
+    SessionRegion *region_ = nullptr;
+    uint64_t reported_ = 0;         // handshakes already covered by the last report, master only
+
+    void lock();
+    void unlock();
+    SessionEntry *slot(const unsigned char *id, unsigned int length);
+
+    static SessionCache *from(SSL_CTX *ctx) { return (SessionCache*)SSL_CTX_get_app_data(ctx); }
+    static int ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv, EVP_CIPHER_CTX *cipher,
+                             EVP_MAC_CTX *mac, int encrypt);
+    static int new_session_cb(SSL *ssl, SSL_SESSION *session);
+    static SSL_SESSION *get_session_cb(SSL *ssl, const unsigned char *id, int length, int *copy);
+    static void remove_session_cb(SSL_CTX *ctx, SSL_SESSION *session);
+};
+
+bool SessionCache::create(SSL_CTX *ctx, uint32_t entries, long lifetime)
+{
+    size_t total = sizeof(SessionRegion) + sizeof(SessionEntry) * entries;
+    void *memory = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        perror("mmap session cache");
+        return false;
+    }
+    // Anonymous mappings start zeroed, that is every slot empty and every counter at 0
+    region_ = (SessionRegion*)memory;
+    region_->entry_count = entries;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&region_->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    rotate_keys();
+
+    SSL_CTX_set_app_data(ctx, this);
+    SSL_CTX_set_timeout(ctx, lifetime);
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+    if (entries > 0)
+    {
+        // The built-in cache is per process, workers would only ever hit their own sessions
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+        SSL_CTX_sess_set_get_cb(ctx, get_session_cb);
+        SSL_CTX_sess_set_remove_cb(ctx, remove_session_cb);
+    }
+    else
+    {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+    return true;
+}
+
+void SessionCache::lock()
+{
+    if (pthread_mutex_lock(&region_->lock) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&region_->lock);
+    }
+}
+
+void SessionCache::unlock()
+{
+    pthread_mutex_unlock(&region_->lock);
+}
+
+// Called by the master every lifetime, tickets sealed with the old key keep working for one more period
+void SessionCache::rotate_keys()
+{
+    TicketKey key;
+    if (RAND_bytes(key.name, sizeof(key.name)) != 1 || RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1 ||
+        RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1)
+    {
+        fprintf(stderr, "Ticket key rotation failed, keeping the current key\n");
+        return;
+    }
+
+    lock();
+    memmove(&region_->keys[1], &region_->keys[0], sizeof(TicketKey) * (TICKET_KEYS - 1));
+    region_->keys[0] = key;
+    if (region_->key_count < TICKET_KEYS) region_->key_count++;
+    unlock();
+    OPENSSL_cleanse(&key, sizeof(key));
+}
+
+int SessionCache::ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv, EVP_CIPHER_CTX *cipher,
+                                EVP_MAC_CTX *mac, int encrypt)
+{
+    SessionCache *cache = from(SSL_get_SSL_CTX(ssl));
+    SessionRegion *region = cache->region_;
+
+    // Copy the key out so the crypto setup runs without the lock held
+    TicketKey key;
+    int index = -1;
+    cache->lock();
+    for (int i = 0; i < region->key_count; i++)
+    {
+        if (encrypt ? i == 0 : memcmp(key_name, region->keys[i].name, 16) == 0)
+        {
+            key = region->keys[i];
+            index = i;
+            break;
+        }
+    }
+    cache->unlock();
+    // Unknown or rotated out key, fall back to a full handshake
+    if (index < 0) return 0;
+
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, sizeof(key.hmac_key));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char*)"SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+
+    int ret;
+    if (encrypt)
+    {
+        memcpy(key_name, key.name, 16);
+        ret = RAND_bytes(iv, 16) == 1 &&
+              EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes_key, iv) == 1 &&
+              EVP_MAC_CTX_set_params(mac, params) == 1 ? 1 : -1;
+    }
+    else
+    {
+        // 2 asks OpenSSL to issue a fresh ticket under the current key. TLS 1.3 clients use a ticket only once
+        // and a resumed handshake sends no new one unless asked, so those always get a replacement
+        bool renew = index != 0 || SSL_version(ssl) >= TLS1_3_VERSION;
+        ret = EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes_key, iv) == 1 &&
+              EVP_MAC_CTX_set_params(mac, params) == 1 ? (renew ? 2 : 1) : -1;
+    }
+    OPENSSL_cleanse(&key, sizeof(key));
+    return ret;
+}
+
+// Direct mapped, a new session simply replaces whatever hashed to the same slot
+SessionEntry *SessionCache::slot(const unsigned char *id, unsigned int length)
+{
+    uint32_t hash = 2166136261u;
+    for (unsigned int i = 0; i < length; i++)
+    {
+        hash ^= id[i];
+        hash *= 16777619u;
+    }
+    return &region_->entries[hash % region_->entry_count];
+}
+
+int SessionCache::new_session_cb(SSL *ssl, SSL_SESSION *session)
+{
+    SessionCache *cache = from(SSL_get_SSL_CTX(ssl));
+    unsigned int id_len;
+    const unsigned char *id = SSL_SESSION_get_id(session, &id_len);
+    int der_len = i2d_SSL_SESSION(session, NULL);
+    if (id_len == 0 || id_len > SESSION_ID_MAX || der_len <= 0 || der_len > SESSION_DER_MAX) return 0;
+
+    unsigned char der[SESSION_DER_MAX];
+    unsigned char *end = der;
+    i2d_SSL_SESSION(session, &end);
+
+    cache->lock();
+    SessionEntry *entry = cache->slot(id, id_len);
+    entry->expires = SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+    entry->id_len = id_len;
+    entry->der_len = der_len;
+    memcpy(entry->id, id, id_len);
+    memcpy(entry->der, der, der_len);
+    cache->unlock();
+    OPENSSL_cleanse(der, der_len);
+    // We keep a serialized copy, not a reference to the session
+    return 0;
+}
+
+SSL_SESSION *SessionCache::get_session_cb(SSL *ssl, const unsigned char *id, int length, int *copy)
+{
+    SessionCache *cache = from(SSL_get_SSL_CTX(ssl));
+    *copy = 0;
+    if (length <= 0 || length > SESSION_ID_MAX) return NULL;
+
+    unsigned char der[SESSION_DER_MAX];
+    uint32_t der_len = 0;
+    cache->lock();
+    SessionEntry *entry = cache->slot(id, length);
+    if (entry->expires > time(NULL) && entry->id_len == (uint32_t)length && memcmp(entry->id, id, length) == 0)
+    {
+        der_len = entry->der_len;
+        memcpy(der, entry->der, der_len);
+    }
+    cache->unlock();
+
+    TlsStats &stats = cache->region_->stats;
+    const unsigned char *start = der;
+    SSL_SESSION *session = der_len ? d2i_SSL_SESSION(NULL, &start, der_len) : NULL;
+    (session ? stats.cache_hits : stats.cache_misses).fetch_add(1, std::memory_order_relaxed);
+    OPENSSL_cleanse(der, der_len);
+    return session;
+}
+
+void SessionCache::remove_session_cb(SSL_CTX *ctx, SSL_SESSION *session)
+{
+    SessionCache *cache = from(ctx);
+    unsigned int id_len;
+    const unsigned char *id = SSL_SESSION_get_id(session, &id_len);
+    if (id_len == 0 || id_len > SESSION_ID_MAX) return;
+
+    cache->lock();
+    SessionEntry *entry = cache->slot(id, id_len);
+    if (entry->id_len == id_len && memcmp(entry->id, id, id_len) == 0) entry->expires = 0;
+    cache->unlock();
+}
+
+void SessionCache::record_handshake(bool resumed, uint64_t ns)
+{
+    if (!region_) return;
+    TlsStats &stats = region_->stats;
+    (resumed ? stats.resumed : stats.full).fetch_add(1, std::memory_order_relaxed);
+    (resumed ? stats.resumed_ns : stats.full_ns).fetch_add(ns, std::memory_order_relaxed);
+}
+
+// One line per report interval for the log, empty while no handshakes happened
+std::string SessionCache::report()
+{
+    if (!region_) return "";
+    TlsStats &stats = region_->stats;
+    uint64_t full = stats.full.load(std::memory_order_relaxed);
+    uint64_t resumed = stats.resumed.load(std::memory_order_relaxed);
+    if (full + resumed == reported_) return "";
+    reported_ = full + resumed;
+
+    uint64_t hits = stats.cache_hits.load(std::memory_order_relaxed);
+    uint64_t misses = stats.cache_misses.load(std::memory_order_relaxed);
+    char line[160];
+    snprintf(line, sizeof(line), "TLS: %lu handshakes, %.1f%% resumed, full %.2f ms, resumed %.2f ms, session ID cache %lu/%lu hits",
+             (unsigned long)(full + resumed), 100.0 * resumed / (full + resumed),
+             full ? stats.full_ns.load(std::memory_order_relaxed) / 1e6 / full : 0.0,
+             resumed ? stats.resumed_ns.load(std::memory_order_relaxed) / 1e6 / resumed : 0.0,
+             (unsigned long)hits, (unsigned long)(hits + misses));
+    return line;
+}
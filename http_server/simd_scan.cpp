@@ -0,0 +1,149 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Byte classification kernels for the request parser. Each returns the index of the
+// first byte that does not belong to the class, or length when all of them do
+struct ScanKernels {
+    const char *name;
+    size_t (*ctl)(const char *data, size_t length);     // stops at CTL bytes other than HTAB (CR, LF, ...)
+    size_t (*token)(const char *data, size_t length);   // stops at the first non tchar byte (':', SP, ...)
+};
+
+static inline bool is_ctl_byte(unsigned char c)
+{
+    return (c < 0x20 && c != '\t') || c == 0x7f;
+}
+
+static inline bool is_separator_byte(unsigned char c)
+{
+    return c <= 0x20 || c >= 0x7f || c == '"' || c == '(' || c == ')' || c == ',' || c == '/' ||
+           (c >= ':' && c <= '@') || (c >= '[' && c <= ']') || c == '{' || c == '}';
+}
+
+static size_t scan_ctl_scalar(const char *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        if (is_ctl_byte(data[i])) return i;
+    }
+    return length;
+}
+
+static size_t scan_token_scalar(const char *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        if (is_separator_byte(data[i])) return i;
+    }
+    return length;
+}
+
+#if defined(__x86_64__)
+
+// lo <= b <= hi on unsigned bytes
+#define SSE2_IN_RANGE(b, lo, hi) \
+    _mm_cmpeq_epi8(_mm_min_epu8(_mm_max_epu8(b, _mm_set1_epi8(lo)), _mm_set1_epi8(hi)), b)
+#define AVX2_IN_RANGE(b, lo, hi) \
+    _mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_max_epu8(b, _mm256_set1_epi8(lo)), _mm256_set1_epi8(hi)), b)
+
+// Lane masks of the bytes that end a scan, inlined into both encodings so the AVX2
+// kernels never call legacy SSE code (the transition stalls cost more than the scan)
+static inline int ctl_mask16(__m128i b)
+{
+    __m128i low = _mm_cmpeq_epi8(_mm_min_epu8(b, _mm_set1_epi8(0x1f)), b);
+    __m128i bad = _mm_or_si128(_mm_andnot_si128(_mm_cmpeq_epi8(b, _mm_set1_epi8('\t')), low),
+                               _mm_cmpeq_epi8(b, _mm_set1_epi8(0x7f)));
+    return _mm_movemask_epi8(bad);
+}
+
+static inline int token_mask16(__m128i b)
+{
+    __m128i bad = _mm_xor_si128(SSE2_IN_RANGE(b, 0x21, 0x7e), _mm_set1_epi8(-1));
+    bad = _mm_or_si128(bad, SSE2_IN_RANGE(b, ':', '@'));
+    bad = _mm_or_si128(bad, SSE2_IN_RANGE(b, '[', ']'));
+    bad = _mm_or_si128(bad, SSE2_IN_RANGE(b, '(', ')'));
+    bad = _mm_or_si128(bad, _mm_cmpeq_epi8(b, _mm_set1_epi8('"')));
+    bad = _mm_or_si128(bad, _mm_cmpeq_epi8(b, _mm_set1_epi8(',')));
+    bad = _mm_or_si128(bad, _mm_cmpeq_epi8(b, _mm_set1_epi8('/')));
+    bad = _mm_or_si128(bad, _mm_cmpeq_epi8(b, _mm_set1_epi8('{')));
+    bad = _mm_or_si128(bad, _mm_cmpeq_epi8(b, _mm_set1_epi8('}')));
+    return _mm_movemask_epi8(bad);
+}
+
+#define SCAN16(mask16, scalar)                                                  \
+    for (; i + 16 <= length; i += 16) {                                         \
+        int mask = mask16(_mm_loadu_si128((const __m128i*)(data + i)));         \
+        if (mask) return i + __builtin_ctz(mask);                               \
+    }                                                                           \
+    return i + scalar(data + i, length - i)
+
+static size_t scan_ctl_sse2(const char *data, size_t length)
+{
+    size_t i = 0;
+    SCAN16(ctl_mask16, scan_ctl_scalar);
+}
+
+static size_t scan_token_sse2(const char *data, size_t length)
+{
+    size_t i = 0;
+    SCAN16(token_mask16, scan_token_scalar);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_ctl_avx2(const char *data, size_t length)
+{
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i low = _mm256_cmpeq_epi8(_mm256_min_epu8(b, _mm256_set1_epi8(0x1f)), b);
+        __m256i bad = _mm256_or_si256(_mm256_andnot_si256(_mm256_cmpeq_epi8(b, _mm256_set1_epi8('\t')), low),
+                                      _mm256_cmpeq_epi8(b, _mm256_set1_epi8(0x7f)));
+        uint32_t mask = _mm256_movemask_epi8(bad);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    SCAN16(ctl_mask16, scan_ctl_scalar);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_token_avx2(const char *data, size_t length)
+{
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i bad = _mm256_xor_si256(AVX2_IN_RANGE(b, 0x21, 0x7e), _mm256_set1_epi8(-1));
+        bad = _mm256_or_si256(bad, AVX2_IN_RANGE(b, ':', '@'));
+        bad = _mm256_or_si256(bad, AVX2_IN_RANGE(b, '[', ']'));
+        bad = _mm256_or_si256(bad, AVX2_IN_RANGE(b, '(', ')'));
+        bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('"')));
+        bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(b, _mm256_set1_epi8(',')));
+        bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('/')));
+        bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('{')));
+        bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(b, _mm256_set1_epi8('}')));
+        uint32_t mask = _mm256_movemask_epi8(bad);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    SCAN16(token_mask16, scan_token_scalar);
+}
+
+static const ScanKernels sse2_kernels = { "sse2", scan_ctl_sse2, scan_token_sse2 };
+static const ScanKernels avx2_kernels = { "avx2", scan_ctl_avx2, scan_token_avx2 };
+
+#endif
+
+static const ScanKernels scalar_kernels = { "scalar", scan_ctl_scalar, scan_token_scalar };
+
+// Picked once per process from CPUID, SSE2 is always there on x86-64
+static const ScanKernels *select_scan_kernels()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return &avx2_kernels;
+    return &sse2_kernels;
+#else
+    return &scalar_kernels;
+#endif
+}
+
+static const ScanKernels *scan_kernels = select_scan_kernels();
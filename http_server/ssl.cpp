@@ -16,19 +16,17 @@ SSLclass();
 
 SSL* SSLclass::create_ssl(SSL_CTX *ctx, int new_socket)
 {
+    // The handshake itself is driven by the worker's event loop (SSL_do_handshake)
     SSL *ssl;
     ssl = SSL_new(ctx);
-    SSL_set_fd(ssl, new_socket);
-    if (SSL_accept(ssl) <= 0) 
+    if (!ssl) 
     {
-        fprintf(stderr, "SSL handshake failed.\n");
         ERR_print_errors_fp(stderr);
-        SSL_shutdown(ssl);
-        SSL_free(ssl);
         close(new_socket);
         return NULL;
     }
-    printf("SSL handshake successful.\n");
+    SSL_set_fd(ssl, new_socket);
+    SSL_set_accept_state(ssl);
     return ssl;
 }
 
@@ -61,6 +59,12 @@ void SSLclass::configure_context(SSL_CTX *ctx)
         ERR_print_errors_fp(stderr);
         exit(EXIT_FAILURE);
     }
+
+    // Sockets are non-blocking, SSL_write may be retried after WANT_WRITE
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // Let the kernel do record encryption when the tls module and cipher allow it, needed for SSL_sendfile
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
 }
 
 SSLclass::SSLclass()
@@ -0,0 +1,39 @@
+#!/bin/bash
+# A HEAD pipelined in front of a GET on one keep-alive connection. The HEAD
+# response must end with its header block so the GET's status line follows it.
+#
+# Usage: tests/head_pipeline.sh
+# Run from the http_server directory after `make`, SERVER overrides the binary.
+
+SERVER=${SERVER:-./main}
+HOST=localhost:8080
+FILE=index.html
+
+# Own session so the workers and the logger go down with the master
+setsid $SERVER > /dev/null 2>&1 &
+server_pid=$!
+sleep 1
+if ! kill -0 "$server_pid" 2> /dev/null; then
+    echo "FAIL server did not start, is $HOST in use?"
+    exit 1
+fi
+
+for path in "/$FILE" "/missing-$$"; do
+    output=$(printf 'HEAD %s HTTP/1.1\r\nHost: localhost\r\n\r\nGET %s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n' \
+                    "$path" "$path" |
+             timeout 5 openssl s_client -connect "$HOST" -quiet -ign_eof 2> /dev/null | tr -d '\r')
+
+    # The line after the first blank line has to be the second status line
+    next=$(printf '%s\n' "$output" | awk 'blank { print; exit } $0 == "" { blank = 1 }')
+    statuses=$(printf '%s\n' "$output" | grep -c '^HTTP/1.1 ')
+    if [[ "$next" != HTTP/1.1\ * || "$statuses" != 2 ]]; then
+        echo "FAIL HEAD $path: response after the HEAD header block is '$next', $statuses status lines"
+        failed=1
+    else
+        echo "ok   HEAD $path followed by GET"
+    fi
+done
+
+kill -- -"$server_pid" 2> /dev/null
+wait "$server_pid" 2> /dev/null
+exit ${failed:-0}
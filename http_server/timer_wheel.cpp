@@ -0,0 +1,95 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define TIMER_WHEEL_SLOTS   512     // power of two, one lap covers TIMER_WHEEL_SLOTS ticks
+
+// Intrusive list node embedded in whatever owns the timer
+struct TimerNode
+{
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    uint64_t expires = 0;       // tick at which the timer fires
+    void *owner = nullptr;
+};
+
+// Hashed timing wheel, O(1) schedule and cancel. Deadlines further than one lap away stay
+// in their slot and are skipped until the wheel comes around to the right tick
+class TimerWheel
+{
+public:
+    explicit TimerWheel(uint64_t tick_ms) : tick_ms_(tick_ms) {}
+    void start(uint64_t now_ms);
+    void schedule(TimerNode *node, uint64_t deadline_ms);
+    void cancel(TimerNode *node);
+    bool armed(const TimerNode *node) const { return node->prev != nullptr; }
+    size_t size() const { return count_; }
+    void advance(uint64_t now_ms, std::vector<void*>& expired);
+
+private:
+    TimerNode slots_[TIMER_WHEEL_SLOTS];    // list heads
+    uint64_t tick_ms_;
+    uint64_t current_ = 0;                  // last tick processed
+    size_t count_ = 0;
+};
+
+void TimerWheel::start(uint64_t now_ms)
+{
+    current_ = now_ms / tick_ms_;
+    count_ = 0;
+    for (TimerNode& head : slots_)
+    {
+        head.prev = head.next = &head;
+    }
+}
+
+void TimerWheel::schedule(TimerNode *node, uint64_t deadline_ms)
+{
+    cancel(node);
+    // Round up so a timer never fires before its deadline, and never into a tick already processed
+    uint64_t tick = (deadline_ms + tick_ms_ - 1) / tick_ms_;
+    if (tick <= current_) tick = current_ + 1;
+    node->expires = tick;
+
+    TimerNode *head = &slots_[tick & (TIMER_WHEEL_SLOTS - 1)];
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+    count_++;
+}
+
+void TimerWheel::cancel(TimerNode *node)
+{
+    if (!node->prev) return;
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+    count_--;
+}
+
+// Unlinks every timer due by now_ms and returns their owners
+void TimerWheel::advance(uint64_t now_ms, std::vector<void*>& expired)
+{
+    uint64_t target = now_ms / tick_ms_;
+    // After a long stall one lap visits every slot, later ticks would only revisit them
+    uint64_t first = current_ + 1;
+    if (target >= first + TIMER_WHEEL_SLOTS) first = target - TIMER_WHEEL_SLOTS + 1;
+
+    for (uint64_t tick = first; tick <= target && count_ > 0; tick++)
+    {
+        TimerNode *head = &slots_[tick & (TIMER_WHEEL_SLOTS - 1)];
+        TimerNode *node = head->next;
+        while (node != head)
+        {
+            TimerNode *next = node->next;
+            if (node->expires <= target)
+            {
+                cancel(node);
+                expired.push_back(node->owner);
+            }
+            node = next;
+        }
+    }
+    if (target > current_) current_ = target;
+}